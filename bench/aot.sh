@@ -0,0 +1,40 @@
+#!/bin/sh
+# Compare interpreted and lispyc-compiled execution of the same script.
+# Usage: bench/aot.sh [forms]   (run from the repository root after build.sh)
+set -e
+
+FORMS=${1:-1000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# A straight-line script of arithmetic and list forms over a few variables
+{
+  echo "(def {a b c} 3 7 11)"
+  i=0
+  while [ $i -lt "$FORMS" ]; do
+    echo "(+ (* a b $i) (- c a) (/ (* b 100) c) (* (+ a 1) (+ b 2) (- c 4)))"
+    echo "(head (tail (join {$i} (list a b c))))"
+    echo "(def {a} (+ (/ (* a 7) 5) 1))"
+    echo "(def {a} (- a (* (/ a 8) 8)))"
+    i=$((i + 1))
+  done
+} > "$DIR/bench.lsp"
+
+./lispyc -o "$DIR/bench" "$DIR/bench.lsp"
+
+now() { date +%s%N; }
+
+t0=$(now)
+./parsing "$DIR/bench.lsp" > "$DIR/interpreted.out"
+t1=$(now)
+"$DIR/bench" > "$DIR/compiled.out"
+t2=$(now)
+
+cmp -s "$DIR/interpreted.out" "$DIR/compiled.out" || {
+  echo "outputs differ" >&2
+  exit 1
+}
+
+echo "forms:       $((FORMS * 4))"
+echo "interpreted: $(((t1 - t0) / 1000000)) ms"
+echo "compiled:    $(((t2 - t1) / 1000000)) ms"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Time futures that look up many global definitions, on one thread and on
+# several. Each future reads the caller's bindings where they are, instead
+# of a copy of the whole environment.
+# Usage: bench/envshare.sh [futures] [threads]   (run from the repository root after build.sh)
+set -e
+
+FUTURES=${1:-200}
+THREADS=${2:-4}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Globals, a large table among them, then futures summing the small ones
+{
+  echo "(def {table} {$(seq -s ' ' 1 20000)})"
+  names=""
+  i=0
+  while [ $i -lt 200 ]; do
+    echo "(def {g$i} $i)"
+    names="$names g$i"
+    i=$((i + 1))
+  done
+  echo "(def {fs} {})"
+  i=0
+  while [ $i -lt "$FUTURES" ]; do
+    echo "(def {fs} (join fs (list (future {+$names$names$names}))))"
+    i=$((i + 1))
+  done
+  echo "(reduce + (eval (join {await} fs)))"
+} > "$DIR/bench.lsp"
+
+now() { date +%s%N; }
+
+t0=$(now)
+LISPY_THREADS=1 ./parsing "$DIR/bench.lsp" | tail -n 1 > "$DIR/one.out"
+t1=$(now)
+LISPY_THREADS=$THREADS ./parsing "$DIR/bench.lsp" | tail -n 1 > "$DIR/many.out"
+t2=$(now)
+
+cmp -s "$DIR/one.out" "$DIR/many.out" || {
+  echo "outputs differ" >&2
+  exit 1
+}
+
+echo "futures:        $FUTURES"
+echo "lookups:        $((FUTURES * 600))"
+echo "1 thread:       $(((t1 - t0) / 1000000)) ms"
+echo "$THREADS threads:      $(((t2 - t1) / 1000000)) ms"
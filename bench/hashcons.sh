@@ -0,0 +1,38 @@
+#!/bin/sh
+# Report the memory hash-consing saves on a script of repeated literals.
+# Usage: bench/hashcons.sh [forms]   (run from the repository root after build.sh)
+set -e
+
+FORMS=${1:-1000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Configuration tables and constant lists repeated through a generated script
+{
+  i=0
+  while [ $i -lt "$FORMS" ]; do
+    echo "(def {cfg} {{host \"localhost\"} {port 8080} {retries 3} {tags {web api internal}}})"
+    echo "(head (tail {{1 2 3} {4 5 6} {7 8 9}}))"
+    echo "(join {alpha beta gamma} {$((i % 10))})"
+    i=$((i + 1))
+  done
+  echo "(hashcons 0)"
+} > "$DIR/bench.lsp"
+
+./parsing "$DIR/bench.lsp" | sed '$d' > "$DIR/plain.out"
+./parsing --hashcons "$DIR/bench.lsp" > "$DIR/shared.out"
+stats=$(tail -n 1 "$DIR/shared.out")
+sed -i '$d' "$DIR/shared.out"
+
+cmp -s "$DIR/plain.out" "$DIR/shared.out" || {
+  echo "outputs differ" >&2
+  exit 1
+}
+
+# { literals shared bytes-unshared bytes-shared }
+set -- $stats
+echo "literals:         $2"
+echo "already shared:   $3"
+echo "bytes unshared:   $4"
+echo "bytes shared:     $5"
+echo "saved:            $(($4 - $5)) bytes ($((($4 - $5) * 100 / $4))%)"
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Time a long generated script read up front and read by a pipelined
+# reader thread, to the first result and to the end.
+# Usage: bench/pipeline.sh [forms]   (run from the repository root after build.sh)
+set -e
+
+FORMS=${1:-3000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$FORMS" ]; do
+  echo "(def {l$i} {$(seq -s ' ' 1 50) {a b c} \"s$i\"})"
+  echo "(+ $i (eval (join {+} l$i)))"
+  i=$((i + 1))
+done > "$DIR/bench.lsp"
+
+now() { date +%s%N; }
+
+for mode in "" --pipeline; do
+  t0=$(now)
+  ./parsing $mode "$DIR/bench.lsp" > "$DIR/out$mode"
+  t1=$(now)
+  ./parsing $mode "$DIR/bench.lsp" | head -n 1 > /dev/null
+  t2=$(now)
+  echo "${mode:-up front}: first result $(((t2 - t1) / 1000000)) ms, all $(((t1 - t0) / 1000000)) ms"
+done
+
+cmp -s "$DIR/out" "$DIR/out--pipeline" || {
+  echo "outputs differ" >&2
+  exit 1
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Histogram the latency of requests with large results, freed inline and
+# then in the background while the client pauses as a user at a prompt
+# would.
+# Usage: bench/reclaim.sh [requests] [size]   (run from the repository root after build.sh)
+set -e
+
+REQUESTS=${1:-50}
+SIZE=${2:-131072}
+DIR=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# Each request doubles a list up to SIZE and returns a list per element
+{
+  echo "(def {r} {1})"
+  n=1
+  while [ $n -lt "$SIZE" ]; do
+    echo "(def {r} (join r r))"
+    n=$((n * 2))
+  done
+  echo "(map list r)"
+} > "$DIR/req.lsp"
+
+for reclaim in 0 1; do
+  if [ $reclaim = 0 ]; then
+    echo "freed inline:"
+  else
+    echo "freed in the background:"
+  fi
+  LISPY_RECLAIM=$((reclaim * 4096)) LISPY_THREADS=1 \
+    ./parsing --server "$DIR/sock$reclaim" 2>/dev/null &
+  SERVER=$!
+  while [ ! -S "$DIR/sock$reclaim" ]; do sleep 0.1; done
+  ./lispyclient -n "$REQUESTS" -w 50 "$DIR/sock$reclaim" "$DIR/req.lsp" 2>&1 \
+    >/dev/null | grep -v '^server'
+  kill $SERVER
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Time small requests run by starting ./parsing for each one against the
+# same requests sent to a server, which builds its grammar and builtins once.
+# Usage: bench/server.sh [requests]   (run from the repository root after build.sh)
+set -e
+
+REQUESTS=${1:-200}
+DIR=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+echo "(reduce + {$(seq -s ' ' 1 100)})" > "$DIR/req.lsp"
+
+./parsing --server "$DIR/sock" 2>/dev/null &
+SERVER=$!
+while [ ! -S "$DIR/sock" ]; do sleep 0.1; done
+
+now() { date +%s%N; }
+
+t0=$(now)
+i=0
+while [ $i -lt "$REQUESTS" ]; do
+  ./parsing "$DIR/req.lsp" >> "$DIR/fork.out"
+  i=$((i + 1))
+done
+t1=$(now)
+./lispyclient -n "$REQUESTS" "$DIR/sock" "$DIR/req.lsp" > "$DIR/server.out" 2>/dev/null
+t2=$(now)
+
+cmp -s "$DIR/fork.out" "$DIR/server.out" || {
+  echo "outputs differ" >&2
+  exit 1
+}
+
+echo "requests:       $REQUESTS"
+echo "per process:    $(((t1 - t0) / REQUESTS / 1000)) us"
+echo "server:         $(((t2 - t1) / REQUESTS / 1000)) us"
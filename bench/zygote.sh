@@ -0,0 +1,48 @@
+#!/bin/sh
+# Time short jobs started cold, each building the grammar and builtins and
+# loading a prelude, against jobs forked from a zygote that did so once.
+# Usage: bench/zygote.sh [jobs]   (run from the repository root after build.sh)
+set -e
+
+JOBS=${1:-100}
+DIR=$(mktemp -d)
+trap 'kill $ZYGOTE 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# A prelude of a few hundred definitions, and a job that uses them
+i=0
+while [ $i -lt 300 ]; do
+  echo "(def {p$i} {$(seq -s ' ' $i $((i + 20)))})"
+  i=$((i + 1))
+done > "$DIR/prelude.lsp"
+echo "(+ (eval (join {+} p7)) 1)" > "$DIR/job.lsp"
+cat "$DIR/prelude.lsp" "$DIR/job.lsp" > "$DIR/cold.lsp"
+
+./parsing --zygote "$DIR/sock" "$DIR/prelude.lsp" 2>/dev/null &
+ZYGOTE=$!
+while [ ! -S "$DIR/sock" ]; do sleep 0.1; done
+
+now() { date +%s%N; }
+
+# Time to the job's result: the last line of a cold run, the only one here
+t0=$(now)
+i=0
+while [ $i -lt "$JOBS" ]; do
+  ./parsing "$DIR/cold.lsp" | tail -n 1 > "$DIR/cold.out"
+  i=$((i + 1))
+done
+t1=$(now)
+i=0
+while [ $i -lt "$JOBS" ]; do
+  ./lispyclient "$DIR/sock" "$DIR/job.lsp" > "$DIR/zygote.out" 2>/dev/null
+  i=$((i + 1))
+done
+t2=$(now)
+
+cmp -s "$DIR/cold.out" "$DIR/zygote.out" || {
+  echo "outputs differ" >&2
+  exit 1
+}
+
+echo "jobs:           $JOBS"
+echo "cold start:     $(((t1 - t0) / JOBS / 1000)) us to first eval"
+echo "zygote fork:    $(((t2 - t1) / JOBS / 1000)) us to first eval"
@@ -1 +1,3 @@
-gcc -std=c99 -Wall -o parsing parsing.c mpc.c -lm -ledit
+gcc -std=c99 -Wall -O2 -o parsing parsing.c mpc.c -lm -lpthread -ledit
+gcc -std=c99 -Wall -DLISPY_SRC_DIR="\"$(pwd)\"" -o lispyc lispyc.c mpc.c -lm -lpthread
+gcc -std=c99 -Wall -O2 -o lispyclient lispyclient.c
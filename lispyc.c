@@ -0,0 +1,723 @@
+/* Ahead-of-time compiler from Lispy source to C
+ *
+ * lispyc reads a script through the same grammar and lval_read as the
+ * interpreter, and emits a C program that evaluates each top-level form
+ * and prints its result, exactly as `parsing script.lsp` would. Calls to
+ * builtins are made directly, arithmetic over numbers and variables is
+ * compiled to unboxed C with a fallback to the boxed path, and variable
+ * lookups cache their environment slot.
+ *
+ * The generated program includes this file with LISPYC_RUNTIME defined to
+ * get the interpreter and the helpers it calls, and is linked with mpc.c.
+ */
+#define LISPY_NO_MAIN
+#include "parsing.c"
+#include <limits.h>
+
+/* Runtime support called by generated code */
+
+/* Each variable reference caches the slot it was last found in */
+typedef struct lc_site {
+  char *key;
+  int slot;
+} lc_site;
+
+/* A slot only ever holds bindings of one symbol, so it is checked by the
+ * identity of the binding's string */
+lval *lc_peek(lenv *e, lc_site *s, char *sym) {
+  lenv_table *t = e->tab;
+  if (s->key && s->slot < t->count && t->syms[s->slot] == s->key) {
+    return t->binds[s->slot]->val;
+  }
+  for (int i = 0; i < t->count; i++) {
+    if (strcmp(t->syms[i], sym) == 0) {
+      s->key = t->syms[i];
+      s->slot = i;
+      return t->binds[i]->val;
+    }
+  }
+  return e->parent ? lenv_peek(e, sym) : NULL;
+}
+
+lval *lc_get(lenv *e, lc_site *s, char *sym) {
+  /* Values read from a shared environment are cloned, as lenv_get does */
+  if (e->parent) {
+    lval *k = lsym(sym);
+    lval *x = lenv_get(e, k);
+    lval_del(k);
+    return x;
+  }
+  lval *x = lc_peek(e, s, sym);
+  return x ? lval_copy(x) : lerr("unbound symbol!");
+}
+
+/* Load a variable for the unboxed path, failing unless it is a Number */
+int lc_num(lenv *e, lc_site *s, char *sym, long *out) {
+  lval *x = lc_peek(e, s, sym);
+  if (!x || x->type != LVAL_NUM) {
+    return 0;
+  }
+  *out = x->num;
+  return 1;
+}
+
+/* Call a builtin on evaluated arguments, as lval_apply would */
+lval *lc_call(lenv *e, lbuiltin f, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_ERR) {
+      return lval_take(a, i);
+    }
+  }
+  lval_thaw_args(a);
+  return f(e, a);
+}
+
+#ifndef LISPYC_RUNTIME
+
+#ifndef LISPY_SRC_DIR
+#define LISPY_SRC_DIR "."
+#endif
+
+/* Growable output buffer */
+typedef struct lcbuf {
+  char *s;
+  size_t len;
+  size_t cap;
+} lcbuf;
+
+void lcbuf_printf(lcbuf *b, const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+
+  if (b->len + n + 1 > b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    while (b->len + n + 1 > b->cap) {
+      b->cap *= 2;
+    }
+    b->s = realloc(b->s, b->cap);
+  }
+  va_start(va, fmt);
+  vsnprintf(b->s + b->len, n + 1, fmt, va);
+  va_end(va);
+  b->len += n;
+}
+
+void lcbuf_free(lcbuf *b) {
+  free(b->s);
+  b->s = NULL;
+  b->len = b->cap = 0;
+}
+
+/* Builtins that can be called directly when never rebound */
+static const char *lc_builtins[][2] = {
+    {"list", "builtin_list"}, {"head", "builtin_head"},
+    {"tail", "builtin_tail"}, {"eval", "builtin_eval"},
+    {"join", "builtin_join"}, {"def", "builtin_def"},
+    {"defmacro", "builtin_defmacro"}, {"memo", "builtin_memo"},
+    {"memo-stats", "builtin_memo_stats"}, {"jit", "builtin_jit"},
+    {"-", "builtin_sub"}, {"+", "builtin_add"},
+    {"*", "builtin_mul"}, {"/", "builtin_div"},
+    {"array", "builtin_array"}, {"tolist", "builtin_tolist"},
+    {"shape", "builtin_shape"}, {"reshape", "builtin_reshape"},
+    {"transpose", "builtin_transpose"}, {"matmul", "builtin_matmul"},
+    {"sum", "builtin_sum"}, {"prod", "builtin_prod"},
+    {"min", "builtin_min"}, {"max", "builtin_max"},
+    {"strlen", "builtin_strlen"}, {"concat", "builtin_concat"},
+    {"substr", "builtin_substr"}, {"search", "builtin_search"},
+    {"split", "builtin_split"}, {"dict", "builtin_dict"},
+    {"pdict", "builtin_pdict"}, {"get", "builtin_get"},
+    {"put", "builtin_put"}, {"remove", "builtin_remove"},
+    {"keys", "builtin_keys"}, {"size", "builtin_size"},
+    {"omap", "builtin_omap"}, {"oset", "builtin_oset"},
+    {"range", "builtin_range"}, {"sort", "builtin_sort"},
+    {"sort-stable", "builtin_sort_stable"}, {"typeof", "builtin_typeof"},
+    {"bitset", "builtin_bitset"}, {"members", "builtin_members"},
+    {"contains", "builtin_contains"}, {"popcount", "builtin_popcount"},
+    {"union", "builtin_union"}, {"intersect", "builtin_intersect"},
+    {"difference", "builtin_difference"}, {"hashcons", "builtin_hashcons"},
+    {"map", "builtin_map"}, {"reduce", "builtin_reduce"},
+    {"pmap", "builtin_pmap"}, {"preduce", "builtin_preduce"},
+    {"future", "builtin_future"}, {"touch", "builtin_touch"},
+    {"await", "builtin_await"}, {"cancel", "builtin_cancel"},
+    {"spawn", "builtin_spawn"}, {"chan", "builtin_chan"},
+    {"send", "builtin_send"}, {"recv", "builtin_recv"},
+    {"select", "builtin_select"}, {"close", "builtin_close"},
+    {"parargs", "builtin_parargs"},
+};
+
+typedef struct lcomp {
+  /* Static declarations and helper functions, emitted before the forms */
+  lcbuf decls;
+  /* Functions building the Q-expression constants */
+  lcbuf init;
+  int nconsts;
+  int nsites;
+  int nhelpers;
+  /* Builtins and macros as the program sees them at compile time */
+  lenv *env;
+  /* Symbols appearing in any Q-expression, which 'def' may rebind */
+  lenv *quoted;
+  /* As above, excluding the arguments of top-level defmacro forms */
+  lenv *data;
+  /* Set when macros are used in a way that must be expanded at runtime */
+  int interpret;
+} lcomp;
+
+/* Per-function emission state */
+typedef struct lcfn {
+  lcbuf body;
+  int ntemps;
+} lcfn;
+
+int lc_is_defmacro(lval *v) {
+  return v->type == LVAL_SEXPR && v->count == 4 &&
+         v->cell[0]->type == LVAL_SYM &&
+         strcmp(v->cell[0]->sym, "defmacro") == 0;
+}
+
+/* Record a symbol that 'def' or 'defrecord' may bind at runtime */
+void lc_rebindable(lcomp *c, char *sym) {
+  lval *k = lsym(sym);
+  lenv_put(c->quoted, k, k);
+  lenv_put(c->data, k, k);
+  lval_del(k);
+}
+
+/* Record the constructor and accessors a (defrecord {name} {slots ...})
+ * call binds, whose names never appear in the source, returning 0 if its
+ * arguments are not both literal */
+int lc_scan_defrecord(lcomp *c, lval *v) {
+  if (v->count != 3 || v->cell[1]->type != LVAL_QEXPR ||
+      v->cell[2]->type != LVAL_QEXPR || v->cell[1]->nums ||
+      v->cell[2]->nums || v->cell[1]->count != 1 ||
+      v->cell[1]->cell[0]->type != LVAL_SYM) {
+    return 0;
+  }
+  char *name = v->cell[1]->cell[0]->sym;
+  lc_rebindable(c, name);
+  for (int i = 0; i < v->cell[2]->count; i++) {
+    lval *slot = v->cell[2]->cell[i];
+    if (slot->type != LVAL_SYM) {
+      continue;
+    }
+    char *sym = malloc(strlen(name) + strlen(slot->sym) + 2);
+    sprintf(sym, "%s-%s", name, slot->sym);
+    lc_rebindable(c, sym);
+    free(sym);
+  }
+  return 1;
+}
+
+int lc_is_defrecord(lval *v) {
+  return v->type == LVAL_SYM && strcmp(v->sym, "defrecord") == 0;
+}
+
+/* Record quoted symbols and any use of defmacro other than at top level */
+void lc_scan(lcomp *c, lval *v, int quoted, int data, int top) {
+  if (v->type == LVAL_SYM) {
+    if (quoted) {
+      lenv_put(c->quoted, v, v);
+      if (data) {
+        lenv_put(c->data, v, v);
+      }
+    }
+    if (strcmp(v->sym, "defmacro") == 0 && (quoted || !top)) {
+      c->interpret = 1;
+    }
+    return;
+  }
+  if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->nums) {
+    return;
+  }
+  int q = quoted || v->type == LVAL_QEXPR;
+  int macro = top && lc_is_defmacro(v);
+  for (int i = 0; i < v->count; i++) {
+    lc_scan(c, v->cell[i], q, data && !(macro && i > 0), top && i == 0);
+    /* Records whose names can't be known here are defined at runtime */
+    if (lc_is_defrecord(v->cell[i]) && (i > 0 || !lc_scan_defrecord(c, v))) {
+      c->interpret = 1;
+    }
+  }
+}
+
+/* C name of a builtin that the program can never rebind, or NULL */
+const char *lc_builtin(lcomp *c, lval *v) {
+  if (v->type != LVAL_SYM || lenv_peek(c->quoted, v->sym)) {
+    return NULL;
+  }
+  for (size_t i = 0; i < sizeof(lc_builtins) / sizeof(lc_builtins[0]); i++) {
+    if (strcmp(lc_builtins[i][0], v->sym) == 0) {
+      return lc_builtins[i][1];
+    }
+  }
+  return NULL;
+}
+
+/* Write a symbol as a C string literal */
+void lc_string(lcbuf *b, char *sym) {
+  lcbuf_printf(b, "\"");
+  for (char *p = sym; *p; p++) {
+    lcbuf_printf(b, *p == '\\' ? "\\\\" : "%c", *p);
+  }
+  lcbuf_printf(b, "\"");
+}
+
+/* Write arbitrary bytes as a C string literal */
+void lc_bytes(lcbuf *b, char *s, long len) {
+  lcbuf_printf(b, "\"");
+  for (long i = 0; i < len; i++) {
+    unsigned char ch = s[i];
+    if (ch == '\\' || ch == '"' || ch == '?' || ch < ' ' || ch > '~') {
+      lcbuf_printf(b, "\\%03o", ch);
+    } else {
+      lcbuf_printf(b, "%c", ch);
+    }
+  }
+  lcbuf_printf(b, "\"");
+}
+
+void lc_long(lcbuf *b, long n) {
+  if (n == LONG_MIN) {
+    lcbuf_printf(b, "(-%ldL - 1)", LONG_MAX);
+  } else {
+    lcbuf_printf(b, "%ldL", n);
+  }
+}
+
+/* Emit code constructing v at startup, returning the temporary's index */
+int lc_const_build(lcomp *c, lval *v, int *ntemps) {
+  int t = (*ntemps)++;
+  switch (v->type) {
+  case LVAL_NUM:
+    lcbuf_printf(&c->init, "  lval *k%d = lnum(", t);
+    lc_long(&c->init, v->num);
+    lcbuf_printf(&c->init, ");\n");
+    break;
+  case LVAL_ERR:
+    lcbuf_printf(&c->init, "  lval *k%d = lerr(\"%%s\", ", t);
+    lc_bytes(&c->init, v->err, strlen(v->err));
+    lcbuf_printf(&c->init, ");\n");
+    break;
+  case LVAL_SYM:
+    lcbuf_printf(&c->init, "  lval *k%d = lsym(", t);
+    lc_string(&c->init, v->sym);
+    lcbuf_printf(&c->init, ");\n");
+    break;
+  case LVAL_STR:
+    lcbuf_printf(&c->init, "  lval *k%d = lstrn(", t);
+    lc_bytes(&c->init, v->str, v->len);
+    lcbuf_printf(&c->init, ", %ld);\n", v->len);
+    break;
+  default:
+    lcbuf_printf(&c->init, "  lval *k%d = %s();\n", t,
+                 v->type == LVAL_QEXPR ? "lqexpr" : "lsexpr");
+    /* lval_add packs the numbers again as they are added */
+    for (int i = 0; v->nums && i < v->count; i++) {
+      lcbuf_printf(&c->init, "  lval_add(k%d, lnum(", t);
+      lc_long(&c->init, v->nums[i]);
+      lcbuf_printf(&c->init, "));\n");
+    }
+    for (int i = 0; !v->nums && i < v->count; i++) {
+      int k = lc_const_build(c, v->cell[i], ntemps);
+      lcbuf_printf(&c->init, "  lval_add(k%d, k%d);\n", t, k);
+    }
+    break;
+  }
+  return t;
+}
+
+/* Build v once at startup, returning the index into lc_const */
+int lc_const(lcomp *c, lval *v) {
+  int ntemps = 0;
+  lcbuf_printf(&c->init, "static lval *lc_init_%d(void) {\n", c->nconsts);
+  int t = lc_const_build(c, v, &ntemps);
+  lcbuf_printf(&c->init, "  return k%d;\n}\n\n", t);
+  return c->nconsts++;
+}
+
+int lc_new_site(lcomp *c) {
+  lcbuf_printf(&c->decls, "static lc_site lc_site_%d;\n", c->nsites);
+  return c->nsites++;
+}
+
+/* Is v arithmetic over numbers and symbols using never-rebound operators */
+int lc_arith(lcomp *c, lval *v, int *nsyms) {
+  if (v->type == LVAL_NUM) {
+    return 1;
+  }
+  if (v->type == LVAL_SYM) {
+    (*nsyms)++;
+    return 1;
+  }
+  if (v->type != LVAL_SEXPR || v->count < 2) {
+    return 0;
+  }
+  const char *f = lc_builtin(c, v->cell[0]);
+  if (!f || !strchr("+-*/", v->cell[0]->sym[0]) || v->cell[0]->sym[1]) {
+    return 0;
+  }
+  for (int i = 1; i < v->count; i++) {
+    if (!lc_arith(c, v->cell[i], nsyms)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int lc_var(lval **vars, int *nvars, char *sym) {
+  for (int i = 0; i < *nvars; i++) {
+    if (strcmp(vars[i]->sym, sym) == 0) {
+      return i;
+    }
+  }
+  return (*nvars)++;
+}
+
+/* Emit unboxed C for an arithmetic form, returning its variable index */
+int lc_unboxed(lcfn *fn, lval *v, lval **vars, int *nvars) {
+  int r = fn->ntemps++;
+  if (v->type == LVAL_NUM) {
+    lcbuf_printf(&fn->body, "  long r%d = ", r);
+    lc_long(&fn->body, v->num);
+    lcbuf_printf(&fn->body, ";\n");
+    return r;
+  }
+  if (v->type == LVAL_SYM) {
+    int i = lc_var(vars, nvars, v->sym);
+    vars[i] = v;
+    lcbuf_printf(&fn->body, "  long r%d = v[%d];\n", r, i);
+    return r;
+  }
+
+  char op = v->cell[0]->sym[0];
+  int x = lc_unboxed(fn, v->cell[1], vars, nvars);
+  /* Overflow wraps as in the interpreter, so it is done on unsigned */
+  if (v->count == 2 && op == '-') {
+    lcbuf_printf(&fn->body, "  long r%d = (long)(0UL - (unsigned long)r%d);\n",
+                 r, x);
+    return r;
+  }
+  lcbuf_printf(&fn->body, "  long r%d = r%d;\n", r, x);
+  for (int i = 2; i < v->count; i++) {
+    int y = lc_unboxed(fn, v->cell[i], vars, nvars);
+    if (op == '/') {
+      /* Division by zero, and by -1 which traps on LONG_MIN, are left to
+       * the boxed path */
+      lcbuf_printf(&fn->body,
+                   "  if (r%d == 0 || r%d == -1) {\n    return 0;\n  }\n", y,
+                   y);
+      lcbuf_printf(&fn->body, "  r%d /= r%d;\n", r, y);
+    } else {
+      lcbuf_printf(&fn->body,
+                   "  r%d = (long)((unsigned long)r%d %c (unsigned long)r%d);\n",
+                   r, r, op, y);
+    }
+  }
+  return r;
+}
+
+int lc_expr(lcomp *c, lcfn *fn, lval *v, int fast);
+
+/* Emit a helper function evaluating v, returning its number */
+int lc_helper(lcomp *c, lval *v, int fast) {
+  lcfn fn = {{NULL, 0, 0}, 0};
+  int t = lc_expr(c, &fn, v, fast);
+  int h = c->nhelpers++;
+  lcbuf_printf(&c->decls, "static lval *lc_fn_%d(lenv *e) {\n%s  return t%d;\n}\n\n",
+               h, fn.body.s ? fn.body.s : "", t);
+  lcbuf_free(&fn.body);
+  return h;
+}
+
+/* Emit arithmetic with an unboxed fast path, falling back to the boxed one */
+int lc_expr_arith(lcomp *c, lcfn *fn, lval *v, int nsyms) {
+  lcfn fast = {{NULL, 0, 0}, 0};
+  lval **vars = malloc(sizeof(lval *) * nsyms);
+  int nvars = 0;
+  int r = lc_unboxed(&fast, v, vars, &nvars);
+
+  int h = c->nhelpers;
+  lcbuf_printf(&c->decls,
+               "static int lc_fast_%d(const long *v, long *out) {\n%s"
+               "  *out = r%d;\n  return 1;\n}\n\n",
+               h, fast.body.s, r);
+  lcbuf_free(&fast.body);
+  lc_helper(c, v, 0);
+
+  int t = fn->ntemps++;
+  lcbuf_printf(&fn->body, "  lval *t%d = NULL;\n  {\n    long v[%d], r;\n    if (",
+               t, nvars);
+  for (int i = 0; i < nvars; i++) {
+    lcbuf_printf(&fn->body, "lc_num(e, &lc_site_%d, ", lc_new_site(c));
+    lc_string(&fn->body, vars[i]->sym);
+    lcbuf_printf(&fn->body, ", &v[%d]) &&\n        ", i);
+  }
+  lcbuf_printf(&fn->body,
+               "lc_fast_%d(v, &r)) {\n      t%d = lnum(r);\n    }\n  }\n"
+               "  if (!t%d) {\n    t%d = lc_fn_%d(e);\n  }\n",
+               h, t, t, t, h);
+  free(vars);
+  return t;
+}
+
+/* Emit statements evaluating v into a fresh temporary, returning its index */
+int lc_expr(lcomp *c, lcfn *fn, lval *v, int fast) {
+  int t;
+  switch (v->type) {
+  case LVAL_NUM:
+    t = fn->ntemps++;
+    lcbuf_printf(&fn->body, "  lval *t%d = lnum(", t);
+    lc_long(&fn->body, v->num);
+    lcbuf_printf(&fn->body, ");\n");
+    return t;
+
+  case LVAL_ERR:
+    t = fn->ntemps++;
+    lcbuf_printf(&fn->body, "  lval *t%d = lerr(\"%%s\", ", t);
+    lc_bytes(&fn->body, v->err, strlen(v->err));
+    lcbuf_printf(&fn->body, ");\n");
+    return t;
+
+  case LVAL_SYM: {
+    const char *f = lc_builtin(c, v);
+    t = fn->ntemps++;
+    if (f) {
+      lcbuf_printf(&fn->body, "  lval *t%d = lfun(%s);\n", t, f);
+    } else {
+      lcbuf_printf(&fn->body, "  lval *t%d = lc_get(e, &lc_site_%d, ", t,
+                   lc_new_site(c));
+      lc_string(&fn->body, v->sym);
+      lcbuf_printf(&fn->body, ");\n");
+    }
+    return t;
+  }
+
+  case LVAL_STR:
+  case LVAL_QEXPR:
+    t = fn->ntemps++;
+    lcbuf_printf(&fn->body, "  lval *t%d = lval_copy(lc_const[%d]);\n", t,
+                 lc_const(c, v));
+    return t;
+  }
+
+  /* Sexprs: the empty one is itself, a single one is its element */
+  if (v->count == 0) {
+    t = fn->ntemps++;
+    lcbuf_printf(&fn->body, "  lval *t%d = lsexpr();\n", t);
+    return t;
+  }
+  if (v->count == 1) {
+    return lc_expr(c, fn, v->cell[0], fast);
+  }
+
+  int nsyms = 0;
+  if (fast && lc_arith(c, v, &nsyms)) {
+    if (nsyms > 0) {
+      return lc_expr_arith(c, fn, v, nsyms);
+    }
+    /* Fold constant arithmetic now, unless it is an error */
+    lval *r = lval_eval(c->env, lval_copy(v));
+    if (r->type == LVAL_NUM) {
+      t = fn->ntemps++;
+      lcbuf_printf(&fn->body, "  lval *t%d = lnum(", t);
+      lc_long(&fn->body, r->num);
+      lcbuf_printf(&fn->body, ");\n");
+      lval_del(r);
+      return t;
+    }
+    lval_del(r);
+  }
+
+  /* Known builtins are called directly on the evaluated arguments */
+  const char *f = lc_builtin(c, v->cell[0]);
+  t = fn->ntemps++;
+  lcbuf_printf(&fn->body, "  lval *t%d = lsexpr();\n", t);
+  for (int i = f ? 1 : 0; i < v->count; i++) {
+    int x = lc_expr(c, fn, v->cell[i], fast);
+    lcbuf_printf(&fn->body, "  lval_add(t%d, t%d);\n", t, x);
+  }
+  if (f) {
+    lcbuf_printf(&fn->body, "  t%d = lc_call(e, %s, t%d);\n", t, f, t);
+  } else {
+    lcbuf_printf(&fn->body, "  t%d = lval_apply(e, t%d);\n", t, t);
+  }
+  return t;
+}
+
+/* Translate the forms of a script into a complete C program */
+void lc_program(lcomp *c, lval *forms, lcbuf *out) {
+  lcbuf main = {NULL, 0, 0};
+
+  /* Expand macros in order, defining each top-level macro as it appears */
+  for (int i = 0; i < forms->count; i++) {
+    forms->cell[i] = lval_expand(c->env, forms->cell[i]);
+    if (lc_is_defmacro(forms->cell[i])) {
+      lval_del(lval_eval(c->env, lval_copy(forms->cell[i])));
+    }
+  }
+  for (int i = 0; i < forms->count; i++) {
+    lc_scan(c, forms->cell[i], 0, 1, 1);
+  }
+  lenv_table *t = c->env->tab;
+  for (int i = 0; i < t->count; i++) {
+    if (t->binds[i]->val->type == LVAL_MACRO &&
+        lenv_peek(c->data, t->syms[i])) {
+      c->interpret = 1;
+    }
+  }
+
+  /* One function per top-level form, run in order by main */
+  for (int i = 0; i < forms->count; i++) {
+    int h;
+    if (c->interpret) {
+      /* Macros may change at runtime, so expand and evaluate as parsing does */
+      int k = lc_const(c, forms->cell[i]);
+      h = c->nhelpers++;
+      lcbuf_printf(&c->decls,
+                   "static lval *lc_fn_%d(lenv *e) {\n"
+                   "  return lval_eval(e, lval_expand(e, lval_copy(lc_const[%d])));"
+                   "\n}\n\n",
+                   h, k);
+    } else {
+      h = lc_helper(c, forms->cell[i], 1);
+    }
+    lcbuf_printf(&main, "    lc_fn_%d,\n", h);
+  }
+
+  lcbuf_printf(out, "/* Generated by lispyc */\n");
+  lcbuf_printf(out, "#define LISPYC_RUNTIME\n#include \"lispyc.c\"\n\n");
+  lcbuf_printf(out, "static lval *lc_const[%d];\n\n", c->nconsts + 1);
+  lcbuf_printf(out, "%s", c->init.s ? c->init.s : "");
+  lcbuf_printf(out, "static lval *(*lc_inits[])(void) = {\n");
+  for (int i = 0; i < c->nconsts; i++) {
+    lcbuf_printf(out, "    lc_init_%d,\n", i);
+  }
+  lcbuf_printf(out, "    NULL};\n\n");
+  lcbuf_printf(out, "%s", c->decls.s ? c->decls.s : "");
+  lcbuf_printf(out, "static lval *(*lc_forms[])(lenv *) = {\n%s    NULL};\n\n",
+               main.s ? main.s : "");
+  lcbuf_printf(out,
+               "int main(int argc, char **argv) {\n"
+               "  linterp *li = linterp_new();\n"
+               "  lenv *e = li->env;\n"
+               "  for (int i = 0; lc_inits[i]; i++) {\n"
+               "    lc_const[i] = lc_inits[i]();\n"
+               "  }\n\n"
+               "  /* Each form's temporaries live in the arena until printed */\n"
+               "  for (int i = 0; lc_forms[i]; i++) {\n"
+               "    larena_begin();\n"
+               "    lval *r = lc_forms[i](e);\n"
+               "    lval_println(r);\n"
+               "    lreclaim(r);\n"
+               "    larena_reset();\n"
+               "  }\n\n"
+               "  linterp_del(li);\n"
+               "  return 0;\n"
+               "}\n");
+  lcbuf_free(&main);
+}
+
+/* Quote a path for the shell */
+void lc_shell_path(lcbuf *b, const char *p) {
+  lcbuf_printf(b, "'");
+  for (; *p; p++) {
+    lcbuf_printf(b, *p == '\'' ? "'\\''" : "%c", *p);
+  }
+  lcbuf_printf(b, "'");
+}
+
+int main(int argc, char **argv) {
+  char *input = NULL;
+  char *output = NULL;
+  int emit_only = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0) {
+      emit_only = 1;
+    } else {
+      input = argv[i];
+    }
+  }
+  if (!input) {
+    fprintf(stderr, "usage: lispyc [-c] [-o output] script.lsp\n");
+    return 2;
+  }
+
+  /* Default the output to the script name without its extension */
+  char *dflt = NULL;
+  if (!output) {
+    dflt = malloc(strlen(input) + 1);
+    strcpy(dflt, input);
+    char *dot = strrchr(dflt, '.');
+    if (dot && dot != dflt && !strchr(dot, '/')) {
+      *dot = '\0';
+    } else {
+      strcat(dflt, ".out");
+      dflt = realloc(dflt, strlen(dflt) + 1);
+    }
+    output = dflt;
+  }
+
+  linterp *li = linterp_new();
+  mpc_result_t r;
+  if (!mpc_parse_contents(input, li->grammar.Lispy, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    linterp_del(li);
+    return 1;
+  }
+  lval *forms = lval_read(r.output);
+  mpc_ast_delete(r.output);
+
+  lcomp c;
+  memset(&c, 0, sizeof(c));
+  c.env = li->env;
+  c.quoted = lenv_new();
+  c.data = lenv_new();
+
+  lcbuf prog = {NULL, 0, 0};
+  lc_program(&c, forms, &prog);
+
+  lcbuf cfile = {NULL, 0, 0};
+  lcbuf_printf(&cfile, "%s.c", output);
+  FILE *f = fopen(cfile.s, "w");
+  if (!f) {
+    perror(cfile.s);
+    return 1;
+  }
+  fwrite(prog.s, 1, prog.len, f);
+  fclose(f);
+
+  int status = 0;
+  if (!emit_only) {
+    char *cc = getenv("CC");
+    lcbuf cmd = {NULL, 0, 0};
+    lcbuf_printf(&cmd, "%s -std=c99 -O2 -fwrapv -I", cc ? cc : "gcc");
+    lc_shell_path(&cmd, LISPY_SRC_DIR);
+    lcbuf_printf(&cmd, " -o ");
+    lc_shell_path(&cmd, output);
+    lcbuf_printf(&cmd, " ");
+    lc_shell_path(&cmd, cfile.s);
+    lcbuf_printf(&cmd, " ");
+    lc_shell_path(&cmd, LISPY_SRC_DIR "/mpc.c");
+    lcbuf_printf(&cmd, " -lm -lpthread");
+    status = system(cmd.s) == 0 ? 0 : 1;
+    lcbuf_free(&cmd);
+  }
+
+  lcbuf_free(&prog);
+  lcbuf_free(&cfile);
+  lcbuf_free(&c.decls);
+  lcbuf_free(&c.init);
+  lenv_del(c.quoted);
+  lenv_del(c.data);
+  lval_del(forms);
+  linterp_del(li);
+  free(dflt);
+  return status;
+}
+
+#endif
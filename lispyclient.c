@@ -0,0 +1,216 @@
+/* Client for the evaluation server started by ./parsing --server PATH
+ *
+ *   ./lispyclient [-n COUNT] [-w MS] SOCKET [FILE ...]
+ *
+ * Sends each file, or stdin if there are none, as one request, COUNT
+ * times over and MS milliseconds apart, printing the results as they
+ * stream back. The server's latency, and the first result and round trip
+ * seen here, go to stderr for each request, followed by a histogram of the
+ * round trips.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Round trips counted in buckets a quarter of a power of two wide, in
+ * microseconds */
+#define LC_BUCKETS 128
+static unsigned long lc_hist[LC_BUCKETS];
+
+/* Least round trip counted in bucket b */
+unsigned long lc_bucket_floor(int b) {
+  if (b < 4) {
+    return b;
+  }
+  return (4UL + (b & 3)) << (b / 4 - 1);
+}
+
+void lc_record(unsigned long us) {
+  int b = 0;
+  while (b < LC_BUCKETS - 1 && lc_bucket_floor(b + 1) <= us) {
+    b++;
+  }
+  lc_hist[b]++;
+}
+
+void lc_print_hist(void) {
+  unsigned long most = 0;
+  int lo = LC_BUCKETS, hi = -1;
+  for (int b = 0; b < LC_BUCKETS; b++) {
+    if (lc_hist[b]) {
+      most = lc_hist[b] > most ? lc_hist[b] : most;
+      lo = b < lo ? b : lo;
+      hi = b;
+    }
+  }
+  for (int b = lo; b <= hi; b++) {
+    fprintf(stderr, "%9lu us %6lu ", lc_bucket_floor(b), lc_hist[b]);
+    for (unsigned long i = 0; i < lc_hist[b] * 50 / most; i++) {
+      fputc('#', stderr);
+    }
+    fputc('\n', stderr);
+  }
+}
+
+/* Read or write exactly n bytes, returning 0 if the server has gone */
+int lc_read(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t k = read(fd, p, n);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      return 0;
+    }
+    p += k;
+    n -= k;
+  }
+  return 1;
+}
+
+int lc_write(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      return 0;
+    }
+    p += k;
+    n -= k;
+  }
+  return 1;
+}
+
+/* Slurp a whole file, or stdin when path is NULL */
+char *lc_slurp(char *path, size_t *size) {
+  FILE *f = path ? fopen(path, "rb") : stdin;
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  size_t cap = 4096, n = 0, k;
+  char *buf = malloc(cap);
+  while ((k = fread(buf + n, 1, cap - n, f)) > 0) {
+    n += k;
+    if (n == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  if (path) {
+    fclose(f);
+  }
+  *size = n;
+  return buf;
+}
+
+/* Send one request and print its reply, returning 0 on a broken
+ * connection */
+int lc_request(int fd, char *src, size_t n) {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  unsigned char h[4] = {n >> 24, n >> 16, n >> 8, n};
+  if (!lc_write(fd, h, 4) || !lc_write(fd, src, n)) {
+    return 0;
+  }
+
+  unsigned long first = 0;
+  for (;;) {
+    if (!lc_read(fd, h, 4)) {
+      return 0;
+    }
+    if (!first) {
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      first = (t1.tv_sec - t0.tv_sec) * 1000000UL +
+              (t1.tv_nsec - t0.tv_nsec) / 1000;
+    }
+    size_t len = (size_t)h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3];
+    if (len == 0) {
+      break;
+    }
+    char *buf = malloc(len);
+    if (!lc_read(fd, buf, len)) {
+      free(buf);
+      return 0;
+    }
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    free(buf);
+  }
+
+  unsigned char t[8];
+  if (!lc_read(fd, t, 8)) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  unsigned long us = 0;
+  for (int i = 0; i < 8; i++) {
+    us = us << 8 | t[i];
+  }
+  unsigned long rt = (t1.tv_sec - t0.tv_sec) * 1000000UL +
+                     (t1.tv_nsec - t0.tv_nsec) / 1000;
+  fprintf(stderr, "server %lu us, first result %lu us, round trip %lu us\n",
+          us, first, rt);
+  lc_record(rt);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  int count = 1, wait = 0, first = 1;
+  while (argc > first + 1 && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-n") == 0) {
+      count = atoi(argv[first + 1]);
+    } else if (strcmp(argv[first], "-w") == 0) {
+      wait = atoi(argv[first + 1]);
+    } else {
+      break;
+    }
+    first += 2;
+  }
+  if (argc <= first || argv[first][0] == '-') {
+    fprintf(stderr, "usage: %s [-n COUNT] [-w MS] SOCKET [FILE ...]\n",
+            argv[0]);
+    return 2;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, argv[first], sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(argv[first]);
+    return 1;
+  }
+
+  int ok = 1;
+  int nfiles = argc - first - 1;
+  for (int i = 0; i < (nfiles ? nfiles : 1) && ok; i++) {
+    size_t n;
+    char *src = lc_slurp(nfiles ? argv[first + 1 + i] : NULL, &n);
+    if (!src) {
+      ok = 0;
+      break;
+    }
+    for (int j = 0; j < count && ok; j++) {
+      if (wait && (i || j)) {
+        usleep(wait * 1000);
+      }
+      ok = lc_request(fd, src, n);
+    }
+    free(src);
+  }
+  close(fd);
+  lc_print_hist();
+  return ok ? 0 : 1;
+}
@@ -1,9 +1,22 @@
+/* Expose POSIX/BSD extensions such as MAP_ANONYMOUS under -std=c99 */
+#define _DEFAULT_SOURCE
 #include "mpc.h"
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 #define LASSERT(args, cond, fmt, ...)                                          \
   if (!(cond)) {                                                               \
@@ -14,9 +27,9 @@
 
 #define LASSERT_TYPE(func, expected, index, args)                              \
   if (!(args->cell[index]->type == expected)) {                                \
-    lval *err =                                                                \
-        lerr("Function '%s' passed incorrect type: %s\nExpected QExpressions", \
-             func, ltype_name(a->cell[0]->type), ltype_name(expected));      \
+    lval *err = lerr("Function '%s' passed incorrect type: %s\nExpected %s",   \
+                     func, ltype_name(args->cell[index]->type),                \
+                     ltype_name(expected));                                    \
     lval_del(args);                                                            \
     return err;                                                                \
   }
@@ -31,6 +44,10 @@
   }
 
 #define STR_ERR_SIZE 512
+#define LCACHE_DEFAULT_CAPACITY 256
+#define MACRO_MAX_DEPTH 1000
+/* Strings shorter than this are stored inside the lval itself */
+#define LSTR_SMALL 16
 /*if we are compiling on Windows compile these functions*/
 #ifdef _WIN32
 
@@ -53,6 +70,12 @@ void add_history(char *unused) {}
 #include <readline/history.h>
 #include <readline/readline.h>
 #endif
+
+/* Native code generation is only available on x86-64 Linux */
+#if defined(__linux__) && defined(__x86_64__)
+#define LISPY_JIT
+#include <sys/mman.h>
+#endif
 /*Foward Declarations*/
 struct lval;
 struct lenv;
@@ -60,25 +83,383 @@ typedef struct lval lval;
 typedef struct lenv lenv;
 
 typedef lval *(*lbuiltin)(lenv *, lval *);
+struct lcache;
+struct larray;
+struct lbits;
+struct lstrbuf;
+struct lmap;
+struct lfuture;
+struct lchan;
 struct lval {
   int type;
-  long num;
-  /* Error and Symbol types have some string data */
-  char *err;
-  char *sym;
-  lbuiltin fun;
-  /* Count and a Pointer to a list of "lval*" */
-  int count;
-  struct lval **cell;
+  /* Each type only uses its own payload, so they share storage */
+  union {
+    long num;
+    /* Error and Symbol types have some string data */
+    char *err;
+    char *sym;
+    struct {
+      /* Memoised functions share a result cache between copies, and
+       * macros cache their expansions */
+      struct lcache *cache;
+      union {
+        struct {
+          lbuiltin fun;
+          /* Functions generated by defrecord: the record tag, and the
+           * slot they access or -1 for the constructor */
+          int rec;
+          int slot;
+        };
+        struct {
+          /* Count and a Pointer to a list of "lval*" */
+          int count;
+          /* References to a hash-consed Qexpr, or 0 for one with a
+           * single owner */
+          int refs;
+          struct lval **cell;
+          /* Qexprs of only numbers store them packed here instead of
+           * in cell */
+          long *nums;
+        };
+      };
+    };
+    /* Numeric arrays share their contents between copies */
+    struct larray *arr;
+    /* Bitsets, also shared between copies */
+    struct lbits *bits;
+    /* Strings are len bytes at str, which points into small or strbuf */
+    struct {
+      long len;
+      char *str;
+      struct lstrbuf *strbuf;
+      char small[LSTR_SMALL];
+    };
+    /* Maps share their entries between copies */
+    struct lmap *map;
+    /* Futures, shared between copies and with the thread running them */
+    struct lfuture *fut;
+    /* Channels, shared between copies and between coroutines */
+    struct lchan *chan;
+  };
 };
 
-struct lenv {
+/* A binding. Once other threads may be reading its table a binding is
+ * never changed in place: a def swaps in a new one */
+typedef struct lbinding {
+  char *sym;
+  lval *val;
+  /* Unique, so a copy can tell whether its binding was since replaced */
+  unsigned long id;
+  /* For a reader's private copy of a shared binding, that binding's id,
+   * else 0 */
+  unsigned long src;
+} lbinding;
+
+struct linterp;
+
+/* The bindings an environment holds itself. Readers on other threads
+ * load its count and slots atomically, so the owner fills a slot before
+ * counting it and replaces a full table with a bigger one */
+typedef struct lenv_table {
   int count;
+  int capacity;
+  /* Each binding's symbol, kept alongside for a quick scan */
   char **syms;
-  lval **vals;
+  lbinding **binds;
+} lenv_table;
+
+/* A binding or table that a reader may still be looking at, freed once
+ * no interpreter is reading in the epoch it was retired in */
+typedef struct lretired {
+  unsigned long epoch;
+  lbinding *bind;
+  lenv_table *tab;
+  struct lretired *next;
+} lretired;
+
+struct lenv {
+  /* Loaded atomically by readers, since a def may replace it */
+  lenv_table *tab;
+  /* Bumped on every binding change so cached lookups can be validated */
+  unsigned long version;
+  /* One for the owner and one for each environment shared from this one */
+  int refs;
+  /* The environment this one was shared from, looked up after its own */
+  struct lenv *parent;
+  lretired *retired;
+};
+
+enum {
+  LVAL_NUM,
+  LVAL_FUN,
+  LVAL_ERR,
+  LVAL_SYM,
+  LVAL_SEXPR,
+  LVAL_QEXPR,
+  LVAL_MACRO,
+  LVAL_ARRAY,
+  LVAL_STR,
+  LVAL_MAP,
+  LVAL_BITS,
+  LVAL_FUTURE,
+  LVAL_CHAN,
+  /* Each defrecord takes the next tag from here up */
+  LVAL_RECORD
 };
 
-enum { LVAL_NUM, LVAL_FUN, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+/* Record types declared with defrecord, indexed by tag - LVAL_RECORD */
+typedef struct lrectype {
+  char *name;
+  int nslots;
+  char **slots;
+} lrectype;
+
+/* Arena for the temporaries of one top-level evaluation */
+typedef struct larena_chunk {
+  struct larena_chunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} larena_chunk;
+
+typedef struct larena {
+  larena_chunk *chunks;
+  /* Nonzero between larena_begin and larena_reset */
+  int active;
+  /* Nonzero while allocating values that must outlive the arena */
+  int heap_depth;
+} larena;
+
+#define LARENA_CHUNK_SIZE (64 * 1024)
+#define LARENA_ALIGN 16
+
+/* Most threads pmap and preduce will use */
+#define LPOOL_MAX_THREADS 64
+
+/* The parsers making up the Lispy grammar */
+typedef struct lgrammar {
+  mpc_parser_t *Number;
+  mpc_parser_t *Symbol;
+  mpc_parser_t *String;
+  mpc_parser_t *Sexpr;
+  mpc_parser_t *Qexpr;
+  mpc_parser_t *Expr;
+  mpc_parser_t *Lispy;
+} lgrammar;
+
+struct lhcons_table;
+struct lmatch_cache;
+struct lmatch_scope;
+struct ljit_state;
+struct lpool;
+struct lcoro;
+
+/* One interpreter: its environment, parsers, allocator and caches. Values
+ * belong to the interpreter that made them and are passed to another only
+ * as clones, so interpreters running on different threads share nothing
+ * but the atomically counted contents of Arrays, Strings and Bitsets, and
+ * the environments they read through lenv_share */
+typedef struct linterp {
+  lenv *env;
+  lgrammar grammar;
+  larena arena;
+  /* Record types declared with defrecord */
+  lrectype *rectypes;
+  int rectype_count;
+  struct lhcons_table *hcons;
+  struct lmatch_cache *match;
+  /* Names bound by the match bodies being evaluated, innermost first */
+  struct lmatch_scope *scope;
+  struct ljit_state *jit;
+  /* Threads for pmap and preduce, counting this one, and their pool once
+   * first used */
+  int threads;
+  struct lpool *pool;
+  /* The cancellation flag of the future this interpreter is running */
+  int *cancel;
+  /* Least cost of arguments evaluated in parallel, or 0 when off, and the
+   * calls that were */
+  long par_threshold;
+  long par_calls;
+  /* Pool that runs coroutines spawned here, when it is not this
+   * interpreter's own, and the coroutine this interpreter belongs to */
+  struct lpool *sched;
+  struct lcoro *coro;
+  /* Where results are printed, if not stdout */
+  FILE *out;
+  /* Least number of values in a result freed by the reclaimer, or 0 when
+   * off, its jobs still to finish, and whether the arena waits for them */
+  long reclaim_min;
+  int reclaiming;
+  int reclaim_reset;
+  /* Whether scripts are read by a thread of their own while evaluated */
+  int pipeline;
+  /* The epoch this interpreter began reading another thread's environment
+   * in, or 0 while it holds nothing it read there */
+  unsigned long reading;
+  /* Neighbours on the list of every interpreter */
+  struct linterp *prev;
+  struct linterp *next;
+} linterp;
+
+#ifdef __GNUC__
+#define LTHREAD __thread
+#else
+#define LTHREAD
+#endif
+
+/* Flags written by one thread and polled by another */
+#ifdef __GNUC__
+#define LATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define LATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#else
+#define LATOMIC_LOAD(p) (*(volatile int *)(p))
+#define LATOMIC_STORE(p, v) (*(volatile int *)(p) = (v))
+#endif
+
+/* The interpreter running on this thread, set by linterp_enter */
+static LTHREAD linterp *linterp_current;
+
+/* Each arena block is preceded by its usable capacity */
+typedef union larena_header {
+  size_t capacity;
+  char pad[LARENA_ALIGN];
+} larena_header;
+
+int larena_owns(void *p) {
+  for (larena_chunk *c = linterp_current->arena.chunks; c; c = c->next) {
+    if ((char *)p >= c->data && (char *)p < c->data + c->size) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void *larena_alloc(size_t size) {
+  larena *a = &linterp_current->arena;
+  size = (size + LARENA_ALIGN - 1) & ~(size_t)(LARENA_ALIGN - 1);
+  size_t need = size + sizeof(larena_header);
+
+  larena_chunk *c = a->chunks;
+  if (!c || c->used + need > c->size) {
+    /* Chunks double so a large form's stay few for larena_owns to scan */
+    size_t csize = c ? c->size * 2 : LARENA_CHUNK_SIZE;
+    while (csize < need) {
+      csize *= 2;
+    }
+    c = malloc(sizeof(larena_chunk) + csize);
+    c->size = csize;
+    c->used = 0;
+    c->next = a->chunks;
+    a->chunks = c;
+  }
+
+  larena_header *h = (larena_header *)(c->data + c->used);
+  h->capacity = size;
+  c->used += need;
+  return h + 1;
+}
+
+int lreclaim_pending(linterp *li);
+void lreclaim_wait(linterp *li);
+
+void larena_recycle(larena *a);
+
+/* Start bump-allocating evaluation temporaries, once the last form's
+ * result has been freed */
+void larena_begin(void) {
+  linterp *li = linterp_current;
+  lreclaim_wait(li);
+  if (li->reclaim_reset) {
+    larena_recycle(&li->arena);
+    li->reclaim_reset = 0;
+  }
+  li->arena.active = 1;
+}
+
+/* Keep one chunk big enough for the last form's peak, emptied */
+void larena_recycle(larena *a) {
+  if (!a->chunks) {
+    return;
+  }
+
+  /* Coalesce into a single chunk big enough for this form's peak */
+  size_t total = 0;
+  int nchunks = 0;
+  for (larena_chunk *c = a->chunks; c; c = c->next) {
+    total += c->size;
+    nchunks++;
+  }
+  if (nchunks > 1) {
+    larena_chunk *c = a->chunks;
+    while (c) {
+      larena_chunk *next = c->next;
+      free(c);
+      c = next;
+    }
+    a->chunks = malloc(sizeof(larena_chunk) + total);
+    a->chunks->size = total;
+    a->chunks->next = NULL;
+  }
+  a->chunks->used = 0;
+}
+
+/* Release every temporary at once, or at the next larena_begin if the
+ * last result is still being freed from the arena */
+void larena_reset(void) {
+  linterp *li = linterp_current;
+  li->arena.active = 0;
+  if (lreclaim_pending(li)) {
+    li->reclaim_reset = 1;
+  } else {
+    larena_recycle(&li->arena);
+  }
+}
+
+/* Give the arena's memory back when its interpreter is deleted */
+void larena_free(larena *a) {
+  larena_chunk *c = a->chunks;
+  while (c) {
+    larena_chunk *next = c->next;
+    free(c);
+    c = next;
+  }
+  a->chunks = NULL;
+}
+
+/* Allocate from the arena when one is active, otherwise from the heap */
+void *lalloc(size_t size) {
+  larena *a = &linterp_current->arena;
+  if (a->active && a->heap_depth == 0) {
+    return larena_alloc(size);
+  }
+  return malloc(size);
+}
+
+void *lrealloc(void *p, size_t size) {
+  if (!p) {
+    return lalloc(size);
+  }
+  if (!larena_owns(p)) {
+    return realloc(p, size);
+  }
+
+  /* Arena blocks grow geometrically so repeated lval_add stays linear */
+  larena_header *h = (larena_header *)p - 1;
+  if (size <= h->capacity) {
+    return p;
+  }
+  size_t grow = h->capacity * 2 > size ? h->capacity * 2 : size;
+  void *x = lalloc(grow);
+  memcpy(x, p, h->capacity);
+  return x;
+}
+
+void lfree(void *p) {
+  if (p && !larena_owns(p)) {
+    free(p);
+  }
+}
 
 char *ltype_name(int val) {
   switch (val) {
@@ -100,7 +481,32 @@ char *ltype_name(int val) {
   case LVAL_NUM:
     return "Number";
     break;
+  case LVAL_MACRO:
+    return "Macro";
+    break;
+  case LVAL_ARRAY:
+    return "Array";
+    break;
+  case LVAL_STR:
+    return "String";
+    break;
+  case LVAL_MAP:
+    return "Map";
+    break;
+  case LVAL_BITS:
+    return "Bitset";
+    break;
+  case LVAL_FUTURE:
+    return "Future";
+    break;
+  case LVAL_CHAN:
+    return "Channel";
+    break;
   default:
+    if (val >= LVAL_RECORD &&
+        val < LVAL_RECORD + linterp_current->rectype_count) {
+      return linterp_current->rectypes[val - LVAL_RECORD].name;
+    }
     break;
   }
   return "Unknown type";
@@ -108,7 +514,7 @@ char *ltype_name(int val) {
 
 /*Construct a pointer to a new Number lval*/
 lval *lnum(long val) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lalloc(sizeof(lval));
   v->type = LVAL_NUM;
   v->num = val;
   return v;
@@ -116,35 +522,40 @@ lval *lnum(long val) {
 
 /*Construct a pointer to a new Function lval*/
 lval *lfun(lbuiltin func) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lalloc(sizeof(lval));
   v->type = LVAL_FUN;
   v->fun = func;
+  v->cache = NULL;
+  v->rec = 0;
   return v;
 }
 
 /*Construct a pointer to a new Qexpr lval*/
 lval *lqexpr() {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lalloc(sizeof(lval));
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->nums = NULL;
+  v->refs = 0;
   return v;
 }
 
 /*Construct a pointer to a new Error lval*/
 lval *lerr(char *fmt, ...) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lalloc(sizeof(lval));
   v->type = LVAL_ERR;
 
   va_list va;
   va_start(va, fmt);
 
-  /*Allocate 512 bytes for our string*/
-  v->err = malloc(STR_ERR_SIZE);
+  /*Format into 512 bytes on the stack*/
+  char buf[STR_ERR_SIZE];
+  vsnprintf(buf, STR_ERR_SIZE, fmt, va);
 
-  vsprintf(v->err, fmt, va);
-  /*Reallocate to actual space used by string*/
-  v->err = realloc(v->err, strlen(v->err) + 1);
+  /*Allocate only the space actually used by the string*/
+  v->err = lalloc(strlen(buf) + 1);
+  strcpy(v->err, buf);
 
   va_end(va);
   return v;
@@ -152,50 +563,312 @@ lval *lerr(char *fmt, ...) {
 
 /*Construct a pointer to a new Symbol lval*/
 lval *lsym(char *sym) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lalloc(sizeof(lval));
   v->type = LVAL_SYM;
-  v->sym = malloc(sizeof(strlen(sym) + 1));
+  v->sym = lalloc(strlen(sym) + 1);
   strcpy(v->sym, sym);
   return v;
 }
 
 /*Construct a pointer to a new Sexpr lval*/
 lval *lsexpr(void) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lalloc(sizeof(lval));
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->nums = NULL;
+  v->refs = 0;
+  return v;
+}
+
+struct lcache *lcache_new(int capacity);
+
+lval *lval_unpack(lval *v);
+
+/*Construct a pointer to a new Macro lval from its formals and body*/
+lval *lmacro(lval *formals, lval *body) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_MACRO;
+  v->count = 2;
+  v->cell = lalloc(sizeof(lval *) * 2);
+  v->nums = NULL;
+  v->refs = 0;
+  v->cell[0] = lval_unpack(formals);
+  v->cell[1] = lval_unpack(body);
+  /* Expansions of each distinct call form are cached on the macro */
+  v->cache = lcache_new(LCACHE_DEFAULT_CAPACITY);
+  return v;
+}
+
+/* Contiguous row-major array of numbers, shared between copies */
+typedef struct larray {
+  /* Atomic, since copies may be on other threads */
+  int refs;
+  int ndim;
+  /* Total number of elements */
+  long size;
+  long *shape;
+  long *data;
+} larray;
+
+larray *larray_new(int ndim, long *shape) {
+  larray *a = malloc(sizeof(larray));
+  a->refs = 1;
+  a->ndim = ndim;
+  a->shape = malloc(sizeof(long) * (ndim ? ndim : 1));
+  a->size = 1;
+  for (int i = 0; i < ndim; i++) {
+    a->shape[i] = shape[i];
+    a->size *= shape[i];
+  }
+  a->data = malloc(sizeof(long) * (a->size ? a->size : 1));
+  return a;
+}
+
+void larray_release(larray *a) {
+  if (__atomic_sub_fetch(&a->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  free(a->shape);
+  free(a->data);
+  free(a);
+}
+
+/*Construct a pointer to a new Array lval, taking ownership of arr*/
+lval *larr(larray *arr) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_ARRAY;
+  v->arr = arr;
+  return v;
+}
+
+/* Dense set of non-negative integers, one bit per possible member. The
+ * last word is never zero, so equal sets have equal words */
+typedef struct lbits {
+  /* Atomic, as for larray */
+  int refs;
+  long nwords;
+  unsigned long *words;
+} lbits;
+
+#define LBITS_WORD ((long)sizeof(unsigned long) * 8)
+
+lbits *lbits_new(long nwords) {
+  lbits *b = malloc(sizeof(lbits));
+  b->refs = 1;
+  b->nwords = nwords;
+  b->words = calloc(nwords ? nwords : 1, sizeof(unsigned long));
+  return b;
+}
+
+void lbits_release(lbits *b) {
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  free(b->words);
+  free(b);
+}
+
+/* Drop trailing zero words */
+lbits *lbits_trim(lbits *b) {
+  while (b->nwords > 0 && b->words[b->nwords - 1] == 0) {
+    b->nwords--;
+  }
+  return b;
+}
+
+/*Construct a pointer to a new Bitset lval, taking ownership of bits*/
+lval *lbitsv(lbits *bits) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_BITS;
+  v->bits = bits;
+  return v;
+}
+
+/* Refcounted storage for long strings, shared by all slices of it */
+typedef struct lstrbuf {
+  /* Atomic, as for larray */
+  int refs;
+  long size;
+  char data[];
+} lstrbuf;
+
+lstrbuf *lstrbuf_new(long size) {
+  lstrbuf *b = malloc(sizeof(lstrbuf) + size);
+  b->refs = 1;
+  b->size = size;
+  return b;
+}
+
+void lstrbuf_release(lstrbuf *b) {
+  if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(b);
+  }
+}
+
+/*Construct a pointer to a new String lval holding len bytes of s*/
+lval *lstrn(char *s, long len) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->len = len;
+  if (len < LSTR_SMALL) {
+    v->strbuf = NULL;
+    v->str = v->small;
+  } else {
+    v->strbuf = lstrbuf_new(len);
+    v->str = v->strbuf->data;
+  }
+  memcpy(v->str, s, len);
+  return v;
+}
+
+/* Substring of a String; long ones share the original's buffer */
+lval *lstr_slice(lval *s, long start, long len) {
+  if (len < LSTR_SMALL) {
+    return lstrn(s->str + start, len);
+  }
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->len = len;
+  v->str = s->str + start;
+  v->strbuf = s->strbuf;
+  __atomic_add_fetch(&v->strbuf->refs, 1, __ATOMIC_RELAXED);
+  return v;
+}
+
+/* Growable buffer for building a String without a realloc per piece */
+typedef struct lstrbuilder {
+  lstrbuf *buf;
+  long len;
+} lstrbuilder;
+
+void lstrbuilder_add(lstrbuilder *b, char *s, long len) {
+  if (!b->buf || b->len + len > b->buf->size) {
+    long size = b->buf ? b->buf->size * 2 : 64;
+    while (size < b->len + len) {
+      size *= 2;
+    }
+    b->buf = realloc(b->buf, sizeof(lstrbuf) + size);
+    b->buf->refs = 1;
+    b->buf->size = size;
+  }
+  memcpy(b->buf->data + b->len, s, len);
+  b->len += len;
+}
+
+/* Finish building, adopting the buffer unless the result is small */
+lval *lstrbuilder_done(lstrbuilder *b) {
+  if (b->len < LSTR_SMALL) {
+    lval *v = lstrn(b->buf ? b->buf->data : "", b->len);
+    free(b->buf);
+    return v;
+  }
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->len = b->len;
+  v->strbuf = b->buf;
+  v->str = b->buf->data;
   return v;
 }
 
+void lcache_retain(struct lcache *c);
+void lcache_release(struct lcache *c);
+void lmap_retain(struct lmap *m);
+void lmap_release(struct lmap *m);
+void lfuture_retain(struct lfuture *f);
+void lfuture_release(struct lfuture *f);
+void lchan_retain(struct lchan *c);
+void lchan_release(struct lchan *c);
+unsigned long lmap_hash(struct lmap *m);
+int lmap_eq(struct lmap *x, struct lmap *y);
+void lval_del(lval *v);
+void lhcons_remove(lval *v);
+
 lval *lval_copy(lval *v) {
-  lval *x = malloc(sizeof(lval));
+  /* Hash-consed Qexprs are never modified, so copies share them */
+  if (v->type == LVAL_QEXPR && v->refs) {
+    v->refs++;
+    return v;
+  }
+  lval *x = lalloc(sizeof(lval));
   x->type = v->type;
 
   switch (v->type) {
   /*Copy Function and Numbers Directly*/
   case LVAL_FUN:
     x->fun = v->fun;
+    x->rec = v->rec;
+    x->slot = v->slot;
+    x->cache = v->cache;
+    lcache_retain(x->cache);
     break;
   case LVAL_NUM:
     x->num = v->num;
     break;
+  /* Arrays are immutable, so copies share the same contents */
+  case LVAL_ARRAY:
+    x->arr = v->arr;
+    __atomic_add_fetch(&x->arr->refs, 1, __ATOMIC_RELAXED);
+    break;
+  case LVAL_BITS:
+    x->bits = v->bits;
+    __atomic_add_fetch(&x->bits->refs, 1, __ATOMIC_RELAXED);
+    break;
+  /* Long Strings share their buffer, short ones are copied inline */
+  case LVAL_STR:
+    x->len = v->len;
+    x->strbuf = v->strbuf;
+    if (x->strbuf) {
+      __atomic_add_fetch(&x->strbuf->refs, 1, __ATOMIC_RELAXED);
+      x->str = v->str;
+    } else {
+      x->str = x->small;
+      memcpy(x->small, v->small, v->len);
+    }
+    break;
+  case LVAL_MAP:
+    x->map = v->map;
+    lmap_retain(x->map);
+    break;
+  case LVAL_FUTURE:
+    x->fut = v->fut;
+    lfuture_retain(x->fut);
+    break;
+  case LVAL_CHAN:
+    x->chan = v->chan;
+    lchan_retain(x->chan);
+    break;
 
-  /* Copy Strings using malloc and strcpy */
+  /* Copy Strings using lalloc and strcpy */
   case LVAL_ERR:
-    x->err = malloc(strlen(v->err) + 1);
+    x->err = lalloc(strlen(v->err) + 1);
     strcpy(x->err, v->err);
     break;
   case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
+    x->sym = lalloc(strlen(v->sym) + 1);
     strcpy(x->sym, v->sym);
     break;
 
   /* Copy List by copying each sub-expression */
+  case LVAL_MACRO:
+    x->cache = v->cache;
+    lcache_retain(x->cache);
+    /* fall through */
+  /* Records hold their slots like a list */
+  default:
   case LVAL_SEXPR:
   case LVAL_QEXPR:
     x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
+    x->cell = NULL;
+    x->nums = NULL;
+    x->refs = 0;
+    /* Packed numbers are copied in one block */
+    if (v->nums) {
+      x->nums = lalloc(sizeof(long) * x->count);
+      memcpy(x->nums, v->nums, sizeof(long) * x->count);
+      break;
+    }
+    x->cell = lalloc(sizeof(lval *) * x->count);
     for (int i = 0; i < v->count; ++i) {
       x->cell[i] = lval_copy(v->cell[i]);
     }
@@ -209,290 +882,6680 @@ void lval_del(lval *v) {
   case LVAL_NUM:
     break;
   case LVAL_ERR:
-    free(v->err);
+    lfree(v->err);
     break;
   case LVAL_SYM:
-    free(v->sym);
+    lfree(v->sym);
     break;
   case LVAL_FUN:
+    lcache_release(v->cache);
+    break;
+  case LVAL_ARRAY:
+    larray_release(v->arr);
+    break;
+  case LVAL_BITS:
+    lbits_release(v->bits);
     break;
+  case LVAL_STR:
+    lstrbuf_release(v->strbuf);
+    break;
+  case LVAL_MAP:
+    lmap_release(v->map);
+    break;
+  case LVAL_FUTURE:
+    lfuture_release(v->fut);
+    break;
+  case LVAL_CHAN:
+    lchan_release(v->chan);
+    break;
+  case LVAL_MACRO:
+    lcache_release(v->cache);
+    /* fall through */
+  default:
   case LVAL_QEXPR:
   case LVAL_SEXPR:
+    /* Shared Qexprs are only freed with their last reference */
+    if (v->refs) {
+      if (--v->refs > 0) {
+        return;
+      }
+      lhcons_remove(v);
+    }
 
     /*If Sexpr delete all elements inside*/
+    if (v->nums) {
+      lfree(v->nums);
+      break;
+    }
     for (int i = 0; i < v->count; ++i) {
       lval_del(v->cell[i]);
     }
     /* Also free the memory allocated to the pointers */
-    free(v->cell);
+    lfree(v->cell);
     break;
   }
   /* Free the memory allocated for the "lval" struct itself */
-  free(v);
-}
-
-lenv *lenv_new() {
-  lenv *e = malloc(sizeof(lenv));
-  e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
-  return e;
+  lfree(v);
 }
 
-void lenv_del(lenv *e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+/* Structural hashing of lvals */
+unsigned long lhash_mix(unsigned long h, unsigned long x) {
+  h ^= x + 0x9e3779b97f4a7c15UL + (h << 6) + (h >> 2);
+  return h;
 }
 
-lval *lenv_get(lenv *e, lval *k) {
-  /* Iterate over all items in environment */
-  for (int i = 0; i < e->count; i++) {
-    /*Check if the stored string matches the symbol string */
-    /* If it does, return a copy of the value */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+unsigned long lhash_str(unsigned long h, char *s) {
+  /* FNV-1a over the bytes of the string */
+  unsigned long f = 14695981039346656037UL;
+  while (*s) {
+    f ^= (unsigned char)*s++;
+    f *= 1099511628211UL;
   }
-  /* If no symbol found return error */
-  return lerr("unbound symbol!");
+  return lhash_mix(h, f);
 }
 
-void lenv_put(lenv *e, lval *k, lval *v) {
-  /* Iterate over all items in environment */
-  /* This is to see if variable already exists */
-  for (int i = 0; i < e->count; i++) {
-    /* If variable is found delete item at that position */
-    /* And replace with variable supplied by user */
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+unsigned long lhash_bytes(unsigned long h, char *s, long len) {
+  unsigned long f = 14695981039346656037UL;
+  for (long i = 0; i < len; i++) {
+    f ^= (unsigned char)s[i];
+    f *= 1099511628211UL;
   }
-
-  /* If no existing entry found allocate space for new entry */
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
-
-  /* Copy contents of lval and symbol string into new location */
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  return lhash_mix(h, f);
 }
 
-lval *lval_read_num(mpc_ast_t *t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lnum(x) : lerr("invalid number");
+/* Hash of a Number, shared by boxed and packed elements */
+unsigned long lhash_num(long n) {
+  return lhash_mix(lhash_mix(0, (unsigned long)LVAL_NUM), (unsigned long)n);
 }
 
-lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  v->cell[v->count - 1] = x;
-  return v;
+unsigned long lval_hash(lval *v) {
+  unsigned long h = lhash_mix(0, (unsigned long)v->type);
+  switch (v->type) {
+  case LVAL_NUM:
+    return lhash_num(v->num);
+  case LVAL_FUN:
+    h = lhash_mix(h, (unsigned long)(size_t)v->fun);
+    h = lhash_mix(h, (unsigned long)v->rec * 31 + (unsigned long)v->slot);
+    break;
+  case LVAL_ERR:
+    h = lhash_str(h, v->err);
+    break;
+  case LVAL_SYM:
+    h = lhash_str(h, v->sym);
+    break;
+  case LVAL_STR:
+    h = lhash_bytes(h, v->str, v->len);
+    break;
+  case LVAL_MAP:
+    h = lhash_mix(h, lmap_hash(v->map));
+    break;
+  case LVAL_FUTURE:
+    h = lhash_mix(h, (unsigned long)(size_t)v->fut);
+    break;
+  case LVAL_CHAN:
+    h = lhash_mix(h, (unsigned long)(size_t)v->chan);
+    break;
+  case LVAL_BITS:
+    for (long i = 0; i < v->bits->nwords; i++) {
+      h = lhash_mix(h, v->bits->words[i]);
+    }
+    break;
+  case LVAL_ARRAY:
+    for (int i = 0; i < v->arr->ndim; i++) {
+      h = lhash_mix(h, (unsigned long)v->arr->shape[i]);
+    }
+    for (long i = 0; i < v->arr->size; i++) {
+      h = lhash_mix(h, (unsigned long)v->arr->data[i]);
+    }
+    break;
+  case LVAL_MACRO:
+    h = lhash_mix(h, (unsigned long)(size_t)v->cache);
+    /* fall through */
+  default:
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    h = lhash_mix(h, (unsigned long)v->count);
+    for (int i = 0; i < v->count; i++) {
+      h = lhash_mix(h, v->nums ? lhash_num(v->nums[i]) : lval_hash(v->cell[i]));
+    }
+    break;
+  }
+  return h;
 }
-void lval_println(lval *);
 
-/* Parsing */
-lval *lval_read(mpc_ast_t *t) {
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
-  if (strstr(t->tag, "symbol")) {
-    return lsym(t->contents);
-  }
-  /*If root (>) or sexpr then create empty list*/
-  lval *x = NULL;
-  if (strstr(t->tag, "qexpr")) {
-    x = lqexpr();
-  }
-  if (strcmp(t->tag, ">") == 0) {
-    x = lsexpr();
-  }
-  if (strstr(t->tag, "sexpr")) {
-    x = lsexpr();
+/* Structural equality: same type and same contents all the way down */
+int lval_eq(lval *x, lval *y) {
+  if (x->type != y->type) {
+    return 0;
   }
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; ++i) {
-    if (strcmp(t->children[i]->contents, "(") == 0) {
-      continue;
+  switch (x->type) {
+  case LVAL_NUM:
+    return x->num == y->num;
+  case LVAL_FUN:
+    return x->fun == y->fun && x->cache == y->cache && x->rec == y->rec &&
+           x->slot == y->slot;
+  case LVAL_ERR:
+    return strcmp(x->err, y->err) == 0;
+  case LVAL_SYM:
+    return strcmp(x->sym, y->sym) == 0;
+  case LVAL_STR:
+    return x->len == y->len && memcmp(x->str, y->str, x->len) == 0;
+  case LVAL_MAP:
+    return lmap_eq(x->map, y->map);
+  case LVAL_FUTURE:
+    return x->fut == y->fut;
+  case LVAL_CHAN:
+    return x->chan == y->chan;
+  case LVAL_BITS:
+    return x->bits->nwords == y->bits->nwords &&
+           memcmp(x->bits->words, y->bits->words,
+                  sizeof(unsigned long) * x->bits->nwords) == 0;
+  case LVAL_ARRAY:
+    if (x->arr == y->arr) {
+      return 1;
     }
-    if (strcmp(t->children[i]->contents, ")") == 0) {
-      continue;
+    if (x->arr->ndim != y->arr->ndim ||
+        memcmp(x->arr->shape, y->arr->shape, sizeof(long) * x->arr->ndim)) {
+      return 0;
     }
-    if (strcmp(t->children[i]->contents, "{") == 0) {
-      continue;
+    return memcmp(x->arr->data, y->arr->data, sizeof(long) * x->arr->size) ==
+           0;
+  case LVAL_MACRO:
+    if (x->cache != y->cache) {
+      return 0;
     }
-    if (strcmp(t->children[i]->contents, "}") == 0) {
-      continue;
+    /* fall through */
+  default:
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (x->count != y->count) {
+      return 0;
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
+    if (x->nums && y->nums) {
+      return memcmp(x->nums, y->nums, sizeof(long) * x->count) == 0;
     }
-    x = lval_add(x, lval_read(t->children[i]));
+    /* A packed list equals a boxed one holding the same numbers */
+    for (int i = 0; i < x->count; i++) {
+      lval *a = x->nums ? NULL : x->cell[i];
+      lval *b = y->nums ? NULL : y->cell[i];
+      if (a && b) {
+        if (!lval_eq(a, b)) {
+          return 0;
+        }
+      } else if (a || b) {
+        lval *boxed = a ? a : b;
+        long n = a ? y->nums[i] : x->nums[i];
+        if (boxed->type != LVAL_NUM || boxed->num != n) {
+          return 0;
+        }
+      } else if (x->nums[i] != y->nums[i]) {
+        return 0;
+      }
+    }
+    return 1;
   }
-  return x;
+  return 0;
 }
 
-/* Printing lvals */
-void lval_print(lval *val); // Foward declaration
+/* Copy a value onto the heap so it can outlive the current form */
+lval *lval_copy_heap(lval *v) {
+  linterp_current->arena.heap_depth++;
+  lval *x = lval_copy(v);
+  linterp_current->arena.heap_depth--;
+  return x;
+}
 
-void lval_expr_print(lval *v, char *open, char *close) {
-  printf("%s", open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-    /*Don't print trailing space if last element*/
-    if (i != (v->count - 1)) {
-      putchar(' ');
-    }
+/* Move a value out of the arena, consuming the original */
+lval *lval_promote(lval *v) {
+  if (!linterp_current->arena.active) {
+    return v;
   }
-  printf("%s", close);
+  lval *x = lval_copy_heap(v);
+  lval_del(v);
+  return x;
 }
 
-void lval_print(lval *val) {
+/* Hash-consing of Q-expression literals
+ *
+ * When enabled, the reader keeps a single copy of each Qexpr built only
+ * from Numbers, Symbols, Strings and other such Qexprs, which every
+ * structurally identical literal then shares. Shared Qexprs live on the
+ * heap and count their references in refs. Builtins are free to modify
+ * their arguments, so lval_call gives them private copies instead.
+ */
+
+typedef struct lhcons_slot {
+  unsigned long hash;
+  lval *v;
+} lhcons_slot;
+
+typedef struct lhcons_table {
+  int enabled;
+  /* Number of slots, a power of two */
+  long size;
+  /* Live shared Qexprs, and slots holding either one or a tombstone */
+  long count;
+  long used;
+  lhcons_slot *slots;
+  /* Literals read, how many were already shared, and the bytes their
+   * nodes take without and with sharing */
+  long literals;
+  long hits;
+  long unshared;
+  long shared;
+} lhcons_table;
+
+static lval lhcons_tombstone;
+
+lhcons_table *lhcons_table_new(void) {
+  return calloc(1, sizeof(lhcons_table));
+}
+
+/* Shared Qexprs free themselves with their last reference */
+void lhcons_table_del(lhcons_table *t) {
+  free(t->slots);
+  free(t);
+}
+
+/* Bytes of a literal's own node, its cells and any atoms in them; child
+ * Qexprs are accounted for when they are read themselves */
+long lhcons_bytes(lval *v) {
+  long n = sizeof(lval);
+  if (v->nums) {
+    return n + sizeof(long) * v->count;
+  }
+  n += sizeof(lval *) * v->count;
+  for (int i = 0; i < v->count; i++) {
+    lval *c = v->cell[i];
+    if (c->type == LVAL_QEXPR) {
+      continue;
+    }
+    n += sizeof(lval);
+    if (c->type == LVAL_SYM) {
+      n += strlen(c->sym) + 1;
+    }
+    if (c->type == LVAL_STR && c->strbuf) {
+      n += sizeof(lstrbuf) + c->strbuf->size;
+    }
+  }
+  return n;
+}
+
+/* Only Qexprs of atoms and already shared Qexprs can be shared */
+int lhcons_ok(lval *v) {
+  if (v->nums) {
+    return 1;
+  }
+  for (int i = 0; i < v->count; i++) {
+    switch (v->cell[i]->type) {
+    case LVAL_NUM:
+    case LVAL_SYM:
+    case LVAL_STR:
+      break;
+    case LVAL_QEXPR:
+      if (!v->cell[i]->refs) {
+        return 0;
+      }
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void lhcons_rehash(lhcons_table *t) {
+  long size = 64;
+  while (size < t->count * 4) {
+    size *= 2;
+  }
+  lhcons_slot *old = t->slots;
+  long oldsize = t->size;
+  t->slots = calloc(size, sizeof(lhcons_slot));
+  t->size = size;
+  t->used = t->count;
+  for (long i = 0; i < oldsize; i++) {
+    if (old[i].v && old[i].v != &lhcons_tombstone) {
+      long j = old[i].hash & (size - 1);
+      while (t->slots[j].v) {
+        j = (j + 1) & (size - 1);
+      }
+      t->slots[j] = old[i];
+    }
+  }
+  free(old);
+}
+
+/* The shared copy of a freshly read Qexpr, consuming it */
+lval *lhcons_intern(lval *v) {
+  lhcons_table *t = linterp_current->hcons;
+  if (!t->enabled || !lhcons_ok(v)) {
+    return v;
+  }
+  t->literals++;
+  t->unshared += lhcons_bytes(v);
+  if ((t->used + 1) * 2 > t->size) {
+    lhcons_rehash(t);
+  }
+
+  unsigned long h = lval_hash(v);
+  long mask = t->size - 1;
+  long i = h & mask;
+  long free_slot = -1;
+  for (; t->slots[i].v; i = (i + 1) & mask) {
+    lhcons_slot *s = &t->slots[i];
+    if (s->v == &lhcons_tombstone) {
+      free_slot = free_slot < 0 ? i : free_slot;
+    } else if (s->hash == h && lval_eq(s->v, v)) {
+      t->hits++;
+      s->v->refs++;
+      lval_del(v);
+      return s->v;
+    }
+  }
+  if (free_slot < 0) {
+    free_slot = i;
+    t->used++;
+  }
+
+  lval *x = lval_copy_heap(v);
+  lval_del(v);
+  x->refs = 1;
+  t->slots[free_slot].hash = h;
+  t->slots[free_slot].v = x;
+  t->count++;
+  t->shared += lhcons_bytes(x);
+  return x;
+}
+
+/* Forget a shared Qexpr whose last reference is being dropped */
+void lhcons_remove(lval *v) {
+  lhcons_table *t = linterp_current->hcons;
+  long mask = t->size - 1;
+  for (long i = lval_hash(v) & mask; t->slots[i].v; i = (i + 1) & mask) {
+    if (t->slots[i].v == v) {
+      t->slots[i].v = &lhcons_tombstone;
+      t->count--;
+      return;
+    }
+  }
+}
+
+/* A version of v with no shared Qexprs anywhere inside, consuming v */
+lval *lval_thaw(lval *v) {
+  if (linterp_current->hcons->count == 0 ||
+      (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR &&
+       v->type < LVAL_RECORD)) {
+    return v;
+  }
+  if (v->refs) {
+    lval *x = lqexpr();
+    x->count = v->count;
+    if (v->nums) {
+      x->nums = lalloc(sizeof(long) * v->count);
+      memcpy(x->nums, v->nums, sizeof(long) * v->count);
+    } else if (v->count > 0) {
+      x->cell = lalloc(sizeof(lval *) * v->count);
+      for (int i = 0; i < v->count; i++) {
+        x->cell[i] = lval_thaw(lval_copy(v->cell[i]));
+      }
+    }
+    lval_del(v);
+    return x;
+  }
+  if (!v->nums) {
+    for (int i = 0; i < v->count; i++) {
+      v->cell[i] = lval_thaw(v->cell[i]);
+    }
+  }
+  return v;
+}
+
+/* Give a builtin private copies of its arguments */
+void lval_thaw_args(lval *a) {
+  if (linterp_current->hcons->count == 0) {
+    return;
+  }
+  for (int i = 0; i < a->count; i++) {
+    a->cell[i] = lval_thaw(a->cell[i]);
+  }
+}
+
+lval *lval_clone(lval *v);
+lval *lenv_peek(lenv *e, char *sym);
+lval *lmatch_peek(lenv *e, char *sym);
+
+/* Epochs
+ *
+ * An interpreter reading an environment shared from another thread
+ * announces the epoch it started in, and clears it once it holds no
+ * pointer into that environment: when lenv_get has copied the value out,
+ * and when its thread switches interpreter. A binding or table the owner
+ * replaces is retired in the current epoch and freed once no interpreter
+ * is still reading in that epoch or an earlier one */
+static unsigned long lepoch = 1;
+static unsigned long lbinding_ids;
+/* Every interpreter, for finding the oldest epoch still being read in */
+static linterp *linterp_all;
+static pthread_mutex_t linterp_all_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void linterp_register(linterp *li) {
+  pthread_mutex_lock(&linterp_all_lock);
+  li->next = linterp_all;
+  if (linterp_all) {
+    linterp_all->prev = li;
+  }
+  linterp_all = li;
+  pthread_mutex_unlock(&linterp_all_lock);
+}
+
+void linterp_unregister(linterp *li) {
+  pthread_mutex_lock(&linterp_all_lock);
+  if (li->prev) {
+    li->prev->next = li->next;
+  } else {
+    linterp_all = li->next;
+  }
+  if (li->next) {
+    li->next->prev = li->prev;
+  }
+  pthread_mutex_unlock(&linterp_all_lock);
+}
+
+void lepoch_enter(linterp *li) {
+  if (!li->reading) {
+    __atomic_store_n(&li->reading, __atomic_load_n(&lepoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+  }
+}
+
+void lepoch_leave(linterp *li) {
+  if (li && li->reading) {
+    __atomic_store_n(&li->reading, 0, __ATOMIC_RELEASE);
+  }
+}
+
+/* The oldest epoch any interpreter is still reading in */
+unsigned long lepoch_oldest(void) {
+  unsigned long oldest = ULONG_MAX;
+  pthread_mutex_lock(&linterp_all_lock);
+  for (linterp *li = linterp_all; li; li = li->next) {
+    unsigned long r = __atomic_load_n(&li->reading, __ATOMIC_SEQ_CST);
+    if (r && r < oldest) {
+      oldest = r;
+    }
+  }
+  pthread_mutex_unlock(&linterp_all_lock);
+  return oldest;
+}
+
+lbinding *lbinding_new(char *sym, lval *val) {
+  lbinding *b = malloc(sizeof(lbinding));
+  b->sym = malloc(strlen(sym) + 1);
+  strcpy(b->sym, sym);
+  b->val = val;
+  b->id = __atomic_add_fetch(&lbinding_ids, 1, __ATOMIC_RELAXED);
+  b->src = 0;
+  return b;
+}
+
+void lbinding_del(lbinding *b) {
+  free(b->sym);
+  lval_del(b->val);
+  free(b);
+}
+
+lenv_table *lenv_table_new(int capacity) {
+  lenv_table *t = calloc(1, sizeof(lenv_table));
+  t->capacity = capacity;
+  t->syms = malloc(sizeof(char *) * capacity);
+  t->binds = malloc(sizeof(lbinding *) * capacity);
+  return t;
+}
+
+/* Free a table but not the bindings in it */
+void lenv_table_free(lenv_table *t) {
+  free(t->syms);
+  free(t->binds);
+  free(t);
+}
+
+void lretired_free(lretired *r) {
+  if (r->bind) {
+    lbinding_del(r->bind);
+  }
+  if (r->tab) {
+    lenv_table_free(r->tab);
+  }
+  free(r);
+}
+
+/* Whether environments shared from e may be reading its table */
+int lenv_shared(lenv *e) {
+  return __atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Free a binding or table e no longer holds, once no reader can see it */
+void lenv_retire(lenv *e, lbinding *b, lenv_table *t) {
+  if (!lenv_shared(e)) {
+    if (b) {
+      lbinding_del(b);
+    }
+    if (t) {
+      lenv_table_free(t);
+    }
+    return;
+  }
+  lretired *r = malloc(sizeof(lretired));
+  r->epoch = __atomic_fetch_add(&lepoch, 1, __ATOMIC_SEQ_CST);
+  r->bind = b;
+  r->tab = t;
+  r->next = e->retired;
+  e->retired = r;
+}
+
+/* Free what e has retired that no reader can see any more */
+void lenv_drain(lenv *e) {
+  if (!e->retired) {
+    return;
+  }
+  unsigned long oldest = lenv_shared(e) ? lepoch_oldest() : ULONG_MAX;
+  lretired **p = &e->retired;
+  while (*p) {
+    lretired *r = *p;
+    if (r->epoch < oldest) {
+      *p = r->next;
+      lretired_free(r);
+    } else {
+      p = &r->next;
+    }
+  }
+}
+
+/* Put b in slot i of e's table, or add it if i is the table's count. The
+ * slot is filled before it is counted, and a full table is copied to a
+ * bigger one, so readers on other threads always see a whole binding */
+void lenv_table_set(lenv *e, int i, lbinding *b) {
+  lenv_drain(e);
+  lenv_table *t = e->tab;
+  if (i == t->count && t->count == t->capacity) {
+    lenv_table *x = lenv_table_new(t->capacity * 2);
+    x->count = t->count;
+    memcpy(x->syms, t->syms, sizeof(char *) * t->count);
+    memcpy(x->binds, t->binds, sizeof(lbinding *) * t->count);
+    __atomic_store_n(&e->tab, x, __ATOMIC_SEQ_CST);
+    lenv_retire(e, NULL, t);
+    t = x;
+  }
+  lbinding *old = i < t->count ? t->binds[i] : NULL;
+  __atomic_store_n(&t->syms[i], b->sym, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&t->binds[i], b, __ATOMIC_SEQ_CST);
+  if (old) {
+    lenv_retire(e, old, NULL);
+  } else {
+    __atomic_store_n(&t->count, t->count + 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* An empty environment owned by the current interpreter */
+lenv *lenv_new() {
+  lenv *e = malloc(sizeof(lenv));
+  e->tab = lenv_table_new(16);
+  e->version = 0;
+  e->refs = 1;
+  e->parent = NULL;
+  e->retired = NULL;
+  return e;
+}
+
+/* Let go of e. Environments shared from it hold it until they are
+ * deleted too, so the last of them may free it on another thread */
+void lenv_del(lenv *e) {
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  lenv_table *t = e->tab;
+  for (int i = 0; i < t->count; i++) {
+    lbinding_del(t->binds[i]);
+  }
+  lenv_table_free(t);
+  while (e->retired) {
+    lretired *r = e->retired;
+    e->retired = r->next;
+    lretired_free(r);
+  }
+  if (e->parent) {
+    lenv_del(e->parent);
+  }
+  free(e);
+}
+
+/* A new environment for the current interpreter that looks up e's
+ * bindings after its own, seeing every later def made in e. Nothing is
+ * copied: e's owner changes its table so that it can be read meanwhile */
+lenv *lenv_share(lenv *e) {
+  lenv *x = lenv_new();
+  x->parent = e;
+  __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+  x->version = e->version;
+  return x;
+}
+
+/* The slot of sym in e's own table, or -1 */
+int lenv_slot(lenv *e, char *sym) {
+  lenv_table *t = e->tab;
+  for (int i = 0; i < t->count; i++) {
+    if (strcmp(t->syms[i], sym) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* The binding of sym in the environments e was shared from, whose owners
+ * may be changing them meanwhile. Readers' private copies are passed
+ * over, since they may be out of date. The caller has entered an epoch */
+lbinding *lenv_find_shared(lenv *e, char *sym) {
+  for (lenv *p = e->parent; p; p = p->parent) {
+    lenv_table *t = __atomic_load_n(&p->tab, __ATOMIC_SEQ_CST);
+    int n = __atomic_load_n(&t->count, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < n; i++) {
+      if (strcmp(__atomic_load_n(&t->syms[i], __ATOMIC_SEQ_CST), sym) == 0) {
+        lbinding *b = __atomic_load_n(&t->binds[i], __ATOMIC_SEQ_CST);
+        if (!b->src) {
+          return b;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Macros and memoised functions keep caches only one thread may use, so
+ * a reader works on a private copy of a shared one */
+int lenv_private(lval *v) {
+  return v->type == LVAL_MACRO || (v->type == LVAL_FUN && v->cache);
+}
+
+/* Look up sym without copying, setting *shared if the value belongs to an
+ * environment e was shared from. Such a value stays valid only until the
+ * interpreter leaves its epoch */
+lval *lenv_lookup(lenv *e, char *sym, int *shared) {
+  *shared = 0;
+  /* Names bound by match come before the environment's own */
+  if (linterp_current->scope) {
+    lval *x = lmatch_peek(e, sym);
+    if (x) {
+      return x;
+    }
+  }
+
+  int i = lenv_slot(e, sym);
+  lbinding *b = i < 0 ? NULL : e->tab->binds[i];
+  if (!e->parent || (b && !b->src)) {
+    return b ? b->val : NULL;
+  }
+
+  lepoch_enter(linterp_current);
+  lbinding *s = lenv_find_shared(e, sym);
+  if (!s) {
+    return NULL;
+  }
+  if (!lenv_private(s->val)) {
+    *shared = 1;
+    return s->val;
+  }
+  if (b && b->src == s->id) {
+    return b->val;
+  }
+  /* Copied again whenever the shared binding has been replaced */
+  linterp_current->arena.heap_depth++;
+  lbinding *x = lbinding_new(sym, lval_clone(s->val));
+  linterp_current->arena.heap_depth--;
+  x->src = s->id;
+  lenv_table_set(e, b ? i : e->tab->count, x);
+  return x->val;
+}
+
+lval *lenv_get(lenv *e, lval *k) {
+  int shared;
+  lval *x = lenv_lookup(e, k->sym, &shared);
+  /* If it is bound return a copy of the value. One from a shared
+   * environment is cloned, as its owner counts some references to it
+   * without atomics */
+  if (x) {
+    x = shared ? lval_clone(x) : lval_copy(x);
+  }
+  lepoch_leave(linterp_current);
+  /* If no symbol found return error */
+  return x ? x : lerr("unbound symbol!");
+}
+
+/* Look up a symbol without copying, returning NULL if unbound */
+lval *lenv_peek(lenv *e, char *sym) {
+  int shared;
+  return lenv_lookup(e, sym, &shared);
+}
+
+void lenv_put(lenv *e, lval *k, lval *v) {
+  e->version++;
+
+  /* Iterate over all items in environment */
+  /* This is to see if variable already exists */
+  int i = lenv_slot(e, k->sym);
+  if (i >= 0) {
+    /* Replace its value in place while no reader can see it */
+    lbinding *b = e->tab->binds[i];
+    if (!lenv_shared(e) && !b->src) {
+      lenv_drain(e);
+      lval_del(b->val);
+      b->val = lval_copy_heap(v);
+      return;
+    }
+  }
+
+  /* Otherwise swap in a new binding, or add one if none was found */
+  lenv_table_set(e, i >= 0 ? i : e->tab->count,
+                 lbinding_new(k->sym, lval_copy_heap(v)));
+}
+
+/* LRU cache keyed by structural hash/equality of lvals */
+typedef struct lcache_entry {
+  unsigned long hash;
+  lval *key;
+  lval *val;
+  /* Chain within a hash bucket */
+  struct lcache_entry *next;
+  /* Recency list, most recently used first */
+  struct lcache_entry *newer;
+  struct lcache_entry *older;
+} lcache_entry;
+
+typedef struct lcache {
+  int refs;
+  int capacity;
+  int count;
+  int nbuckets;
+  lcache_entry **buckets;
+  lcache_entry *newest;
+  lcache_entry *oldest;
+  long hits;
+  long misses;
+} lcache;
+
+lcache *lcache_new(int capacity) {
+  lcache *c = malloc(sizeof(lcache));
+  c->refs = 1;
+  c->capacity = capacity;
+  c->count = 0;
+  /* Keep the load factor at or below one half */
+  c->nbuckets = 8;
+  while (c->nbuckets < capacity * 2) {
+    c->nbuckets *= 2;
+  }
+  c->buckets = calloc(c->nbuckets, sizeof(lcache_entry *));
+  c->newest = NULL;
+  c->oldest = NULL;
+  c->hits = 0;
+  c->misses = 0;
+  return c;
+}
+
+void lcache_retain(lcache *c) {
+  if (c) {
+    c->refs++;
+  }
+}
+
+void lcache_release(lcache *c) {
+  if (!c || --c->refs > 0) {
+    return;
+  }
+  lcache_entry *n = c->newest;
+  while (n) {
+    lcache_entry *older = n->older;
+    lval_del(n->key);
+    lval_del(n->val);
+    free(n);
+    n = older;
+  }
+  free(c->buckets);
+  free(c);
+}
+
+/* Unlink an entry from the recency list */
+void lcache_unlink(lcache *c, lcache_entry *n) {
+  if (n->newer) {
+    n->newer->older = n->older;
+  } else {
+    c->newest = n->older;
+  }
+  if (n->older) {
+    n->older->newer = n->newer;
+  } else {
+    c->oldest = n->newer;
+  }
+}
+
+/* Put an entry at the most recently used end */
+void lcache_push(lcache *c, lcache_entry *n) {
+  n->newer = NULL;
+  n->older = c->newest;
+  if (c->newest) {
+    c->newest->newer = n;
+  }
+  c->newest = n;
+  if (!c->oldest) {
+    c->oldest = n;
+  }
+}
+
+/* Look up a key, returning the cached value (still owned by the cache) */
+lval *lcache_get(lcache *c, lval *k) {
+  unsigned long h = lval_hash(k);
+  lcache_entry *n = c->buckets[h & (c->nbuckets - 1)];
+  while (n) {
+    if (n->hash == h && lval_eq(n->key, k)) {
+      lcache_unlink(c, n);
+      lcache_push(c, n);
+      c->hits++;
+      return n->val;
+    }
+    n = n->next;
+  }
+  c->misses++;
+  return NULL;
+}
+
+/* Insert a key/value pair, taking ownership of both */
+void lcache_put(lcache *c, lval *k, lval *v) {
+  if (c->capacity <= 0) {
+    lval_del(k);
+    lval_del(v);
+    return;
+  }
+
+  /* Cached values outlive the form that produced them */
+  k = lval_promote(k);
+  v = lval_promote(v);
+
+  /* Evict the least recently used entry when full */
+  if (c->count >= c->capacity) {
+    lcache_entry *old = c->oldest;
+    lcache_entry **p = &c->buckets[old->hash & (c->nbuckets - 1)];
+    while (*p != old) {
+      p = &(*p)->next;
+    }
+    *p = old->next;
+    lcache_unlink(c, old);
+    lval_del(old->key);
+    lval_del(old->val);
+    free(old);
+    c->count--;
+  }
+
+  lcache_entry *n = malloc(sizeof(lcache_entry));
+  n->hash = lval_hash(k);
+  n->key = k;
+  n->val = v;
+  n->next = c->buckets[n->hash & (c->nbuckets - 1)];
+  c->buckets[n->hash & (c->nbuckets - 1)] = n;
+  lcache_push(c, n);
+  c->count++;
+}
+
+/* The start of each entry of a table of things compiled from forms, such
+ * as decision trees and native code, found by structural hash/equality */
+typedef struct lform_key {
+  unsigned long hash;
+  /* Heap copy of the source form, or NULL for an empty entry */
+  lval *form;
+} lform_key;
+
+/* The entry for v in an open-addressed table of n entries of size bytes,
+ * each starting with an lform_key. A new entry holds a heap copy of v and
+ * sets *fresh for the caller to compile; when the table is full it is
+ * emptied with flush first, rather than probed forever */
+void *lform_lookup(void *table, size_t size, int n, lval *v,
+                   void (*flush)(void), int *fresh) {
+  unsigned long h = lval_hash(v);
+  *fresh = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < n; i++) {
+      lform_key *k =
+          (lform_key *)((char *)table + ((h + i) & (n - 1)) * size);
+      if (!k->form) {
+        k->hash = h;
+        k->form = lval_copy_heap(v);
+        *fresh = 1;
+        return k;
+      }
+      if (k->hash == h && lval_eq(k->form, v)) {
+        return k;
+      }
+    }
+    flush();
+  }
+  return NULL;
+}
+
+/* Maps
+ *
+ * A map is either a mutable open-addressing hash table, a persistent
+ * hash array mapped trie (HAMT) or a persistent B-tree ordered by its
+ * Number keys. All are shared between copies; a table is cloned before
+ * it is changed if anyone else can still see it, while the trees only
+ * copy the path down to the changed entry.
+ */
+
+enum { LMAP_HASH, LMAP_HAMT, LMAP_BTREE };
+
+#define LMAP_MIN_CAPACITY 8
+/* Bits of the hash consumed at each level of the trie */
+#define LHAMT_BITS 5
+#define LHAMT_MASK ((1UL << LHAMT_BITS) - 1)
+
+int lpopcount(unsigned long x) {
+#ifdef __GNUC__
+  return __builtin_popcountl(x);
+#else
+  int n = 0;
+  for (; x; x &= x - 1) {
+    n++;
+  }
+  return n;
+#endif
+}
+
+/* Index of the lowest set bit of a nonzero word */
+int lctz(unsigned long x) {
+#ifdef __GNUC__
+  return __builtin_ctzl(x);
+#else
+  int n = 0;
+  for (; !(x & 1); x >>= 1) {
+    n++;
+  }
+  return n;
+#endif
+}
+
+typedef struct lmap_slot {
+  unsigned long hash;
+  /* NULL when the slot has never been used */
+  lval *key;
+  lval *val;
+} lmap_slot;
+
+/* Marks a slot whose entry was removed, so probing continues past it */
+static lval lmap_tombstone;
+
+/* Trie nodes and leaves are refcounted so versions can share them */
+typedef struct lhamt_item {
+  int refs;
+  int leaf;
+} lhamt_item;
+
+typedef struct lhamt_leaf {
+  lhamt_item item;
+  unsigned long hash;
+  lval *key;
+  lval *val;
+} lhamt_leaf;
+
+typedef struct lhamt_node {
+  lhamt_item item;
+  /* One bit per occupied child; collision nodes below the last level
+   * leave it zero and hold count leaves with the same hash */
+  unsigned int bitmap;
+  int count;
+  lhamt_item *slots[];
+} lhamt_node;
+
+/* Ordered maps are B-trees whose nodes keep their keys in one cache line.
+ * Like trie nodes they are refcounted; a shared node is copied before it
+ * is changed, so updating an ordered map copies only the nodes it visits */
+
+#define LBTREE_LINE 64
+#define LBTREE_SLOTS (LBTREE_LINE / (int)sizeof(long))
+/* Minimum degree: nodes other than the root hold T-1 to 2T-1 keys */
+#define LBTREE_T (LBTREE_SLOTS / 2)
+#define LBTREE_MAX (2 * LBTREE_T - 1)
+
+typedef struct lbtree_node {
+  long keys[LBTREE_SLOTS];
+  /* Values, or NULL throughout for sorted sets */
+  lval *vals[LBTREE_SLOTS];
+  struct lbtree_node *kids[LBTREE_SLOTS + 1];
+  int refs;
+  int count;
+  int leaf;
+} lbtree_node;
+
+lbtree_node *lbtree_node_new(int leaf) {
+  void *p = NULL;
+  if (posix_memalign(&p, LBTREE_LINE, sizeof(lbtree_node)) != 0) {
+    p = malloc(sizeof(lbtree_node));
+  }
+  lbtree_node *n = p;
+  n->refs = 1;
+  n->count = 0;
+  n->leaf = leaf;
+  return n;
+}
+
+void lbtree_release(lbtree_node *n) {
+  if (!n || --n->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < n->count; i++) {
+    if (n->vals[i]) {
+      lval_del(n->vals[i]);
+    }
+  }
+  for (int i = 0; !n->leaf && i <= n->count; i++) {
+    lbtree_release(n->kids[i]);
+  }
+  free(n);
+}
+
+/* Make *p a node only this path refers to, copying it if it is shared */
+lbtree_node *lbtree_own(lbtree_node **p) {
+  lbtree_node *n = *p;
+  if (n->refs == 1) {
+    return n;
+  }
+  lbtree_node *x = lbtree_node_new(n->leaf);
+  x->count = n->count;
+  memcpy(x->keys, n->keys, sizeof(long) * n->count);
+  for (int i = 0; i < n->count; i++) {
+    x->vals[i] = n->vals[i] ? lval_copy_heap(n->vals[i]) : NULL;
+  }
+  for (int i = 0; !n->leaf && i <= n->count; i++) {
+    x->kids[i] = n->kids[i];
+    x->kids[i]->refs++;
+  }
+  n->refs--;
+  *p = x;
+  return x;
+}
+
+/* Index of the first key not less than key; the keys fit in a cache line
+ * so a linear scan beats a binary search */
+int lbtree_find(lbtree_node *n, long key) {
+  int i = 0;
+  while (i < n->count && n->keys[i] < key) {
+    i++;
+  }
+  return i;
+}
+
+int lbtree_get(lbtree_node *n, long key, lval **val) {
+  while (n) {
+    int i = lbtree_find(n, key);
+    if (i < n->count && n->keys[i] == key) {
+      *val = n->vals[i];
+      return 1;
+    }
+    n = n->leaf ? NULL : n->kids[i];
+  }
+  return 0;
+}
+
+/* Split the full child i of x, moving its median key up into x */
+void lbtree_split(lbtree_node *x, int i) {
+  lbtree_node *y = x->kids[i];
+  lbtree_node *z = lbtree_node_new(y->leaf);
+  z->count = LBTREE_T - 1;
+  memcpy(z->keys, &y->keys[LBTREE_T], sizeof(long) * z->count);
+  memcpy(z->vals, &y->vals[LBTREE_T], sizeof(lval *) * z->count);
+  if (!y->leaf) {
+    memcpy(z->kids, &y->kids[LBTREE_T], sizeof(lbtree_node *) * LBTREE_T);
+  }
+  y->count = LBTREE_T - 1;
+
+  memmove(&x->keys[i + 1], &x->keys[i], sizeof(long) * (x->count - i));
+  memmove(&x->vals[i + 1], &x->vals[i], sizeof(lval *) * (x->count - i));
+  memmove(&x->kids[i + 2], &x->kids[i + 1],
+          sizeof(lbtree_node *) * (x->count - i));
+  x->keys[i] = y->keys[LBTREE_T - 1];
+  x->vals[i] = y->vals[LBTREE_T - 1];
+  x->kids[i + 1] = z;
+  x->count++;
+}
+
+/* Bind key to val in the tree at *root, consuming val. Returns 1 if the
+ * key is new */
+int lbtree_put(lbtree_node **root, long key, lval *val) {
+  if (!*root) {
+    *root = lbtree_node_new(1);
+  }
+  lbtree_node *x = lbtree_own(root);
+  if (x->count == LBTREE_MAX) {
+    lbtree_node *r = lbtree_node_new(0);
+    r->kids[0] = x;
+    lbtree_split(r, 0);
+    *root = x = r;
+  }
+
+  for (;;) {
+    int i = lbtree_find(x, key);
+    if (i < x->count && x->keys[i] == key) {
+      if (x->vals[i]) {
+        lval_del(x->vals[i]);
+      }
+      x->vals[i] = val;
+      return 0;
+    }
+    if (x->leaf) {
+      memmove(&x->keys[i + 1], &x->keys[i], sizeof(long) * (x->count - i));
+      memmove(&x->vals[i + 1], &x->vals[i], sizeof(lval *) * (x->count - i));
+      x->keys[i] = key;
+      x->vals[i] = val;
+      x->count++;
+      return 1;
+    }
+
+    /* Split full children on the way down so there is always room */
+    if (lbtree_own(&x->kids[i])->count == LBTREE_MAX) {
+      lbtree_split(x, i);
+      if (x->keys[i] == key) {
+        continue;
+      }
+      if (key > x->keys[i]) {
+        i++;
+      }
+    }
+    x = x->kids[i];
+  }
+}
+
+/* Merge child i+1 of x and the key between them into child i */
+void lbtree_merge(lbtree_node *x, int i) {
+  lbtree_node *y = lbtree_own(&x->kids[i]);
+  lbtree_node *z = lbtree_own(&x->kids[i + 1]);
+  y->keys[y->count] = x->keys[i];
+  y->vals[y->count] = x->vals[i];
+  memcpy(&y->keys[y->count + 1], z->keys, sizeof(long) * z->count);
+  memcpy(&y->vals[y->count + 1], z->vals, sizeof(lval *) * z->count);
+  if (!y->leaf) {
+    memcpy(&y->kids[y->count + 1], z->kids,
+           sizeof(lbtree_node *) * (z->count + 1));
+  }
+  y->count += z->count + 1;
+  /* z's contents now belong to y */
+  free(z);
+
+  memmove(&x->keys[i], &x->keys[i + 1], sizeof(long) * (x->count - i - 1));
+  memmove(&x->vals[i], &x->vals[i + 1], sizeof(lval *) * (x->count - i - 1));
+  memmove(&x->kids[i + 1], &x->kids[i + 2],
+          sizeof(lbtree_node *) * (x->count - i - 1));
+  x->count--;
+}
+
+/* Make sure child i of x has at least T keys before descending into it,
+ * returning the index of the child that now covers the same keys */
+int lbtree_fill(lbtree_node *x, int i) {
+  lbtree_node *c = lbtree_own(&x->kids[i]);
+  if (c->count >= LBTREE_T) {
+    return i;
+  }
+
+  if (i > 0 && x->kids[i - 1]->count >= LBTREE_T) {
+    /* Rotate the last key of the left sibling through x */
+    lbtree_node *l = lbtree_own(&x->kids[i - 1]);
+    memmove(&c->keys[1], c->keys, sizeof(long) * c->count);
+    memmove(&c->vals[1], c->vals, sizeof(lval *) * c->count);
+    if (!c->leaf) {
+      memmove(&c->kids[1], c->kids, sizeof(lbtree_node *) * (c->count + 1));
+      c->kids[0] = l->kids[l->count];
+    }
+    c->keys[0] = x->keys[i - 1];
+    c->vals[0] = x->vals[i - 1];
+    c->count++;
+    x->keys[i - 1] = l->keys[l->count - 1];
+    x->vals[i - 1] = l->vals[l->count - 1];
+    l->count--;
+    return i;
+  }
+
+  if (i < x->count && x->kids[i + 1]->count >= LBTREE_T) {
+    /* Rotate the first key of the right sibling through x */
+    lbtree_node *r = lbtree_own(&x->kids[i + 1]);
+    c->keys[c->count] = x->keys[i];
+    c->vals[c->count] = x->vals[i];
+    if (!c->leaf) {
+      c->kids[c->count + 1] = r->kids[0];
+      memmove(r->kids, &r->kids[1], sizeof(lbtree_node *) * r->count);
+    }
+    c->count++;
+    x->keys[i] = r->keys[0];
+    x->vals[i] = r->vals[0];
+    memmove(r->keys, &r->keys[1], sizeof(long) * (r->count - 1));
+    memmove(r->vals, &r->vals[1], sizeof(lval *) * (r->count - 1));
+    r->count--;
+    return i;
+  }
+
+  if (i < x->count) {
+    lbtree_merge(x, i);
+    return i;
+  }
+  lbtree_merge(x, i - 1);
+  return i - 1;
+}
+
+/* Remove key from the subtree at x, which is already owned and has at
+ * least T keys unless it is the root. The removed value goes to *val */
+int lbtree_delete(lbtree_node *x, long key, lval **val) {
+  for (;;) {
+    int i = lbtree_find(x, key);
+    if (i < x->count && x->keys[i] == key) {
+      if (x->leaf) {
+        *val = x->vals[i];
+        memmove(&x->keys[i], &x->keys[i + 1],
+                sizeof(long) * (x->count - i - 1));
+        memmove(&x->vals[i], &x->vals[i + 1],
+                sizeof(lval *) * (x->count - i - 1));
+        x->count--;
+        return 1;
+      }
+
+      /* Replace the key with its predecessor or successor, or merge */
+      if (x->kids[i]->count >= LBTREE_T) {
+        lbtree_node *y = lbtree_own(&x->kids[i]);
+        lbtree_node *p = y;
+        while (!p->leaf) {
+          p = p->kids[p->count];
+        }
+        long pred = p->keys[p->count - 1];
+        *val = x->vals[i];
+        lbtree_delete(y, pred, &x->vals[i]);
+        x->keys[i] = pred;
+        return 1;
+      }
+      if (x->kids[i + 1]->count >= LBTREE_T) {
+        lbtree_node *z = lbtree_own(&x->kids[i + 1]);
+        lbtree_node *s = z;
+        while (!s->leaf) {
+          s = s->kids[0];
+        }
+        long succ = s->keys[0];
+        *val = x->vals[i];
+        lbtree_delete(z, succ, &x->vals[i]);
+        x->keys[i] = succ;
+        return 1;
+      }
+      lbtree_merge(x, i);
+      x = x->kids[i];
+      continue;
+    }
+
+    if (x->leaf) {
+      return 0;
+    }
+    x = x->kids[lbtree_fill(x, i)];
+  }
+}
+
+int lbtree_remove(lbtree_node **root, long key) {
+  if (!*root) {
+    return 0;
+  }
+  lval *val = NULL;
+  lbtree_node *r = lbtree_own(root);
+  int removed = lbtree_delete(r, key, &val);
+  if (val) {
+    lval_del(val);
+  }
+
+  /* An emptied root hands over to its only child */
+  if (r->count == 0) {
+    *root = r->leaf ? NULL : r->kids[0];
+    free(r);
+  }
+  return removed;
+}
+
+/* Largest number of keys a tree of the given height can hold */
+long lbtree_capacity(int height) {
+  long cap = 0;
+  for (int h = 0; h < height && cap < LONG_MAX / (LBTREE_MAX + 1); h++) {
+    cap = cap * (LBTREE_MAX + 1) + LBTREE_MAX;
+  }
+  return cap;
+}
+
+/* Build a tree of exactly the given height from n sorted entries, spread
+ * evenly so every node stays within its bounds */
+lbtree_node *lbtree_build(long *keys, lval **vals, long n, int height) {
+  lbtree_node *x = lbtree_node_new(height == 1);
+  if (height == 1) {
+    x->count = n;
+    memcpy(x->keys, keys, sizeof(long) * n);
+    memcpy(x->vals, vals, sizeof(lval *) * n);
+    return x;
+  }
+  long below = lbtree_capacity(height - 1);
+  long kids = (n + 1 + below) / (below + 1);
+  kids = kids < 2 ? 2 : kids;
+
+  long rest = n - (kids - 1);
+  long at = 0;
+  for (long k = 0; k < kids; k++) {
+    long m = rest / kids + (k < rest % kids);
+    x->kids[k] = lbtree_build(&keys[at], &vals[at], m, height - 1);
+    at += m;
+    if (k < kids - 1) {
+      x->keys[k] = keys[at];
+      x->vals[k] = vals[at];
+      at++;
+    }
+  }
+  x->count = kids - 1;
+  return x;
+}
+
+/* Bulk load n entries with strictly ascending keys in O(n) */
+lbtree_node *lbtree_load(long *keys, lval **vals, long n) {
+  if (n == 0) {
+    return NULL;
+  }
+  int height = 1;
+  while (lbtree_capacity(height) < n) {
+    height++;
+  }
+  return lbtree_build(keys, vals, n, height);
+}
+
+typedef void (*lbtree_fn)(long key, lval *val, void *ctx);
+
+/* Visit the entries with lo <= key <= hi in order */
+void lbtree_range(lbtree_node *n, long lo, long hi, lbtree_fn f, void *ctx) {
+  if (!n) {
+    return;
+  }
+  for (int i = lbtree_find(n, lo); i <= n->count; i++) {
+    if (!n->leaf) {
+      lbtree_range(n->kids[i], lo, hi, f, ctx);
+    }
+    if (i == n->count || n->keys[i] > hi) {
+      return;
+    }
+    f(n->keys[i], n->vals[i], ctx);
+  }
+}
+
+typedef struct lmap {
+  int refs;
+  int kind;
+  long count;
+  /* LMAP_HASH */
+  long capacity;
+  long tombstones;
+  lmap_slot *slots;
+  /* LMAP_HAMT */
+  lhamt_node *root;
+  /* LMAP_BTREE, which has no values when set is nonzero */
+  lbtree_node *tree;
+  int set;
+} lmap;
+
+lmap *lmap_new(int kind) {
+  lmap *m = malloc(sizeof(lmap));
+  m->refs = 1;
+  m->kind = kind;
+  m->count = 0;
+  m->capacity = 0;
+  m->tombstones = 0;
+  m->slots = NULL;
+  m->root = NULL;
+  m->tree = NULL;
+  m->set = 0;
+  if (kind == LMAP_HASH) {
+    m->capacity = LMAP_MIN_CAPACITY;
+    m->slots = calloc(m->capacity, sizeof(lmap_slot));
+  }
+  return m;
+}
+
+void lhamt_release(lhamt_item *it) {
+  if (!it || --it->refs > 0) {
+    return;
+  }
+  if (it->leaf) {
+    lhamt_leaf *l = (lhamt_leaf *)it;
+    lval_del(l->key);
+    lval_del(l->val);
+  } else {
+    lhamt_node *n = (lhamt_node *)it;
+    for (int i = 0; i < n->count; i++) {
+      lhamt_release(n->slots[i]);
+    }
+  }
+  free(it);
+}
+
+void lmap_retain(lmap *m) { m->refs++; }
+
+void lmap_release(lmap *m) {
+  if (--m->refs > 0) {
+    return;
+  }
+  for (long i = 0; i < m->capacity; i++) {
+    lval *k = m->slots[i].key;
+    if (k && k != &lmap_tombstone) {
+      lval_del(k);
+      lval_del(m->slots[i].val);
+    }
+  }
+  free(m->slots);
+  lhamt_release((lhamt_item *)m->root);
+  lbtree_release(m->tree);
+  free(m);
+}
+
+/* Slot holding k, or the slot it would be inserted into */
+lmap_slot *lmap_find(lmap *m, unsigned long hash, lval *k) {
+  unsigned long mask = m->capacity - 1;
+  lmap_slot *free_slot = NULL;
+  for (unsigned long i = hash & mask;; i = (i + 1) & mask) {
+    lmap_slot *s = &m->slots[i];
+    if (!s->key) {
+      return free_slot ? free_slot : s;
+    }
+    if (s->key == &lmap_tombstone) {
+      if (!free_slot) {
+        free_slot = s;
+      }
+    } else if (s->hash == hash && lval_eq(s->key, k)) {
+      return s;
+    }
+  }
+}
+
+void lmap_rehash(lmap *m, long capacity) {
+  lmap_slot *old = m->slots;
+  long oldcap = m->capacity;
+  m->slots = calloc(capacity, sizeof(lmap_slot));
+  m->capacity = capacity;
+  m->tombstones = 0;
+  for (long i = 0; i < oldcap; i++) {
+    if (old[i].key && old[i].key != &lmap_tombstone) {
+      unsigned long mask = capacity - 1;
+      unsigned long j = old[i].hash & mask;
+      while (m->slots[j].key) {
+        j = (j + 1) & mask;
+      }
+      m->slots[j] = old[i];
+    }
+  }
+  free(old);
+}
+
+lhamt_node *lhamt_node_new(int count) {
+  lhamt_node *n = malloc(sizeof(lhamt_node) + sizeof(lhamt_item *) * count);
+  n->item.refs = 1;
+  n->item.leaf = 0;
+  n->bitmap = 0;
+  n->count = count;
+  return n;
+}
+
+/* Copy of n with slot i replaced by it (or removed if it is NULL),
+ * or with it inserted at i if insert is set */
+lhamt_node *lhamt_node_edit(lhamt_node *n, int i, lhamt_item *it,
+                            int insert) {
+  int count = n->count + (insert ? 1 : it ? 0 : -1);
+  lhamt_node *x = lhamt_node_new(count);
+  x->bitmap = n->bitmap;
+  int j = 0;
+  for (int k = 0; k < n->count; k++) {
+    if (k == i) {
+      if (it) {
+        x->slots[j++] = it;
+      }
+      if (!insert) {
+        continue;
+      }
+    }
+    n->slots[k]->refs++;
+    x->slots[j++] = n->slots[k];
+  }
+  if (insert && i == n->count) {
+    x->slots[j] = it;
+  }
+  return x;
+}
+
+lval *lhamt_get(lhamt_node *n, unsigned long hash, lval *k) {
+  for (int shift = 0; n; shift += LHAMT_BITS) {
+    if (shift >= (int)(sizeof(long) * 8)) {
+      for (int i = 0; i < n->count; i++) {
+        lhamt_leaf *l = (lhamt_leaf *)n->slots[i];
+        if (lval_eq(l->key, k)) {
+          return l->val;
+        }
+      }
+      return NULL;
+    }
+    unsigned int bit = 1u << ((hash >> shift) & LHAMT_MASK);
+    if (!(n->bitmap & bit)) {
+      return NULL;
+    }
+    lhamt_item *it = n->slots[lpopcount(n->bitmap & (bit - 1))];
+    if (it->leaf) {
+      lhamt_leaf *l = (lhamt_leaf *)it;
+      return l->hash == hash && lval_eq(l->key, k) ? l->val : NULL;
+    }
+    n = (lhamt_node *)it;
+  }
+  return NULL;
+}
+
+/* New version of n with leaf l added, consuming l; n itself is untouched */
+lhamt_node *lhamt_put(lhamt_node *n, int shift, lhamt_leaf *l, int *added) {
+  if (shift >= (int)(sizeof(long) * 8)) {
+    for (int i = 0; n && i < n->count; i++) {
+      if (lval_eq(((lhamt_leaf *)n->slots[i])->key, l->key)) {
+        return lhamt_node_edit(n, i, &l->item, 0);
+      }
+    }
+    *added = 1;
+    if (!n) {
+      lhamt_node *x = lhamt_node_new(1);
+      x->slots[0] = &l->item;
+      return x;
+    }
+    return lhamt_node_edit(n, n->count, &l->item, 1);
+  }
+
+  unsigned int bit = 1u << ((l->hash >> shift) & LHAMT_MASK);
+  if (!n || !(n->bitmap & bit)) {
+    *added = 1;
+    if (!n) {
+      lhamt_node *x = lhamt_node_new(1);
+      x->bitmap = bit;
+      x->slots[0] = &l->item;
+      return x;
+    }
+    lhamt_node *x = lhamt_node_edit(
+        n, lpopcount(n->bitmap & (bit - 1)), &l->item, 1);
+    x->bitmap |= bit;
+    return x;
+  }
+
+  int i = lpopcount(n->bitmap & (bit - 1));
+  lhamt_item *it = n->slots[i];
+  if (!it->leaf) {
+    lhamt_node *sub = lhamt_put((lhamt_node *)it, shift + LHAMT_BITS, l, added);
+    return lhamt_node_edit(n, i, &sub->item, 0);
+  }
+  lhamt_leaf *old = (lhamt_leaf *)it;
+  if (old->hash == l->hash && lval_eq(old->key, l->key)) {
+    return lhamt_node_edit(n, i, &l->item, 0);
+  }
+
+  /* Two keys share this slot: push both down a level */
+  old->item.refs++;
+  int ignored = 0;
+  lhamt_node *sub = lhamt_put(NULL, shift + LHAMT_BITS, old, &ignored);
+  lhamt_node *both = lhamt_put(sub, shift + LHAMT_BITS, l, added);
+  lhamt_release(&sub->item);
+  return lhamt_node_edit(n, i, &both->item, 0);
+}
+
+/* New version of n without k, or NULL if it would be empty. When k is
+ * absent n is returned with an extra reference */
+lhamt_node *lhamt_remove(lhamt_node *n, int shift, unsigned long hash,
+                         lval *k, int *removed) {
+  int i = -1;
+  if (shift >= (int)(sizeof(long) * 8)) {
+    for (int j = 0; j < n->count; j++) {
+      if (lval_eq(((lhamt_leaf *)n->slots[j])->key, k)) {
+        i = j;
+      }
+    }
+  } else {
+    unsigned int bit = 1u << ((hash >> shift) & LHAMT_MASK);
+    if (n->bitmap & bit) {
+      i = lpopcount(n->bitmap & (bit - 1));
+      lhamt_item *it = n->slots[i];
+      if (!it->leaf) {
+        lhamt_node *sub =
+            lhamt_remove((lhamt_node *)it, shift + LHAMT_BITS, hash, k, removed);
+        if (!*removed) {
+          lhamt_release(&sub->item);
+          n->item.refs++;
+          return n;
+        }
+        if (sub) {
+          return lhamt_node_edit(n, i, &sub->item, 0);
+        }
+      } else if (!lval_eq(((lhamt_leaf *)it)->key, k)) {
+        i = -1;
+      }
+    }
+    if (i >= 0 && n->count > 1) {
+      lhamt_node *x = lhamt_node_edit(n, i, NULL, 0);
+      x->bitmap &= ~bit;
+      *removed = 1;
+      return x;
+    }
+  }
+
+  if (i < 0) {
+    n->item.refs++;
+    return n;
+  }
+  *removed = 1;
+  return n->count == 1 ? NULL : lhamt_node_edit(n, i, NULL, 0);
+}
+
+/* Whether m holds k, setting *val to its borrowed value */
+int lmap_lookup(lmap *m, lval *k, lval **val) {
+  if (m->kind == LMAP_BTREE) {
+    return k->type == LVAL_NUM && lbtree_get(m->tree, k->num, val);
+  }
+  unsigned long hash = lval_hash(k);
+  if (m->kind == LMAP_HAMT) {
+    *val = lhamt_get(m->root, hash, k);
+    return *val != NULL;
+  }
+  lmap_slot *s = lmap_find(m, hash, k);
+  *val = s->val;
+  return s->key && s->key != &lmap_tombstone;
+}
+
+/* Borrowed value of k in m, or NULL */
+lval *lmap_get(lmap *m, lval *k) {
+  lval *val;
+  return lmap_lookup(m, k, &val) ? val : NULL;
+}
+
+/* A version of m that only the caller can see, consuming the caller's
+ * reference; tries share all their nodes with the original */
+lmap *lmap_unshare(lmap *m) {
+  if (m->refs == 1) {
+    return m;
+  }
+  lmap *x = lmap_new(m->kind);
+  x->count = m->count;
+  x->set = m->set;
+  if (m->kind == LMAP_BTREE) {
+    x->tree = m->tree;
+    if (x->tree) {
+      x->tree->refs++;
+    }
+  } else if (m->kind == LMAP_HAMT) {
+    x->root = m->root;
+    if (x->root) {
+      x->root->item.refs++;
+    }
+  } else {
+    free(x->slots);
+    x->capacity = m->capacity;
+    x->tombstones = m->tombstones;
+    x->slots = malloc(sizeof(lmap_slot) * m->capacity);
+    for (long i = 0; i < m->capacity; i++) {
+      x->slots[i] = m->slots[i];
+      lval *key = m->slots[i].key;
+      if (key && key != &lmap_tombstone) {
+        x->slots[i].key = lval_copy_heap(key);
+        x->slots[i].val = lval_copy_heap(m->slots[i].val);
+      }
+    }
+  }
+  m->refs--;
+  return x;
+}
+
+/* Bind k to v in an unshared map, consuming both. Ordered maps take
+ * Number keys only, and sets take no value */
+void lmap_put(lmap *m, lval *k, lval *v) {
+  if (m->kind == LMAP_BTREE) {
+    m->count += lbtree_put(&m->tree, k->num, v ? lval_promote(v) : NULL);
+    lval_del(k);
+    return;
+  }
+
+  unsigned long hash = lval_hash(k);
+  k = lval_promote(k);
+  v = lval_promote(v);
+
+  if (m->kind == LMAP_HAMT) {
+    lhamt_leaf *l = malloc(sizeof(lhamt_leaf));
+    l->item.refs = 1;
+    l->item.leaf = 1;
+    l->hash = hash;
+    l->key = k;
+    l->val = v;
+    int added = 0;
+    lhamt_node *root = lhamt_put(m->root, 0, l, &added);
+    lhamt_release((lhamt_item *)m->root);
+    m->root = root;
+    m->count += added;
+    return;
+  }
+
+  lmap_slot *s = lmap_find(m, hash, k);
+  if (s->key && s->key != &lmap_tombstone) {
+    lval_del(s->key);
+    lval_del(s->val);
+  } else {
+    if (s->key == &lmap_tombstone) {
+      m->tombstones--;
+    }
+    m->count++;
+  }
+  s->hash = hash;
+  s->key = k;
+  s->val = v;
+
+  /* Keep the table at most three quarters full, counting tombstones */
+  if ((m->count + m->tombstones) * 4 > m->capacity * 3) {
+    long capacity = m->capacity;
+    while (m->count * 2 > capacity) {
+      capacity *= 2;
+    }
+    lmap_rehash(m, capacity);
+  }
+}
+
+/* Remove k from an unshared map, returning whether it was there */
+int lmap_remove(lmap *m, lval *k) {
+  if (m->kind == LMAP_BTREE) {
+    int removed = k->type == LVAL_NUM && lbtree_remove(&m->tree, k->num);
+    m->count -= removed;
+    return removed;
+  }
+
+  unsigned long hash = lval_hash(k);
+  if (m->kind == LMAP_HAMT) {
+    if (!m->root) {
+      return 0;
+    }
+    int removed = 0;
+    lhamt_node *root = lhamt_remove(m->root, 0, hash, k, &removed);
+    lhamt_release(&m->root->item);
+    m->root = root;
+    m->count -= removed;
+    return removed;
+  }
+
+  lmap_slot *s = lmap_find(m, hash, k);
+  if (!s->key || s->key == &lmap_tombstone) {
+    return 0;
+  }
+  lval_del(s->key);
+  lval_del(s->val);
+  s->key = &lmap_tombstone;
+  s->val = NULL;
+  m->tombstones++;
+  m->count--;
+  return 1;
+}
+
+typedef void (*lmap_fn)(lval *k, lval *v, void *ctx);
+
+void lhamt_each(lhamt_item *it, lmap_fn f, void *ctx) {
+  if (!it) {
+    return;
+  }
+  if (it->leaf) {
+    lhamt_leaf *l = (lhamt_leaf *)it;
+    f(l->key, l->val, ctx);
+    return;
+  }
+  lhamt_node *n = (lhamt_node *)it;
+  for (int i = 0; i < n->count; i++) {
+    lhamt_each(n->slots[i], f, ctx);
+  }
+}
+
+typedef struct lmap_each_ctx {
+  lmap_fn f;
+  void *ctx;
+} lmap_each_ctx;
+
+void lmap_each_key(long key, lval *val, void *ctx) {
+  lmap_each_ctx *c = ctx;
+  lval k = {0};
+  k.type = LVAL_NUM;
+  k.num = key;
+  c->f(&k, val, c->ctx);
+}
+
+/* Call f on every entry of m; sets pass NULL values */
+void lmap_each(lmap *m, lmap_fn f, void *ctx) {
+  if (m->kind == LMAP_BTREE) {
+    lmap_each_ctx c = {f, ctx};
+    lbtree_range(m->tree, LONG_MIN, LONG_MAX, lmap_each_key, &c);
+    return;
+  }
+  if (m->kind == LMAP_HAMT) {
+    lhamt_each((lhamt_item *)m->root, f, ctx);
+    return;
+  }
+  for (long i = 0; i < m->capacity; i++) {
+    lval *k = m->slots[i].key;
+    if (k && k != &lmap_tombstone) {
+      f(k, m->slots[i].val, ctx);
+    }
+  }
+}
+
+void lmap_hash_entry(lval *k, lval *v, void *ctx) {
+  /* Entries are summed so the hash does not depend on their order */
+  *(unsigned long *)ctx += lhash_mix(lval_hash(k), v ? lval_hash(v) : 0);
+}
+
+unsigned long lmap_hash(lmap *m) {
+  unsigned long h = 0;
+  lmap_each(m, lmap_hash_entry, &h);
+  return lhash_mix((unsigned long)m->count, h);
+}
+
+typedef struct lmap_eq_ctx {
+  lmap *other;
+  int eq;
+} lmap_eq_ctx;
+
+void lmap_eq_entry(lval *k, lval *v, void *ctx) {
+  lmap_eq_ctx *c = ctx;
+  lval *w;
+  if (c->eq) {
+    c->eq = lmap_lookup(c->other, k, &w) && (v && w ? lval_eq(v, w) : v == w);
+  }
+}
+
+int lmap_eq(lmap *x, lmap *y) {
+  if (x == y) {
+    return 1;
+  }
+  if (x->count != y->count) {
+    return 0;
+  }
+  lmap_eq_ctx c = {y, 1};
+  lmap_each(x, lmap_eq_entry, &c);
+  return c.eq;
+}
+
+/*Construct a pointer to a new Map lval, taking ownership of map*/
+lval *lmapv(lmap *map) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_MAP;
+  v->map = map;
+  return v;
+}
+
+lval *lval_read_num(mpc_ast_t *t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ? lnum(x) : lerr("invalid number");
+}
+
+lval *lval_read_str(mpc_ast_t *t) {
+  /* Strip the quotes and resolve the escape sequences, counting the bytes
+   * as they are written so an escaped \0 stays part of the string */
+  long n = strlen(t->contents) - 2;
+  char *s = t->contents + 1;
+  char *unescaped = malloc(n + 1);
+  /* The escapes mpc accepts, and the bytes they stand for; any other
+   * escape is kept as it was written */
+  static const char from[] = "abfnrtv0\\'\"";
+  static const char to[] = "\a\b\f\n\r\t\v\0\\'\"";
+  long len = 0;
+  for (long i = 0; i < n; i++) {
+    char c = s[i];
+    char *e = c == '\\' && i + 1 < n ? strchr(from, s[i + 1]) : NULL;
+    if (e) {
+      c = to[e - from];
+      i++;
+    }
+    unescaped[len++] = c;
+  }
+  lval *str = lstrn(unescaped, len);
+  free(unescaped);
+  return str;
+}
+
+/* Box the numbers of a packed Qexpr into cells */
+lval *lval_unpack(lval *v) {
+  if (!v->nums) {
+    return v;
+  }
+  v->cell = lalloc(sizeof(lval *) * v->count);
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lnum(v->nums[i]);
+  }
+  lfree(v->nums);
+  v->nums = NULL;
+  return v;
+}
+
+/* Store a Qexpr of only numbers packed */
+lval *lval_pack(lval *v) {
+  if (v->type != LVAL_QEXPR || v->nums || v->count == 0) {
+    return v;
+  }
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_NUM) {
+      return v;
+    }
+  }
+  v->nums = lalloc(sizeof(long) * v->count);
+  for (int i = 0; i < v->count; i++) {
+    v->nums[i] = v->cell[i]->num;
+    lval_del(v->cell[i]);
+  }
+  lfree(v->cell);
+  v->cell = NULL;
+  return v;
+}
+
+lval *lval_add(lval *v, lval *x) {
+  /* Numbers added to a packed or empty Qexpr stay packed */
+  if (v->type == LVAL_QEXPR && x->type == LVAL_NUM &&
+      (v->nums || v->count == 0)) {
+    lfree(v->cell);
+    v->cell = NULL;
+    v->count++;
+    v->nums = lrealloc(v->nums, sizeof(long) * v->count);
+    v->nums[v->count - 1] = x->num;
+    lval_del(x);
+    return v;
+  }
+  lval_unpack(v);
+
+  v->count++;
+  v->cell = lrealloc(v->cell, sizeof(lval *) * v->count);
+  v->cell[v->count - 1] = x;
+  return v;
+}
+void lval_println(lval *);
+
+/* Parsing */
+lval *lval_read(mpc_ast_t *t) {
+  if (strstr(t->tag, "number")) {
+    return lval_read_num(t);
+  }
+  if (strstr(t->tag, "symbol")) {
+    return lsym(t->contents);
+  }
+  if (strstr(t->tag, "string")) {
+    return lval_read_str(t);
+  }
+  /*If root (>) or sexpr then create empty list*/
+  lval *x = NULL;
+  if (strstr(t->tag, "qexpr")) {
+    x = lqexpr();
+  }
+  if (strcmp(t->tag, ">") == 0) {
+    x = lsexpr();
+  }
+  if (strstr(t->tag, "sexpr")) {
+    x = lsexpr();
+  }
+  /* Fill this list with any valid expression contained within */
+  for (int i = 0; i < t->children_num; ++i) {
+    if (strcmp(t->children[i]->contents, "(") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->contents, ")") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->contents, "{") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->contents, "}") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->tag, "regex") == 0) {
+      continue;
+    }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+  if (x->type == LVAL_QEXPR) {
+    return lhcons_intern(x);
+  }
+  return x;
+}
+
+/* Printing lvals */
+void lval_print(lval *val); // Foward declaration
+
+/* Where the current interpreter prints: a server request's stream, or
+ * else stdout */
+FILE *lval_out(void) {
+  FILE *out = linterp_current ? linterp_current->out : NULL;
+  return out ? out : stdout;
+}
+
+void lval_expr_print(lval *v, char *open, char *close) {
+  FILE *out = lval_out();
+  fprintf(out, "%s", open);
+  for (int i = 0; i < v->count; i++) {
+    if (v->nums) {
+      fprintf(out, "%li", v->nums[i]);
+    } else {
+      lval_print(v->cell[i]);
+    }
+    /*Don't print trailing space if last element*/
+    if (i != (v->count - 1)) {
+      fputc(' ', out);
+    }
+  }
+  fprintf(out, "%s", close);
+}
+
+/* Print the sub-array of dimension d starting at element *i */
+void larray_print(larray *a, int d, long *i) {
+  FILE *out = lval_out();
+  if (d == a->ndim) {
+    fprintf(out, "%li", a->data[(*i)++]);
+    return;
+  }
+  fprintf(out, "[ ");
+  for (long k = 0; k < a->shape[d]; k++) {
+    larray_print(a, d + 1, i);
+    if (k != a->shape[d] - 1) {
+      fputc(' ', out);
+    }
+  }
+  fprintf(out, " ]");
+}
+
+void lval_print_str(lval *v) {
+  FILE *out = lval_out();
+  fputc('"', out);
+  for (long i = 0; i < v->len; i++) {
+    switch (v->str[i]) {
+    case '"':
+      fprintf(out, "\\\"");
+      break;
+    case '\\':
+      fprintf(out, "\\\\");
+      break;
+    case '\n':
+      fprintf(out, "\\n");
+      break;
+    case '\t':
+      fprintf(out, "\\t");
+      break;
+    case '\r':
+      fprintf(out, "\\r");
+      break;
+    case '\0':
+      fprintf(out, "\\0");
+      break;
+    default:
+      fputc(v->str[i], out);
+      break;
+    }
+  }
+  fputc('"', out);
+}
+
+void lval_print_entry(lval *k, lval *v, void *ctx) {
+  FILE *out = lval_out();
+  lval_print(k);
+  fputc(' ', out);
+  if (v) {
+    lval_print(v);
+    fputc(' ', out);
+  }
+}
+
+void lval_print(lval *val) {
+  FILE *out = lval_out();
   switch (val->type) {
   case LVAL_NUM:
-    printf("%li", val->num);
-    break;
+    fprintf(out, "%li", val->num);
+    break;
+  case LVAL_ERR:
+    fprintf(out, "Error: %s", val->err);
+    break;
+  case LVAL_SYM:
+    fprintf(out, "%s", val->sym);
+    break;
+  case LVAL_STR:
+    lval_print_str(val);
+    break;
+  case LVAL_MAP:
+    fprintf(out, val->map->set ? "#[ " : "#{ ");
+    lmap_each(val->map, lval_print_entry, NULL);
+    fputc(val->map->set ? ']' : '}', out);
+    break;
+  case LVAL_FUN:
+    fprintf(out, "<function>");
+    break;
+  case LVAL_MACRO:
+    fprintf(out, "<macro>");
+    break;
+  case LVAL_FUTURE:
+    fprintf(out, "<future>");
+    break;
+  case LVAL_CHAN:
+    fprintf(out, "<channel>");
+    break;
+  case LVAL_ARRAY: {
+    long i = 0;
+    larray_print(val->arr, 0, &i);
+    break;
+  }
+  case LVAL_BITS:
+    fprintf(out, "#bits{ ");
+    for (long w = 0; w < val->bits->nwords; w++) {
+      for (unsigned long x = val->bits->words[w]; x; x &= x - 1) {
+        fprintf(out, "%li ", w * LBITS_WORD + lctz(x));
+      }
+    }
+    fputc('}', out);
+    break;
+  case LVAL_QEXPR:
+    lval_expr_print(val, "{ ", " }");
+    break;
+  case LVAL_SEXPR:
+    lval_expr_print(val, "( ", " )");
+    break;
+  default:
+    if (val->type >= LVAL_RECORD) {
+      fprintf(out, "<%s", ltype_name(val->type));
+      lval_expr_print(val, val->count ? " " : "", ">");
+      break;
+    }
+    fprintf(out, "Error: Unknown value!");
+    break;
+  }
+}
+
+// print a lispy value followed by a newline
+void lval_println(lval *val) {
+  FILE *out = lval_out();
+  lval_print(val);
+  fputc('\n', out);
+}
+
+lval *lval_eval_sexpr(lenv *e, lval *v);
+lval *lval_apply(lenv *e, lval *v);
+lval *lval_pop(lval *v, int i);
+lval *lval_take(lval *v, int i);
+
+lval *lval_eval(lenv *, lval *v);
+lval *lval_expand(lenv *, lval *v);
+void lenv_add_builtins(lenv *);
+
+void lgrammar_init(lgrammar *g) {
+  // define Polish grammar
+
+  /*The symbols for evaluating QExpr are defined below
+   * list: Takes one or more arguments and returns a new Q-Expression containing
+   * the arguments head: Takes a Q-Expression and returns and Q-Expression with
+   * only the first element tail: Takes a Q-Expression and returns a
+   * Q-Expression with the first element removed join: Takes one or more
+   * Q-Expressions and returns a Q-Expression of them conjoined together eval:
+   * Takes a Q-Expression and evaluates it as if it were a S-Expression def: Put
+   * a new variable into the environment
+   *
+   * */
+  g->Number = mpc_new("number");
+  g->Symbol = mpc_new("symbol");
+  g->String = mpc_new("string");
+  g->Sexpr = mpc_new("sexpr");
+  g->Qexpr = mpc_new("qexpr");
+  g->Expr = mpc_new("expr");
+  g->Lispy = mpc_new("lispy");
+  mpca_lang(MPCA_LANG_DEFAULT, "						\
+			number: /-?[0-9]+/; 				\
+			symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;	 \
+			string: /\"(\\\\.|[^\"])*\"/;	 \
+			sexpr: '(' <expr>* ')' ;			\
+			qexpr: '{' <expr>* '}' ;									\
+			expr: <number> | <symbol> | <string> | <sexpr> | <qexpr> ;	\
+			lispy: /^/ <expr>* /$/; 		\
+			",
+            g->Number, g->Symbol, g->String, g->Sexpr, g->Qexpr, g->Expr,
+            g->Lispy);
+}
+
+void lgrammar_cleanup(lgrammar *g) {
+  /*Undefine and Delete our Parsers*/
+  mpc_cleanup(7, g->Number, g->Symbol, g->String, g->Sexpr, g->Qexpr, g->Expr,
+              g->Lispy);
+}
+
+/* Deferred freeing of results
+ *
+ * Freeing a large result walks every value in it, which would hold up the
+ * next prompt. Instead a reclaimer thread frees it, inside the owning
+ * interpreter, while the prompt is shown and the next form read. The
+ * owner waits for it in larena_begin before evaluating again, and only
+ * then resets the arena the result may live in */
+
+/* Results are freed in the background from this many values, unless
+ * LISPY_RECLAIM says otherwise */
+#define LRECLAIM_MIN 4096
+
+typedef struct lreclaim_job {
+  struct lreclaim_job *next;
+  linterp *li;
+  lval *v;
+} lreclaim_job;
+
+static pthread_mutex_t lreclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lreclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lreclaim_done = PTHREAD_COND_INITIALIZER;
+static lreclaim_job *lreclaim_head;
+static lreclaim_job *lreclaim_tail;
+static int lreclaim_started;
+
+/* Whether v holds at least *n values, counting down no further */
+int lreclaim_large(lval *v, long *n) {
+  if (--*n <= 0) {
+    return 1;
+  }
+  if ((v->type != LVAL_QEXPR && v->type != LVAL_SEXPR) || v->nums) {
+    return 0;
+  }
+  for (int i = 0; i < v->count; i++) {
+    if (lreclaim_large(v->cell[i], n)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void *lreclaim_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&lreclaim_lock);
+  for (;;) {
+    while (!lreclaim_head) {
+      pthread_cond_wait(&lreclaim_work, &lreclaim_lock);
+    }
+    lreclaim_job *j = lreclaim_head;
+    lreclaim_head = j->next;
+    pthread_mutex_unlock(&lreclaim_lock);
+
+    linterp_current = j->li;
+    lval_del(j->v);
+
+    pthread_mutex_lock(&lreclaim_lock);
+    j->li->reclaiming--;
+    linterp_current = NULL;
+    pthread_cond_broadcast(&lreclaim_done);
+    free(j);
+  }
+  return NULL;
+}
+
+/* Free a printed result, in the background if it is large */
+void lreclaim(lval *v) {
+  linterp *li = linterp_current;
+  long n = li->reclaim_min;
+  if (n == 0 || !lreclaim_large(v, &n)) {
+    lval_del(v);
+    return;
+  }
+
+  lreclaim_job *j = malloc(sizeof(lreclaim_job));
+  j->next = NULL;
+  j->li = li;
+  j->v = v;
+  pthread_mutex_lock(&lreclaim_lock);
+  if (!lreclaim_started) {
+    pthread_t t;
+    pthread_create(&t, NULL, lreclaim_thread, NULL);
+    pthread_detach(t);
+    lreclaim_started = 1;
+  }
+  if (lreclaim_head) {
+    lreclaim_tail->next = j;
+  } else {
+    lreclaim_head = j;
+  }
+  lreclaim_tail = j;
+  li->reclaiming++;
+  pthread_cond_signal(&lreclaim_work);
+  pthread_mutex_unlock(&lreclaim_lock);
+}
+
+/* Whether li's results are still being freed */
+int lreclaim_pending(linterp *li) {
+  pthread_mutex_lock(&lreclaim_lock);
+  int pending = li->reclaiming > 0;
+  pthread_mutex_unlock(&lreclaim_lock);
+  return pending;
+}
+
+/* Block until li's results have all been freed */
+void lreclaim_wait(linterp *li) {
+  pthread_mutex_lock(&lreclaim_lock);
+  while (li->reclaiming > 0) {
+    pthread_cond_wait(&lreclaim_done, &lreclaim_lock);
+  }
+  pthread_mutex_unlock(&lreclaim_lock);
+}
+
+/* Forget the reclaimer thread in a child forked while it was idle, so the
+ * child starts its own when needed */
+void lreclaim_forked(void) {
+  pthread_mutex_init(&lreclaim_lock, NULL);
+  pthread_cond_init(&lreclaim_work, NULL);
+  pthread_cond_init(&lreclaim_done, NULL);
+  lreclaim_head = NULL;
+  lreclaim_tail = NULL;
+  lreclaim_started = 0;
+}
+
+/* Expand, evaluate and print one top-level form */
+void lispy_run(lenv *e, lval *x) {
+  lval *result = lval_eval(e, lval_expand(e, x));
+  lval_println(result);
+  lreclaim(result);
+}
+
+/* Interpreter instances */
+
+struct lhcons_table *lhcons_table_new(void);
+void lhcons_table_del(struct lhcons_table *t);
+struct lmatch_cache *lmatch_cache_new(void);
+void lmatch_cache_del(struct lmatch_cache *c);
+struct ljit_state *ljit_state_new(void);
+void ljit_state_del(struct ljit_state *j);
+void ljit_reset(struct ljit_state *j);
+void lmatch_flush(void);
+void lpool_del(struct lpool *p);
+
+/* Make li the interpreter running on this thread, returning the last one */
+linterp *linterp_enter(linterp *li) {
+  linterp *prev = linterp_current;
+  /* The interpreter left holds nothing it read from shared environments */
+  if (prev != li) {
+    lepoch_leave(prev);
+  }
+  linterp_current = li;
+  return prev;
+}
+
+/* Threads for pmap and preduce: LISPY_THREADS, or one per processor */
+int linterp_threads(void) {
+  char *s = getenv("LISPY_THREADS");
+  long n = s ? strtol(s, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) {
+    return 1;
+  }
+  return n < LPOOL_MAX_THREADS ? n : LPOOL_MAX_THREADS;
+}
+
+/* Least size of a result freed in the background: LISPY_RECLAIM, 0 for
+ * never, or LRECLAIM_MIN */
+long linterp_reclaim_min(void) {
+  char *s = getenv("LISPY_RECLAIM");
+  long n = s ? strtol(s, NULL, 10) : LRECLAIM_MIN;
+  return n < 0 ? 0 : n;
+}
+
+/* A new interpreter with every builtin defined, entered on this thread */
+linterp *linterp_new(void) {
+  linterp *li = calloc(1, sizeof(linterp));
+  li->hcons = lhcons_table_new();
+  li->match = lmatch_cache_new();
+  li->jit = ljit_state_new();
+  linterp_register(li);
+  linterp_enter(li);
+  lgrammar_init(&li->grammar);
+  li->env = lenv_new();
+  lenv_add_builtins(li->env);
+  li->threads = linterp_threads();
+  li->reclaim_min = linterp_reclaim_min();
+  return li;
+}
+
+void lrectypes_free(linterp *li) {
+  for (int i = 0; i < li->rectype_count; i++) {
+    lrectype *t = &li->rectypes[i];
+    for (int j = 0; j < t->nslots; j++) {
+      free(t->slots[j]);
+    }
+    free(t->slots);
+    free(t->name);
+  }
+  free(li->rectypes);
+  li->rectypes = NULL;
+  li->rectype_count = 0;
+}
+
+/* Replace to's record types with copies of from's */
+void lrectypes_copy(linterp *to, linterp *from) {
+  lrectypes_free(to);
+  to->rectype_count = from->rectype_count;
+  to->rectypes = malloc(sizeof(lrectype) * from->rectype_count);
+  for (int i = 0; i < from->rectype_count; i++) {
+    lrectype *s = &from->rectypes[i];
+    lrectype *t = &to->rectypes[i];
+    t->name = malloc(strlen(s->name) + 1);
+    strcpy(t->name, s->name);
+    t->nslots = s->nslots;
+    t->slots = malloc(sizeof(char *) * s->nslots);
+    for (int j = 0; j < s->nslots; j++) {
+      t->slots[j] = malloc(strlen(s->slots[j]) + 1);
+      strcpy(t->slots[j], s->slots[j]);
+    }
+  }
+}
+
+void linterp_del(linterp *li) {
+  lreclaim_wait(li);
+  linterp *prev = linterp_enter(li);
+  lpool_del(li->pool);
+  /* Pool threads' interpreters have no parsers, and an environment only
+   * once given a job */
+  if (li->env) {
+    lenv_del(li->env);
+  }
+  lmatch_cache_del(li->match);
+  ljit_state_del(li->jit);
+  lhcons_table_del(li->hcons);
+  if (li->grammar.Lispy) {
+    lgrammar_cleanup(&li->grammar);
+  }
+  lrectypes_free(li);
+  larena_free(&li->arena);
+  linterp_unregister(li);
+  linterp_enter(prev == li ? NULL : prev);
+  free(li);
+}
+
+/* Pipelined script loading
+ *
+ * With --pipeline a reader thread parses a script one top-level form at a
+ * time into a bounded queue, while the interpreter evaluates the forms
+ * already read. First the reader checks the whole file against the
+ * grammar in one quick pass, so no form runs unless every form parses.
+ * A file that fails the check is parsed whole as linterp_load would parse
+ * it, giving the same error and running nothing. Then the reader finds
+ * where each form ends with a scan of brackets and strings and hands just
+ * that span to the parser */
+
+/* Forms read ahead of evaluation, at most */
+#define LREADER_QUEUE 64
+
+typedef struct lreader {
+  /* The evaluating interpreter, whose parsers the reader borrows */
+  linterp *li;
+  char *filename;
+  char *src;
+  long len;
+  /* Forms read and not yet taken, counted by next and end */
+  lval *forms[LREADER_QUEUE];
+  long next;
+  long end;
+  int done;
+  mpc_err_t *error;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t room;
+} lreader;
+
+linterp *lpool_interp(void);
+
+/* The whole of a file, or NULL if it can't be read */
+char *lreader_slurp(char *filename, long *len) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return NULL;
+  }
+  long cap = 4096, n = 0, k;
+  char *buf = malloc(cap);
+  while ((k = fread(buf + n, 1, cap - n - 1, f)) > 0) {
+    n += k;
+    if (n + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  fclose(f);
+  buf[n] = '\0';
+  *len = n;
+  return buf;
+}
+
+/* Find the span of the next top-level form from *start, returning 0 if
+ * only whitespace is left. Unbalanced brackets end the span early or at
+ * the end of the file, for the parser to report */
+int lreader_span(char *src, long len, long *start, long *end) {
+  long i = *start;
+  while (i < len && isspace((unsigned char)src[i])) {
+    i++;
+  }
+  if (i == len) {
+    return 0;
+  }
+  *start = i;
+
+  int depth = 0;
+  do {
+    char c = src[i];
+    if (c == '"') {
+      for (i++; i < len && src[i] != '"'; i++) {
+        if (src[i] == '\\' && i + 1 < len) {
+          i++;
+        }
+      }
+      i++;
+    } else if (c == '(' || c == '{') {
+      depth++;
+      i++;
+    } else if (c == ')' || c == '}') {
+      depth--;
+      i++;
+    } else if (isspace((unsigned char)c)) {
+      i++;
+    } else {
+      while (i < len && !isspace((unsigned char)src[i]) &&
+             !strchr("(){}\"", src[i])) {
+        i++;
+      }
+    }
+  } while (i < len && depth > 0);
+  *end = i < len ? i : len;
+  return 1;
+}
+
+/* Whether src is a sequence of well-formed expressions, by the same rules
+ * as the grammar: runs of symbol characters, which include numbers,
+ * strings, and matching brackets. NUL and other bytes the grammar has no
+ * token for fail, leaving linterp_load's parse to report them */
+int lreader_check(char *src, long len) {
+  static const char *symbol = "abcdefghijklmnopqrstuvwxyz"
+                              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                              "0123456789_+-*/\\=<>!&";
+  long depth = 0, cap = 64;
+  char *open = malloc(cap);
+  int ok = 1;
+  for (long i = 0; ok && i < len; i++) {
+    char c = src[i];
+    if (c == '(' || c == '{') {
+      if (depth == cap) {
+        cap *= 2;
+        open = realloc(open, cap);
+      }
+      open[depth++] = c;
+    } else if (c == ')' || c == '}') {
+      ok = depth > 0 && open[--depth] == (c == ')' ? '(' : '{');
+    } else if (c == '"') {
+      for (i++; i < len && src[i] != '"' && src[i] != '\0'; i++) {
+        if (src[i] == '\\' && i + 1 < len) {
+          i++;
+        }
+      }
+      ok = i < len && src[i] == '"';
+    } else if (!isspace((unsigned char)c)) {
+      ok = c != '\0' && strchr(symbol, c) != NULL;
+    }
+  }
+  free(open);
+  return ok && depth == 0;
+}
+
+/* Queue a form for evaluation, waiting while the queue is full */
+void lreader_push(lreader *rd, lval *x) {
+  pthread_mutex_lock(&rd->lock);
+  while (rd->end - rd->next == LREADER_QUEUE) {
+    pthread_cond_wait(&rd->room, &rd->lock);
+  }
+  rd->forms[rd->end++ % LREADER_QUEUE] = x;
+  pthread_cond_signal(&rd->ready);
+  pthread_mutex_unlock(&rd->lock);
+}
+
+/* The next form read, or NULL once the script has run out */
+lval *lreader_pop(lreader *rd) {
+  pthread_mutex_lock(&rd->lock);
+  while (rd->next == rd->end && !rd->done) {
+    pthread_cond_wait(&rd->ready, &rd->lock);
+  }
+  lval *x = NULL;
+  if (rd->next < rd->end) {
+    x = rd->forms[rd->next++ % LREADER_QUEUE];
+    pthread_cond_signal(&rd->room);
+  }
+  pthread_mutex_unlock(&rd->lock);
+  return x;
+}
+
+/* Queue the forms of a parsed span, or of the file, from the skip'th,
+ * returning how many there were */
+long lreader_push_all(lreader *rd, mpc_ast_t *t, long skip) {
+  lval *x = lval_read(t);
+  mpc_ast_delete(t);
+  long n = x->count;
+  for (int i = 0; i < x->count; i++) {
+    if (i < skip) {
+      lval_del(x->cell[i]);
+    } else {
+      lreader_push(rd, x->cell[i]);
+    }
+  }
+  x->count = 0;
+  lval_del(x);
+  return n;
+}
+
+void *lreader_thread(void *arg) {
+  lreader *rd = arg;
+
+  /* Forms are read on the heap of an interpreter of the reader's own, and
+   * interned by the evaluator if it shares literals */
+  linterp *own = lpool_interp();
+  linterp_enter(own);
+  mpc_parser_t *lispy = rd->li->grammar.Lispy;
+  long start = 0, end, nread = 0;
+  mpc_result_t r;
+  if (!lreader_check(rd->src, rd->len)) {
+    if (mpc_parse_contents(rd->filename, lispy, &r)) {
+      lreader_push_all(rd, r.output, 0);
+    } else {
+      rd->error = r.error;
+    }
+    start = rd->len;
+  }
+  while (lreader_span(rd->src, rd->len, &start, &end)) {
+    char c = rd->src[end];
+    rd->src[end] = '\0';
+    int ok = mpc_parse(rd->filename, rd->src + start, lispy, &r);
+    rd->src[end] = c;
+    if (ok) {
+      nread += lreader_push_all(rd, r.output, 0);
+      start = end;
+      continue;
+    }
+
+    /* The file passed the check, so the scan went wrong: parse it whole
+     * for the rest of the forms */
+    mpc_err_delete(r.error);
+    if (mpc_parse(rd->filename, rd->src, lispy, &r)) {
+      lreader_push_all(rd, r.output, nread);
+    } else {
+      rd->error = r.error;
+    }
+    break;
+  }
+  linterp_del(own);
+
+  pthread_mutex_lock(&rd->lock);
+  rd->done = 1;
+  pthread_cond_signal(&rd->ready);
+  pthread_mutex_unlock(&rd->lock);
+  return NULL;
+}
+
+/* Shared copies of the Qexprs in a form read by another interpreter */
+lval *lhcons_intern_all(lval *v) {
+  if (v->type != LVAL_QEXPR && v->type != LVAL_SEXPR) {
+    return v;
+  }
+  for (int i = 0; i < v->count && !v->nums; i++) {
+    v->cell[i] = lhcons_intern_all(v->cell[i]);
+  }
+  return v->type == LVAL_QEXPR ? lhcons_intern(v) : v;
+}
+
+int linterp_load_pipelined(linterp *li, char *filename, char *src, long len) {
+  lreader rd = {li, filename, src, len};
+  pthread_mutex_init(&rd.lock, NULL);
+  pthread_cond_init(&rd.ready, NULL);
+  pthread_cond_init(&rd.room, NULL);
+  int intern = li->hcons->enabled;
+  pthread_t t;
+  pthread_create(&t, NULL, lreader_thread, &rd);
+
+  lval *x;
+  while ((x = lreader_pop(&rd))) {
+    larena_begin();
+    lispy_run(li->env, intern ? lhcons_intern_all(x) : x);
+    larena_reset();
+  }
+  pthread_join(t, NULL);
+  pthread_mutex_destroy(&rd.lock);
+  pthread_cond_destroy(&rd.ready);
+  pthread_cond_destroy(&rd.room);
+  free(src);
+
+  if (rd.error) {
+    mpc_err_print(rd.error);
+    mpc_err_delete(rd.error);
+    return 0;
+  }
+  return 1;
+}
+
+/* Evaluate every top-level form of a script, printing each result */
+int linterp_load(linterp *li, char *filename) {
+  linterp *prev = linterp_enter(li);
+  long len;
+  char *src = li->pipeline ? lreader_slurp(filename, &len) : NULL;
+  if (src) {
+    int ok = linterp_load_pipelined(li, filename, src, len);
+    linterp_enter(prev);
+    return ok;
+  }
+
+  mpc_result_t r;
+  if (!mpc_parse_contents(filename, li->grammar.Lispy, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    linterp_enter(prev);
+    return 0;
+  }
+
+  lval *forms = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  for (int i = 0; i < forms->count; i++) {
+    /* Each form's temporaries live in the arena until it is printed */
+    larena_begin();
+    lispy_run(li->env, forms->cell[i]);
+    larena_reset();
+  }
+  forms->count = 0;
+  lval_del(forms);
+  linterp_enter(prev);
+  return 1;
+}
+
+#ifndef LISPY_NO_MAIN
+/* Evaluation server
+ *
+ * ./parsing --server PATH listens on a Unix socket and evaluates requests
+ * on a pool of interpreters made once at startup, one per thread, so a
+ * request pays for neither the grammar nor the builtins. A request is a
+ * 4-byte big-endian length followed by that much source. The printed
+ * result of each top-level form comes back as soon as it is ready, framed
+ * the same way, and a zero length followed by the request's latency in
+ * microseconds, as 8 big-endian bytes, ends the reply. Each connection
+ * is a session with definitions of its own, started from the builtins.
+ */
+
+#define LSERVER_MAX_REQUEST (16 << 20)
+#define LSERVER_BACKLOG 64
+
+typedef struct lserver {
+  int fd;
+  unsigned long requests;
+} lserver;
+
+/* A worker's output stream, collecting what one form prints */
+typedef struct lserver_out {
+  FILE *f;
+  char *buf;
+  size_t size;
+} lserver_out;
+
+/* Read or write exactly n bytes, returning 0 if the peer has gone */
+int lserver_read(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t k = read(fd, p, n);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      return 0;
+    }
+    p += k;
+    n -= k;
+  }
+  return 1;
+}
+
+int lserver_write(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      return 0;
+    }
+    p += k;
+    n -= k;
+  }
+  return 1;
+}
+
+int lserver_frame(int fd, const char *buf, size_t n) {
+  unsigned char h[4] = {n >> 24, n >> 16, n >> 8, n};
+  return lserver_write(fd, h, 4) && lserver_write(fd, buf, n);
+}
+
+/* Send whatever has been printed since the last frame */
+int lserver_flush(lserver_out *o, int fd) {
+  fflush(o->f);
+  if (o->size == 0) {
+    return 1;
+  }
+  int ok = lserver_frame(fd, o->buf, o->size);
+  fseek(o->f, 0, SEEK_SET);
+  fflush(o->f);
+  return ok;
+}
+
+/* Evaluate one request, sending each form's output as it is printed */
+int lserver_eval(linterp *li, lserver_out *o, int fd, char *src) {
+  mpc_result_t r;
+  if (!mpc_parse("<request>", src, li->grammar.Lispy, &r)) {
+    char *msg = mpc_err_string(r.error);
+    fputs(msg, o->f);
+    free(msg);
+    mpc_err_delete(r.error);
+    return lserver_flush(o, fd);
+  }
+
+  /* Reading may share literals with the last result being freed */
+  lreclaim_wait(li);
+  lval *forms = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  int ok = 1;
+  for (int i = 0; i < forms->count; i++) {
+    larena_begin();
+    lispy_run(li->env, forms->cell[i]);
+    larena_reset();
+    ok = ok && lserver_flush(o, fd);
+  }
+  forms->count = 0;
+  lval_del(forms);
+  return ok;
+}
+
+/* Serve requests on one connection until the client closes it */
+void lserver_session(lserver *s, linterp *li, lserver_out *o, int fd) {
+  unsigned char h[4];
+  while (lserver_read(fd, h, 4)) {
+    size_t n = (size_t)h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3];
+    if (n > LSERVER_MAX_REQUEST) {
+      break;
+    }
+    char *src = malloc(n + 1);
+    if (!lserver_read(fd, src, n)) {
+      free(src);
+      break;
+    }
+    src[n] = '\0';
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ok = lserver_eval(li, o, fd, src);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(src);
+    unsigned long us = (t1.tv_sec - t0.tv_sec) * 1000000UL +
+                       (t1.tv_nsec - t0.tv_nsec) / 1000;
+    unsigned long id = __atomic_add_fetch(&s->requests, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "request %lu: %zu bytes in %lu us\n", id, n, us);
+
+    unsigned char t[12] = {0};
+    for (int i = 0; i < 8; i++) {
+      t[4 + i] = us >> (56 - 8 * i);
+    }
+    if (!ok || !lserver_write(fd, t, sizeof(t))) {
+      break;
+    }
+  }
+}
+
+/* Return li to how it was before a session: the builtins alone, with
+ * the settings and caches a session can change back at their defaults */
+void lserver_reset(linterp *li, lenv *builtins) {
+  lreclaim_wait(li);
+  lpool_del(li->pool);
+  li->pool = NULL;
+  lenv_del(li->env);
+  li->env = builtins;
+  lrectypes_free(li);
+
+  /* Compiled forms hold the session's literals, which may be shared, so
+   * they go first; shared literals still alive keep the table */
+  ljit_reset(li->jit);
+  lmatch_flush();
+  if (li->hcons->count == 0) {
+    lhcons_table_del(li->hcons);
+    li->hcons = lhcons_table_new();
+  }
+  lhcons_table *h = li->hcons;
+  h->enabled = 0;
+  h->literals = h->hits = h->unshared = h->shared = 0;
+
+  li->par_threshold = 0;
+  li->par_calls = 0;
+}
+
+void *lserver_worker(void *arg) {
+  lserver *s = arg;
+
+  /* Requests run on this interpreter alone, as the server's threads are
+   * already one per processor */
+  linterp *li = linterp_new();
+  li->threads = 1;
+  lenv *builtins = li->env;
+  lserver_out o = {NULL, NULL, 0};
+  o.f = open_memstream(&o.buf, &o.size);
+  li->out = o.f;
+
+  for (;;) {
+    int fd = accept(s->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+
+    li->env = lenv_share(builtins);
+    lserver_session(s, li, &o, fd);
+    lserver_reset(li, builtins);
+    close(fd);
+  }
+
+  li->out = NULL;
+  fclose(o.f);
+  free(o.buf);
+  linterp_del(li);
+  return NULL;
+}
+
+/* A socket listening on path, or -1 */
+int lserver_listen(char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, LSERVER_BACKLOG) < 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+/* Listen on path and serve until killed */
+int lserver_run(char *path) {
+  lserver s = {lserver_listen(path), 0};
+  if (s.fd < 0) {
+    return 0;
+  }
+
+  int n = linterp_threads();
+  pthread_t *threads = malloc(sizeof(pthread_t) * n);
+  for (int i = 0; i < n; i++) {
+    pthread_create(&threads[i], NULL, lserver_worker, &s);
+  }
+  fprintf(stderr, "Serving on %s with %d interpreters\n", path, n);
+  for (int i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  close(s.fd);
+  return 1;
+}
+
+/* Zygote
+ *
+ * ./parsing --zygote PATH [PRELUDE ...] loads the preludes into one
+ * interpreter, then forks it for every connection on PATH. A job starts
+ * from that warm heap, shared copy-on-write, rather than building the
+ * grammar and builtins and loading the preludes again. The child speaks
+ * the server's protocol on its connection and exits when it is closed */
+
+/* Load the preludes, printing their results to stderr, and fork a child
+ * per connection until killed */
+int lzygote_run(char *path, char **preludes, int npreludes) {
+  linterp *li = linterp_new();
+  li->out = stderr;
+  for (int i = 0; i < npreludes; i++) {
+    if (!linterp_load(li, preludes[i])) {
+      linterp_del(li);
+      return 0;
+    }
+  }
+  li->out = NULL;
+
+  /* Only the forking thread lives on in a child, so none may be running
+   * or left holding interpreter state */
+  lreclaim_wait(li);
+  lpool_del(li->pool);
+  li->pool = NULL;
+
+  lserver s = {lserver_listen(path), 0};
+  if (s.fd < 0) {
+    linterp_del(li);
+    return 0;
+  }
+  signal(SIGCHLD, SIG_IGN);
+  fprintf(stderr, "Forking jobs on %s from %d preludes\n", path, npreludes);
+
+  for (;;) {
+    int fd = accept(s.fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(s.fd);
+      lreclaim_forked();
+      lserver_out o = {NULL, NULL, 0};
+      o.f = open_memstream(&o.buf, &o.size);
+      li->out = o.f;
+      lserver_session(&s, li, &o, fd);
+      /* The process's memory goes with it, so nothing is freed */
+      fflush(stderr);
+      _exit(0);
+    }
+    if (pid < 0) {
+      perror("fork");
+    }
+    s.requests++;
+    close(fd);
+  }
+
+  close(s.fd);
+  linterp_del(li);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "--server") == 0) {
+    return lserver_run(argv[2]) ? 0 : 1;
+  }
+  if (argc >= 3 && strcmp(argv[1], "--zygote") == 0) {
+    return lzygote_run(argv[2], argv + 3, argc - 3) ? 0 : 1;
+  }
+
+  linterp *li = linterp_new();
+  lenv *e = li->env;
+
+  /* --hashcons shares repeated literals from the start of the scripts,
+   * and --pipeline reads each script while evaluating it */
+  int first = 1;
+  for (; first < argc; first++) {
+    if (strcmp(argv[first], "--hashcons") == 0) {
+      li->hcons->enabled = 1;
+    } else if (strcmp(argv[first], "--pipeline") == 0) {
+      li->pipeline = 1;
+    } else {
+      break;
+    }
+  }
+
+  /* Run any scripts given on the command line instead of the REPL */
+  if (argc > first) {
+    int ok = 1;
+    for (int i = first; i < argc; i++) {
+      ok = linterp_load(li, argv[i]) && ok;
+    }
+    linterp_del(li);
+    return ok ? 0 : 1;
+  }
+
+  puts("Lispy Version 0.0.0.0.1");
+  puts("Press Ctrl+c to exit\n");
+
+  while (1) {
+    char *input = readline("> ");
+    if (!input) {
+      break;
+    }
+    add_history(input);
+    mpc_result_t r;
+    if (mpc_parse("<stdin>", input, li->grammar.Lispy, &r)) {
+
+      /* Temporaries of this line live in the arena until it is printed */
+      larena_begin();
+
+      /* A lone top-level form is expanded on its own, not as a call */
+      lval *x = lval_read(r.output);
+      if (x->count == 1) {
+        lispy_run(e, lval_take(x, 0));
+      } else {
+        lispy_run(e, x);
+      }
+      larena_reset();
+
+      mpc_ast_delete(r.output);
+    } else {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+    }
+    free(input);
+  }
+  linterp_del(li);
+  return 0;
+}
+#endif
+
+lval *lval_eval(lenv *e, lval *v) {
+  if (v->type == LVAL_SYM) {
+    lval *x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  /* Evaluate Sexpression */
+  if (v->type == LVAL_SEXPR) {
+    return lval_eval_sexpr(e, v);
+  }
+  return v;
+}
+
+/* Pop an item from the list */
+lval *lval_pop(lval *v, int i) {
+  /* Packed numbers are boxed as they leave the list */
+  if (v->nums) {
+    lval *x = lnum(v->nums[i]);
+    memmove(&v->nums[i], &v->nums[i + 1], sizeof(long) * (v->count - i - 1));
+    v->count--;
+    return x;
+  }
+
+  /* Find the item at i */
+  lval *x = v->cell[i];
+
+  /* Shift memory after the item at "i" over the top */
+  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+  /* Decrease the count of items in the list */
+  v->count--;
+
+  /* Reallocate the memory used */
+  v->cell = lrealloc(v->cell, sizeof(lval *) * v->count);
+  return x;
+}
+
+/* Take an item from the list and delete the rest */
+lval *lval_take(lval *v, int i) {
+  lval *x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+/* Macro expansion */
+
+/* Copy a macro template, replacing formals with the argument forms */
+lval *lval_subst(lval *t, lval *formals, lval *args) {
+  if (t->type == LVAL_SYM) {
+    for (int i = 0; i < formals->count; i++) {
+      if (strcmp(formals->cell[i]->sym, "&") == 0) {
+        break;
+      }
+      if (strcmp(formals->cell[i]->sym, t->sym) == 0) {
+        return lval_copy(args->cell[i]);
+      }
+    }
+    return lval_copy(t);
+  }
+  if ((t->type != LVAL_SEXPR && t->type != LVAL_QEXPR) || t->nums) {
+    return lval_copy(t);
+  }
+
+  /* Name bound to the remaining arguments, if the macro is variadic */
+  int nfixed = formals->count;
+  char *rest = NULL;
+  if (nfixed >= 2 && strcmp(formals->cell[nfixed - 2]->sym, "&") == 0) {
+    nfixed -= 2;
+    rest = formals->cell[formals->count - 1]->sym;
+  }
+
+  lval *x = t->type == LVAL_SEXPR ? lsexpr() : lqexpr();
+  for (int i = 0; i < t->count; i++) {
+    lval *c = t->cell[i];
+    /* Splice the rest arguments in place of their symbol */
+    if (rest && c->type == LVAL_SYM && strcmp(c->sym, rest) == 0) {
+      for (int j = nfixed; j < args->count; j++) {
+        lval_add(x, lval_copy(args->cell[j]));
+      }
+      continue;
+    }
+    lval_add(x, lval_subst(c, formals, args));
+  }
+  return x;
+}
+
+/* Expand a single call to macro m, caching the result per call form */
+lval *lval_expand_call(lval *m, lval *v) {
+  lval *hit = lcache_get(m->cache, v);
+  if (hit) {
+    lval_del(v);
+    return lval_copy(hit);
+  }
+
+  lval *formals = m->cell[0];
+  int nfixed = formals->count;
+  int variadic = 0;
+  if (nfixed >= 2 && strcmp(formals->cell[nfixed - 2]->sym, "&") == 0) {
+    nfixed -= 2;
+    variadic = 1;
+  }
+
+  /* Arguments are the call form without the macro name */
+  lval *key = lval_copy(v);
+  lval *args = v;
+  lval_del(lval_pop(args, 0));
+  if (args->count < nfixed || (!variadic && args->count > nfixed)) {
+    lval *err = lerr("Macro '%s' passed incorrect number of arguments: %d\n"
+                     "Expected %d",
+                     key->cell[0]->sym, args->count, nfixed);
+    lval_del(key);
+    lval_del(args);
+    return err;
+  }
+
+  lval *x = lval_subst(m->cell[1], formals, args);
+  x->type = LVAL_SEXPR;
+  lval_del(args);
+  lcache_put(m->cache, key, lval_copy(x));
+  return x;
+}
+
+lval *lval_expand_depth(lenv *e, lval *v, int depth) {
+  if (v->type != LVAL_SEXPR) {
+    return v;
+  }
+  if (depth > MACRO_MAX_DEPTH) {
+    lval_del(v);
+    return lerr("Macro expansion exceeded depth %d", MACRO_MAX_DEPTH);
+  }
+
+  /* Expand the outermost call first, then whatever it produced */
+  if (v->count > 0 && v->cell[0]->type == LVAL_SYM) {
+    lval *m = lenv_peek(e, v->cell[0]->sym);
+    if (m && m->type == LVAL_MACRO) {
+      return lval_expand_depth(e, lval_expand_call(m, v), depth + 1);
+    }
+  }
+
+  /* Quoted children are data, so only sub-Sexprs are expanded */
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_expand_depth(e, v->cell[i], depth + 1);
+  }
+  return v;
+}
+
+/* Rewrite every macro call in v before it is evaluated */
+lval *lval_expand(lenv *e, lval *v) { return lval_expand_depth(e, v, 0); }
+
+/* Numeric arrays */
+
+#define LARRAY_MAX_DIMS 32
+/* Tile edge for blocked transpose and matrix multiply */
+#define LARRAY_BLOCK 64
+
+/* Take the shape of a nested Qexpr from its first element at each level */
+int larray_dims(lval *q, long *shape) {
+  int ndim = 0;
+  while (q->type == LVAL_QEXPR) {
+    if (q->count == 0 || ndim == LARRAY_MAX_DIMS) {
+      return -1;
+    }
+    shape[ndim++] = q->count;
+    q = q->nums ? NULL : q->cell[0];
+    if (!q) {
+      break;
+    }
+  }
+  return ndim ? ndim : -1;
+}
+
+/* Check that a nested Qexpr holds only numbers and matches shape */
+int larray_rect(lval *q, int d, int ndim, long *shape) {
+  if (d == ndim) {
+    return q->type == LVAL_NUM;
+  }
+  if (q->type != LVAL_QEXPR || q->count != shape[d]) {
+    return 0;
+  }
+  if (q->nums) {
+    return d == ndim - 1;
+  }
+  for (int i = 0; i < q->count; i++) {
+    if (!larray_rect(q->cell[i], d + 1, ndim, shape)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Copy the numbers of a rectangular nested Qexpr in row-major order */
+void larray_fill(lval *q, long *data, long *i) {
+  if (q->type == LVAL_NUM) {
+    data[(*i)++] = q->num;
+    return;
+  }
+  if (q->nums) {
+    memcpy(&data[*i], q->nums, sizeof(long) * q->count);
+    *i += q->count;
+    return;
+  }
+  for (int k = 0; k < q->count; k++) {
+    larray_fill(q->cell[k], data, i);
+  }
+}
+
+/* Build the nested Qexpr for dimension d starting at element *i */
+lval *larray_list(larray *a, int d, long *i) {
+  lval *x = lqexpr();
+  if (d == a->ndim - 1) {
+    x->nums = lalloc(sizeof(long) * (a->shape[d] ? a->shape[d] : 1));
+    memcpy(x->nums, &a->data[*i], sizeof(long) * a->shape[d]);
+    x->count = a->shape[d];
+    *i += a->shape[d];
+    return x;
+  }
+  for (long k = 0; k < a->shape[d]; k++) {
+    lval_add(x, larray_list(a, d + 1, i));
+  }
+  return x;
+}
+
+/* Apply op elementwise to x and y, either of which may be a Number */
+lval *larray_binop(lval *x, lval *y, char op) {
+  larray *a = x->type == LVAL_ARRAY ? x->arr : NULL;
+  larray *b = y->type == LVAL_ARRAY ? y->arr : NULL;
+  if (!a && !b) {
+    if ((op == '/' || op == '%') && y->num == 0) {
+      return lerr("Division by zero");
+    }
+    switch (op) {
+    case '+':
+      return lnum(x->num + y->num);
+    case '-':
+      return lnum(x->num - y->num);
+    case '*':
+      return lnum(x->num * y->num);
+    case '/':
+      return lnum(x->num / y->num);
+    default:
+      return lnum(x->num % y->num);
+    }
+  }
+  if (a && b && (a->ndim != b->ndim ||
+                 memcmp(a->shape, b->shape, sizeof(long) * a->ndim))) {
+    return lerr("Array shapes do not match");
+  }
+  larray *shape = a ? a : b;
+
+  /* Divisors are checked up front so no partial result is built */
+  if (op == '/' || op == '%') {
+    long n = b ? b->size : 1;
+    for (long i = 0; i < n; i++) {
+      if ((b ? b->data[i] : y->num) == 0) {
+        return lerr("Division by zero");
+      }
+    }
+  }
+
+  /* An operand nobody else references is overwritten in place */
+  larray *r;
+  if (a && __atomic_load_n(&a->refs, __ATOMIC_ACQUIRE) == 1) {
+    r = a;
+    r->refs++;
+  } else if (b && __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1) {
+    r = b;
+    r->refs++;
+  } else {
+    r = larray_new(shape->ndim, shape->shape);
+  }
+
+  long *out = r->data;
+  long *pa = a ? a->data : NULL;
+  long *pb = b ? b->data : NULL;
+  long sa = a ? 0 : x->num;
+  long sb = b ? 0 : y->num;
+  long n = r->size;
+
+#define LARRAY_LOOP(expr)                                                      \
+  for (long i = 0; i < n; i++) {                                               \
+    long u = pa ? pa[i] : sa;                                                  \
+    long w = pb ? pb[i] : sb;                                                  \
+    out[i] = (expr);                                                           \
+  }
+  switch (op) {
+  case '+':
+    LARRAY_LOOP(u + w);
+    break;
+  case '-':
+    LARRAY_LOOP(u - w);
+    break;
+  case '*':
+    LARRAY_LOOP(u * w);
+    break;
+  case '/':
+    LARRAY_LOOP(u / w);
+    break;
+  case '%':
+    LARRAY_LOOP(u % w);
+    break;
+  }
+#undef LARRAY_LOOP
+  return larr(r);
+}
+
+/* builtin_op for operands that include arrays */
+lval *larray_op(lval *v, char *sym) {
+  for (int i = 0; i < v->count; i++) {
+    int t = v->cell[i]->type;
+    if (t != LVAL_NUM && t != LVAL_ARRAY) {
+      lval *err = lerr("Invalid operand: %s\nExpected numbers or arrays",
+                       ltype_name(t));
+      lval_del(v);
+      return err;
+    }
+  }
+
+  lval *x = lval_pop(v, 0);
+  if (v->count == 0 && strcmp(sym, "-") == 0) {
+    lval *zero = lnum(0);
+    lval *r = larray_binop(zero, x, '-');
+    lval_del(zero);
+    lval_del(x);
+    lval_del(v);
+    return r;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lval *r = larray_binop(x, v->cell[i], sym[0]);
+    lval_del(x);
+    x = r;
+    if (x->type == LVAL_ERR) {
+      break;
+    }
+  }
+  lval_del(v);
+  return x;
+}
+
+lval *builtin_array(lenv *e, lval *a) {
+  LASSERT_NUM("array", 1, "QExpr", a);
+  LASSERT_TYPE("array", LVAL_QEXPR, 0, a);
+
+  long shape[LARRAY_MAX_DIMS];
+  int ndim = larray_dims(a->cell[0], shape);
+  LASSERT(a, ndim > 0 && larray_rect(a->cell[0], 0, ndim, shape),
+          "Function 'array' expects a non-empty rectangular QExpr of numbers");
+
+  larray *arr = larray_new(ndim, shape);
+  long i = 0;
+  larray_fill(a->cell[0], arr->data, &i);
+  lval_del(a);
+  return larr(arr);
+}
+
+lval *builtin_tolist(lenv *e, lval *a) {
+  LASSERT_NUM("tolist", 1, "Array", a);
+  LASSERT_TYPE("tolist", LVAL_ARRAY, 0, a);
+  long i = 0;
+  lval *x = larray_list(a->cell[0]->arr, 0, &i);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_shape(lenv *e, lval *a) {
+  LASSERT_NUM("shape", 1, "Array", a);
+  LASSERT_TYPE("shape", LVAL_ARRAY, 0, a);
+  larray *arr = a->cell[0]->arr;
+  lval *x = lqexpr();
+  for (int i = 0; i < arr->ndim; i++) {
+    lval_add(x, lnum(arr->shape[i]));
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_reshape(lenv *e, lval *a) {
+  LASSERT_NUM("reshape", 2, "Array and QExpr", a);
+  LASSERT_TYPE("reshape", LVAL_ARRAY, 0, a);
+  LASSERT_TYPE("reshape", LVAL_QEXPR, 1, a);
+
+  lval *q = a->cell[1];
+  LASSERT(a, q->count > 0 && q->count <= LARRAY_MAX_DIMS && q->nums,
+          "Function 'reshape' expects a non-empty QExpr of dimensions");
+  long size = 1;
+  for (int i = 0; i < q->count; i++) {
+    LASSERT(a, q->nums[i] > 0, "Function 'reshape' passed dimension %li",
+            q->nums[i]);
+    size *= q->nums[i];
+  }
+  larray *src = a->cell[0]->arr;
+  LASSERT(a, size == src->size,
+          "Function 'reshape' cannot reshape %li elements into %li", src->size,
+          size);
+
+  larray *r = larray_new(q->count, q->nums);
+  memcpy(r->data, src->data, sizeof(long) * size);
+  lval_del(a);
+  return larr(r);
+}
+
+/* Reverse the axes; matrices are transposed a tile at a time */
+lval *builtin_transpose(lenv *e, lval *a) {
+  LASSERT_NUM("transpose", 1, "Array", a);
+  LASSERT_TYPE("transpose", LVAL_ARRAY, 0, a);
+  larray *src = a->cell[0]->arr;
+
+  long shape[LARRAY_MAX_DIMS];
+  for (int i = 0; i < src->ndim; i++) {
+    shape[i] = src->shape[src->ndim - 1 - i];
+  }
+  larray *r = larray_new(src->ndim, shape);
+
+  if (src->ndim == 2) {
+    long rows = src->shape[0], cols = src->shape[1];
+    for (long ib = 0; ib < rows; ib += LARRAY_BLOCK) {
+      for (long jb = 0; jb < cols; jb += LARRAY_BLOCK) {
+        long iend = ib + LARRAY_BLOCK < rows ? ib + LARRAY_BLOCK : rows;
+        long jend = jb + LARRAY_BLOCK < cols ? jb + LARRAY_BLOCK : cols;
+        for (long i = ib; i < iend; i++) {
+          for (long j = jb; j < jend; j++) {
+            r->data[j * rows + i] = src->data[i * cols + j];
+          }
+        }
+      }
+    }
+  } else {
+    /* Walk the source in order, scattering with reversed strides */
+    long stride[LARRAY_MAX_DIMS], index[LARRAY_MAX_DIMS];
+    long s = 1;
+    for (int d = 0; d < src->ndim; d++) {
+      /* Source axis d is destination axis ndim-1-d */
+      stride[d] = s;
+      s *= src->shape[d];
+      index[d] = 0;
+    }
+    long off = 0;
+    for (long i = 0; i < src->size; i++) {
+      r->data[off] = src->data[i];
+      for (int d = src->ndim - 1; d >= 0; d--) {
+        off += stride[d];
+        if (++index[d] < src->shape[d]) {
+          break;
+        }
+        off -= stride[d] * src->shape[d];
+        index[d] = 0;
+      }
+    }
+  }
+
+  lval_del(a);
+  return larr(r);
+}
+
+/* Reduce an array with op, over every element or along one axis */
+lval *larray_reduce(lval *a, char *func, char op) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function '%s' passed incorrect number of arguments: %d\n"
+          "Expected an Array and an optional axis",
+          func, a->count);
+  LASSERT_TYPE(func, LVAL_ARRAY, 0, a);
+  larray *src = a->cell[0]->arr;
+
+  long outer = 1, n = src->size, inner = 1;
+  int axis = -1;
+  if (a->count == 2) {
+    LASSERT_TYPE(func, LVAL_NUM, 1, a);
+    LASSERT(a, a->cell[1]->num >= 0 && a->cell[1]->num < src->ndim,
+            "Function '%s' passed axis %li for %d dimensions", func,
+            a->cell[1]->num, src->ndim);
+    axis = a->cell[1]->num;
+    for (int d = 0; d < axis; d++) {
+      outer *= src->shape[d];
+    }
+    n = src->shape[axis];
+    for (int d = axis + 1; d < src->ndim; d++) {
+      inner *= src->shape[d];
+    }
+  }
+  LASSERT(a, n > 0 || (op != '<' && op != '>'),
+          "Function '%s' passed an empty array", func);
+
+  long *out = malloc(sizeof(long) * outer * inner);
+  for (long o = 0; o < outer; o++) {
+    long *row = &out[o * inner];
+    long *base = &src->data[o * n * inner];
+    for (long i = 0; i < inner; i++) {
+      row[i] = op == '+' ? 0 : op == '*' ? 1 : base[i];
+    }
+    /* Accumulate whole rows so the inner loop runs over contiguous memory */
+    for (long k = 0; k < n; k++) {
+      long *in = &base[k * inner];
+      switch (op) {
+      case '+':
+        for (long i = 0; i < inner; i++) {
+          row[i] += in[i];
+        }
+        break;
+      case '*':
+        for (long i = 0; i < inner; i++) {
+          row[i] *= in[i];
+        }
+        break;
+      case '<':
+        for (long i = 0; i < inner; i++) {
+          row[i] = in[i] < row[i] ? in[i] : row[i];
+        }
+        break;
+      case '>':
+        for (long i = 0; i < inner; i++) {
+          row[i] = in[i] > row[i] ? in[i] : row[i];
+        }
+        break;
+      }
+    }
+  }
+
+  lval *x;
+  if (axis < 0 || src->ndim == 1) {
+    x = lnum(out[0]);
+  } else {
+    long shape[LARRAY_MAX_DIMS];
+    int nd = 0;
+    for (int d = 0; d < src->ndim; d++) {
+      if (d != axis) {
+        shape[nd++] = src->shape[d];
+      }
+    }
+    larray *r = larray_new(nd, shape);
+    memcpy(r->data, out, sizeof(long) * r->size);
+    x = larr(r);
+  }
+  free(out);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_sum(lenv *e, lval *a) { return larray_reduce(a, "sum", '+'); }
+
+lval *builtin_prod(lenv *e, lval *a) { return larray_reduce(a, "prod", '*'); }
+
+lval *builtin_min(lenv *e, lval *a) { return larray_reduce(a, "min", '<'); }
+
+lval *builtin_max(lenv *e, lval *a) { return larray_reduce(a, "max", '>'); }
+
+#ifdef __GNUC__
+/* Four lanes of longs; GCC lowers this to the widest SIMD available */
+typedef long lvec4 __attribute__((vector_size(4 * sizeof(long))));
+#endif
+
+/* c[n][m] += a[n][k] * b[k][m], one cache-sized tile at a time */
+void larray_matmul(long *c, long *a, long *b, long n, long k, long m) {
+  memset(c, 0, sizeof(long) * n * m);
+  for (long ib = 0; ib < n; ib += LARRAY_BLOCK) {
+    long iend = ib + LARRAY_BLOCK < n ? ib + LARRAY_BLOCK : n;
+    for (long pb = 0; pb < k; pb += LARRAY_BLOCK) {
+      long pend = pb + LARRAY_BLOCK < k ? pb + LARRAY_BLOCK : k;
+      for (long jb = 0; jb < m; jb += LARRAY_BLOCK) {
+        long jend = jb + LARRAY_BLOCK < m ? jb + LARRAY_BLOCK : m;
+        for (long i = ib; i < iend; i++) {
+          long *crow = &c[i * m];
+          for (long p = pb; p < pend; p++) {
+            long s = a[i * k + p];
+            long *brow = &b[p * m];
+            long j = jb;
+#ifdef __GNUC__
+            lvec4 sv = {s, s, s, s};
+            for (; j + 4 <= jend; j += 4) {
+              lvec4 bv, cv;
+              memcpy(&bv, &brow[j], sizeof(bv));
+              memcpy(&cv, &crow[j], sizeof(cv));
+              cv += sv * bv;
+              memcpy(&crow[j], &cv, sizeof(cv));
+            }
+#endif
+            for (; j < jend; j++) {
+              crow[j] += s * brow[j];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+lval *builtin_matmul(lenv *e, lval *a) {
+  LASSERT_NUM("matmul", 2, "Arrays", a);
+  LASSERT_TYPE("matmul", LVAL_ARRAY, 0, a);
+  LASSERT_TYPE("matmul", LVAL_ARRAY, 1, a);
+  larray *x = a->cell[0]->arr;
+  larray *y = a->cell[1]->arr;
+  LASSERT(a, x->ndim == 2 && y->ndim == 2,
+          "Function 'matmul' expects two matrices");
+  LASSERT(a, x->shape[1] == y->shape[0],
+          "Function 'matmul' passed %lix%li and %lix%li matrices", x->shape[0],
+          x->shape[1], y->shape[0], y->shape[1]);
+
+  long shape[2] = {x->shape[0], y->shape[1]};
+  larray *r = larray_new(2, shape);
+  larray_matmul(r->data, x->data, y->data, x->shape[0], x->shape[1],
+                y->shape[1]);
+  lval_del(a);
+  return larr(r);
+}
+
+/* Strings */
+
+lval *builtin_strlen(lenv *e, lval *a) {
+  LASSERT_NUM("strlen", 1, "String", a);
+  LASSERT_TYPE("strlen", LVAL_STR, 0, a);
+  lval *x = lnum(a->cell[0]->len);
+  lval_del(a);
+  return x;
+}
+
+/* Join Strings and Numbers into one String */
+lval *builtin_concat(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    int t = a->cell[i]->type;
+    LASSERT(a, t == LVAL_STR || t == LVAL_NUM,
+            "Function 'concat' passed incorrect type for argument %i. Got %s, "
+            "Expected String or Number",
+            i, ltype_name(t));
+  }
+
+  lstrbuilder b = {NULL, 0};
+  for (int i = 0; i < a->count; i++) {
+    lval *x = a->cell[i];
+    if (x->type == LVAL_STR) {
+      lstrbuilder_add(&b, x->str, x->len);
+    } else {
+      char num[32];
+      lstrbuilder_add(&b, num, snprintf(num, sizeof(num), "%li", x->num));
+    }
+  }
+  lval_del(a);
+  return lstrbuilder_done(&b);
+}
+
+/* (substr s start [len]) shares the bytes of s rather than copying them */
+lval *builtin_substr(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'substr' passed incorrect number of arguments: %d\n"
+          "Expected a String, a start and an optional length",
+          a->count);
+  LASSERT_TYPE("substr", LVAL_STR, 0, a);
+  LASSERT_TYPE("substr", LVAL_NUM, 1, a);
+  lval *s = a->cell[0];
+  long start = a->cell[1]->num;
+  LASSERT(a, start >= 0 && start <= s->len,
+          "Function 'substr' passed start %li for a String of length %li",
+          start, s->len);
+  long len = s->len - start;
+  if (a->count == 3) {
+    LASSERT_TYPE("substr", LVAL_NUM, 2, a);
+    LASSERT(a, a->cell[2]->num >= 0 && a->cell[2]->num <= len,
+            "Function 'substr' passed length %li with %li bytes remaining",
+            a->cell[2]->num, len);
+    len = a->cell[2]->num;
+  }
+  lval *x = lstr_slice(s, start, len);
+  lval_del(a);
+  return x;
+}
+
+/* Offset of the first needle in s[from..], or -1 */
+long lstr_find(char *s, long len, char *needle, long nlen, long from) {
+  if (nlen == 0) {
+    return from <= len ? from : -1;
+  }
+  char *p = s + from;
+  char *end = s + len - nlen + 1;
+  while (p < end && (p = memchr(p, needle[0], end - p))) {
+    if (memcmp(p, needle, nlen) == 0) {
+      return p - s;
+    }
+    p++;
+  }
+  return -1;
+}
+
+lval *builtin_search(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'search' passed incorrect number of arguments: %d\n"
+          "Expected a String, a needle and an optional start",
+          a->count);
+  LASSERT_TYPE("search", LVAL_STR, 0, a);
+  LASSERT_TYPE("search", LVAL_STR, 1, a);
+  long from = 0;
+  if (a->count == 3) {
+    LASSERT_TYPE("search", LVAL_NUM, 2, a);
+    from = a->cell[2]->num;
+    LASSERT(a, from >= 0 && from <= a->cell[0]->len,
+            "Function 'search' passed start %li for a String of length %li",
+            from, a->cell[0]->len);
+  }
+  lval *s = a->cell[0];
+  lval *n = a->cell[1];
+  lval *x = lnum(lstr_find(s->str, s->len, n->str, n->len, from));
+  lval_del(a);
+  return x;
+}
+
+/* Split a String on a separator into a Qexpr of slices of it */
+lval *builtin_split(lenv *e, lval *a) {
+  LASSERT_NUM("split", 2, "Strings", a);
+  LASSERT_TYPE("split", LVAL_STR, 0, a);
+  LASSERT_TYPE("split", LVAL_STR, 1, a);
+  lval *s = a->cell[0];
+  lval *sep = a->cell[1];
+  LASSERT(a, sep->len > 0, "Function 'split' passed an empty separator");
+
+  lval *x = lqexpr();
+  long start = 0;
+  for (;;) {
+    long at = lstr_find(s->str, s->len, sep->str, sep->len, start);
+    long end = at < 0 ? s->len : at;
+    lval_add(x, lstr_slice(s, start, end - start));
+    if (at < 0) {
+      break;
+    }
+    start = at + sep->len;
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Maps */
+
+/* Build a map from a Qexpr of alternating keys and values */
+lval *lval_map_from(lval *a, char *func, int kind) {
+  LASSERT_NUM(func, 1, "QExpr", a);
+  LASSERT_TYPE(func, LVAL_QEXPR, 0, a);
+  lval *q = lval_unpack(a->cell[0]);
+  LASSERT(a, q->count % 2 == 0,
+          "Function '%s' expects a QExpr of keys and values", func);
+
+  lmap *m = lmap_new(kind);
+  while (q->count) {
+    lval *k = lval_pop(q, 0);
+    lmap_put(m, k, lval_pop(q, 0));
+  }
+  lval_del(a);
+  return lmapv(m);
+}
+
+lval *builtin_dict(lenv *e, lval *a) {
+  return lval_map_from(a, "dict", LMAP_HASH);
+}
+
+lval *builtin_pdict(lenv *e, lval *a) {
+  return lval_map_from(a, "pdict", LMAP_HAMT);
+}
+
+/* (get m k [default]) */
+lval *builtin_get(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'get' passed incorrect number of arguments: %d\n"
+          "Expected a Map, a key and an optional default",
+          a->count);
+  LASSERT_TYPE("get", LVAL_MAP, 0, a);
+  lval *v;
+  if (lmap_lookup(a->cell[0]->map, a->cell[1], &v)) {
+    /* Sets hand back the key itself */
+    v = lval_copy(v ? v : a->cell[1]);
+  } else if (a->count == 3) {
+    v = lval_pop(a, 2);
+  } else {
+    v = lerr("Key not found in Map");
+  }
+  lval_del(a);
+  return v;
+}
+
+/* (put m k v) returns m with k bound to v, and (put s k) adds k to s */
+lval *builtin_put(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'put' passed no arguments");
+  LASSERT_TYPE("put", LVAL_MAP, 0, a);
+  lval *m = a->cell[0];
+  int nargs = m->map->set ? 2 : 3;
+  LASSERT_NUM("put", nargs, "arguments", a);
+  LASSERT(a, m->map->kind != LMAP_BTREE || a->cell[1]->type == LVAL_NUM,
+          "Function 'put' passed a %s key for an ordered Map",
+          ltype_name(a->cell[1]->type));
+  m->map = lmap_unshare(m->map);
+  lval *k = lval_pop(a, 1);
+  lmap_put(m->map, k, m->map->set ? NULL : lval_pop(a, 1));
+  return lval_take(a, 0);
+}
+
+/* (remove m k) returns m without k */
+lval *builtin_remove(lenv *e, lval *a) {
+  LASSERT_NUM("remove", 2, "arguments", a);
+  LASSERT_TYPE("remove", LVAL_MAP, 0, a);
+  lval *m = a->cell[0];
+  lval *v;
+  if (lmap_lookup(m->map, a->cell[1], &v)) {
+    m->map = lmap_unshare(m->map);
+    lmap_remove(m->map, a->cell[1]);
+  }
+  return lval_take(a, 0);
+}
+
+/* Build an ordered map or set, bulk loading keys that are already sorted */
+lval *lval_omap_from(lval *a, char *func, int set) {
+  LASSERT_NUM(func, 1, "QExpr", a);
+  LASSERT_TYPE(func, LVAL_QEXPR, 0, a);
+  lval *q = a->cell[0];
+  int step = set ? 1 : 2;
+  LASSERT(a, q->count % step == 0,
+          "Function '%s' expects a QExpr of keys and values", func);
+
+  long n = q->count / step;
+  for (long i = 0; !q->nums && i < n; i++) {
+    lval *k = q->cell[i * step];
+    LASSERT(a, k->type == LVAL_NUM,
+            "Function '%s' passed a %s key; ordered keys must be Numbers",
+            func, ltype_name(k->type));
+  }
+
+  long *keys = malloc(sizeof(long) * (n > 0 ? n : 1));
+  int sorted = 1;
+  for (long i = 0; i < n; i++) {
+    keys[i] = q->nums ? q->nums[i * step] : q->cell[i * step]->num;
+    sorted = sorted && (i == 0 || keys[i - 1] < keys[i]);
+  }
+
+  lmap *m = lmap_new(LMAP_BTREE);
+  m->set = set;
+  if (sorted) {
+    lval **vals = calloc(n > 0 ? n : 1, sizeof(lval *));
+    for (long i = 0; !set && i < n; i++) {
+      vals[i] = q->nums ? lnum(q->nums[i * 2 + 1])
+                        : lval_copy(q->cell[i * 2 + 1]);
+      vals[i] = lval_promote(vals[i]);
+    }
+    m->tree = lbtree_load(keys, vals, n);
+    m->count = n;
+    free(vals);
+  } else {
+    for (long i = 0; i < n; i++) {
+      lval *v = NULL;
+      if (!set) {
+        v = q->nums ? lnum(q->nums[i * 2 + 1]) : lval_copy(q->cell[i * 2 + 1]);
+      }
+      lmap_put(m, lnum(keys[i]), v);
+    }
+  }
+  free(keys);
+  lval_del(a);
+  return lmapv(m);
+}
+
+lval *builtin_omap(lenv *e, lval *a) { return lval_omap_from(a, "omap", 0); }
+
+lval *builtin_oset(lenv *e, lval *a) { return lval_omap_from(a, "oset", 1); }
+
+void lval_add_range(long key, lval *val, void *ctx) {
+  if (!val) {
+    lval_add(ctx, lnum(key));
+    return;
+  }
+  lval *pair = lqexpr();
+  lval_add(pair, lnum(key));
+  lval_add(pair, lval_copy(val));
+  lval_add(ctx, pair);
+}
+
+/* (range m lo hi) lists the keys of a set, or the {key value} pairs of a
+ * map, with lo <= key <= hi in ascending order */
+lval *builtin_range(lenv *e, lval *a) {
+  LASSERT_NUM("range", 3, "arguments", a);
+  LASSERT_TYPE("range", LVAL_MAP, 0, a);
+  LASSERT_TYPE("range", LVAL_NUM, 1, a);
+  LASSERT_TYPE("range", LVAL_NUM, 2, a);
+  lmap *m = a->cell[0]->map;
+  LASSERT(a, m->kind == LMAP_BTREE,
+          "Function 'range' expects an ordered Map or Set");
+  lval *x = lqexpr();
+  lbtree_range(m->tree, a->cell[1]->num, a->cell[2]->num, lval_add_range, x);
+  lval_del(a);
+  return x;
+}
+
+void lval_add_key(lval *k, lval *v, void *ctx) {
+  lval_add(ctx, lval_copy(k));
+}
+
+lval *builtin_keys(lenv *e, lval *a) {
+  LASSERT_NUM("keys", 1, "Map", a);
+  LASSERT_TYPE("keys", LVAL_MAP, 0, a);
+  lval *x = lqexpr();
+  lmap_each(a->cell[0]->map, lval_add_key, x);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_size(lenv *e, lval *a) {
+  LASSERT_NUM("size", 1, "Map", a);
+  LASSERT_TYPE("size", LVAL_MAP, 0, a);
+  lval *x = lnum(a->cell[0]->map->count);
+  lval_del(a);
+  return x;
+}
+
+/* Sorting */
+
+/* Default ordering: by type, then Numbers by value, text bytewise and
+ * lists element by element. Other values compare equal */
+int lval_cmp(lval *x, lval *y) {
+  if (x->type != y->type) {
+    return x->type < y->type ? -1 : 1;
+  }
+  switch (x->type) {
+  case LVAL_NUM:
+    return (x->num > y->num) - (x->num < y->num);
+  case LVAL_STR: {
+    long n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->str, y->str, n);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+  }
+  case LVAL_SYM:
+    return strcmp(x->sym, y->sym);
+  case LVAL_ERR:
+    return strcmp(x->err, y->err);
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+  default:
+    if (x->type < LVAL_RECORD && x->type != LVAL_SEXPR &&
+        x->type != LVAL_QEXPR) {
+      return 0;
+    }
+    for (int i = 0; i < x->count && i < y->count; i++) {
+      lval a = {0}, b = {0};
+      a.type = b.type = LVAL_NUM;
+      lval *p = x->nums ? (a.num = x->nums[i], &a) : x->cell[i];
+      lval *q = y->nums ? (b.num = y->nums[i], &b) : y->cell[i];
+      int c = lval_cmp(p, q);
+      if (c) {
+        return c;
+      }
+    }
+    return (x->count > y->count) - (x->count < y->count);
+  }
+  return 0;
+}
+
+/* How two elements are compared: the default ordering, or a user
+ * function whose Number result orders them like strcmp */
+typedef struct lsort {
+  lenv *env;
+  lval *cmp;
+  /* First error raised by the comparator; sorting stops comparing */
+  lval *err;
+} lsort;
+
+int lsort_cmp(lsort *s, lval *x, lval *y) {
+  if (!s->cmp) {
+    return lval_cmp(x, y);
+  }
+  if (s->err) {
+    return 0;
+  }
+  lval *call = lsexpr();
+  lval_add(call, lval_copy(s->cmp));
+  lval_add(call, lval_copy(x));
+  lval_add(call, lval_copy(y));
+  lval *r = lval_apply(s->env, call);
+  if (r->type != LVAL_NUM) {
+    s->err = r->type == LVAL_ERR
+                 ? r
+                 : lerr("Comparator returned %s, Expected Number",
+                        ltype_name(r->type));
+    if (s->err != r) {
+      lval_del(r);
+    }
+    return 0;
+  }
+  int c = (r->num > 0) - (r->num < 0);
+  lval_del(r);
+  return c;
+}
+
+/* Sort signed longs in place, one byte at a time from the least
+ * significant, skipping bytes on which every element agrees */
+void lsort_radix(long *v, long n) {
+  if (n < 2) {
+    return;
+  }
+  long *tmp = malloc(sizeof(long) * n);
+  long counts[sizeof(long)][256];
+  memset(counts, 0, sizeof(counts));
+
+  /* Flipping the sign bit makes unsigned byte order match signed order */
+  unsigned long flip = 1UL << (sizeof(long) * 8 - 1);
+  for (long i = 0; i < n; i++) {
+    unsigned long u = (unsigned long)v[i] ^ flip;
+    for (int d = 0; d < (int)sizeof(long); d++) {
+      counts[d][(u >> (d * 8)) & 0xff]++;
+    }
+  }
+
+  long *src = v, *dst = tmp;
+  for (int d = 0; d < (int)sizeof(long); d++) {
+    unsigned long u0 = (unsigned long)v[0] ^ flip;
+    if (counts[d][(u0 >> (d * 8)) & 0xff] == n) {
+      continue;
+    }
+    long offset[256], at = 0;
+    for (int b = 0; b < 256; b++) {
+      offset[b] = at;
+      at += counts[d][b];
+    }
+    for (long i = 0; i < n; i++) {
+      unsigned long u = (unsigned long)src[i] ^ flip;
+      dst[offset[(u >> (d * 8)) & 0xff]++] = src[i];
+    }
+    long *t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != v) {
+    memcpy(v, src, sizeof(long) * n);
+  }
+  free(tmp);
+}
+
+#define LSORT_SMALL 16
+
+void lsort_insertion(lsort *s, lval **v, long n) {
+  for (long i = 1; i < n; i++) {
+    lval *x = v[i];
+    long j = i;
+    while (j > 0 && lsort_cmp(s, v[j - 1], x) > 0) {
+      v[j] = v[j - 1];
+      j--;
+    }
+    v[j] = x;
+  }
+}
+
+void lsort_sift(lsort *s, lval **v, long root, long n) {
+  lval *x = v[root];
+  for (long child; (child = root * 2 + 1) < n; root = child) {
+    if (child + 1 < n && lsort_cmp(s, v[child], v[child + 1]) < 0) {
+      child++;
+    }
+    if (lsort_cmp(s, x, v[child]) >= 0) {
+      break;
+    }
+    v[root] = v[child];
+  }
+  v[root] = x;
+}
+
+void lsort_heap(lsort *s, lval **v, long n) {
+  for (long i = n / 2 - 1; i >= 0; i--) {
+    lsort_sift(s, v, i, n);
+  }
+  for (long i = n - 1; i > 0; i--) {
+    lval *t = v[0];
+    v[0] = v[i];
+    v[i] = t;
+    lsort_sift(s, v, 0, i);
+  }
+}
+
+/* Quicksort on a median of three, falling back to heapsort once the
+ * recursion is deeper than a balanced split would need */
+void lsort_intro(lsort *s, lval **v, long n, int depth) {
+  while (n > LSORT_SMALL) {
+    if (depth-- == 0) {
+      lsort_heap(s, v, n);
+      return;
+    }
+    lval **a = &v[0], **b = &v[n / 2], **c = &v[n - 1], *t;
+    if (lsort_cmp(s, *b, *a) < 0) {
+      t = *a, *a = *b, *b = t;
+    }
+    if (lsort_cmp(s, *c, *b) < 0) {
+      t = *b, *b = *c, *c = t;
+      if (lsort_cmp(s, *b, *a) < 0) {
+        t = *a, *a = *b, *b = t;
+      }
+    }
+    lval *pivot = *b;
+
+    /* The bounds checks guard against comparators that are not orders */
+    long i = 0, j = n - 1;
+    for (;;) {
+      while (i < n - 1 && lsort_cmp(s, v[i], pivot) < 0) {
+        i++;
+      }
+      while (j > 0 && lsort_cmp(s, pivot, v[j]) < 0) {
+        j--;
+      }
+      if (i >= j) {
+        break;
+      }
+      t = v[i], v[i] = v[j], v[j] = t;
+      i++;
+      j--;
+    }
+
+    /* Recurse into the smaller side to bound the stack */
+    long left = j + 1;
+    if (left < n - left) {
+      lsort_intro(s, v, left, depth);
+      v += left;
+      n -= left;
+    } else {
+      lsort_intro(s, &v[left], n - left, depth);
+      n = left;
+    }
+  }
+  lsort_insertion(s, v, n);
+}
+
+/* Stable merge sort through a scratch array of n pointers */
+void lsort_merge(lsort *s, lval **v, lval **tmp, long n) {
+  if (n <= LSORT_SMALL) {
+    lsort_insertion(s, v, n);
+    return;
+  }
+  long mid = n / 2;
+  lsort_merge(s, v, tmp, mid);
+  lsort_merge(s, &v[mid], tmp, n - mid);
+  if (lsort_cmp(s, v[mid - 1], v[mid]) <= 0) {
+    return;
+  }
+  memcpy(tmp, v, sizeof(lval *) * mid);
+  long i = 0, j = mid, k = 0;
+  while (i < mid && j < n) {
+    v[k++] = lsort_cmp(s, v[j], tmp[i]) < 0 ? v[j++] : tmp[i++];
+  }
+  memcpy(&v[k], &tmp[i], sizeof(lval *) * (mid - i));
+}
+
+/* (sort q [cmp]) and (sort-stable q [cmp]) reorder q's elements in place */
+lval *lval_sort(lenv *e, lval *a, char *func, int stable) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function '%s' passed incorrect number of arguments: %d\n"
+          "Expected a QExpr and an optional comparator",
+          func, a->count);
+  LASSERT_TYPE(func, LVAL_QEXPR, 0, a);
+  if (a->count == 2) {
+    LASSERT_TYPE(func, LVAL_FUN, 1, a);
+  }
+  lsort s = {e, a->count == 2 ? a->cell[1] : NULL, NULL};
+  lval *q = a->cell[0];
+
+  /* Numbers in their natural order go through the radix sort, which is
+   * stable anyway */
+  if (!s.cmp) {
+    lval_pack(q);
+    if (q->nums) {
+      lsort_radix(q->nums, q->count);
+      return lval_take(a, 0);
+    }
+  }
+
+  lval_unpack(q);
+  if (stable) {
+    lval **tmp = malloc(sizeof(lval *) * (q->count / 2 + 1));
+    lsort_merge(&s, q->cell, tmp, q->count);
+    free(tmp);
+  } else {
+    int depth = 0;
+    for (long n = q->count; n > 1; n >>= 1) {
+      depth += 2;
+    }
+    lsort_intro(&s, q->cell, q->count, depth);
+  }
+  if (s.err) {
+    lval_del(a);
+    return s.err;
+  }
+  lval_pack(q);
+  return lval_take(a, 0);
+}
+
+lval *builtin_sort(lenv *e, lval *a) { return lval_sort(e, a, "sort", 0); }
+
+lval *builtin_sort_stable(lenv *e, lval *a) {
+  return lval_sort(e, a, "sort-stable", 1);
+}
+
+/* Records */
+
+/* Constructor and accessors of a record, as generated by defrecord */
+lval *lrecord_apply(lval *f, lval *a) {
+  lrectype *t = &linterp_current->rectypes[f->rec - LVAL_RECORD];
+  if (f->slot < 0) {
+    LASSERT_NUM(t->name, t->nslots, "slots", a);
+    /* The argument list already is the slot array */
+    a->type = f->rec;
+    return a;
+  }
+
+  /* (name-slot r) reads a slot, (name-slot r v) returns r with it set */
+  char func[STR_ERR_SIZE];
+  snprintf(func, sizeof(func), "%s-%s", t->name, t->slots[f->slot]);
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function '%s' passed incorrect number of arguments: %d\n"
+          "Expected a %s and an optional value",
+          func, a->count, t->name);
+  LASSERT_TYPE(func, f->rec, 0, a);
+  lval *r = a->cell[0];
+  if (a->count == 1) {
+    return lval_take(lval_take(a, 0), f->slot);
+  }
+  lval_del(r->cell[f->slot]);
+  r->cell[f->slot] = lval_pop(a, 1);
+  return lval_take(a, 0);
+}
+
+/* (defrecord {name} {slot ...}) declares a record type and defines its
+ * constructor name and an accessor name-slot for each slot */
+lval *builtin_defrecord(lenv *e, lval *a) {
+  LASSERT_NUM("defrecord", 2, "QExprs", a);
+  LASSERT_TYPE("defrecord", LVAL_QEXPR, 0, a);
+  LASSERT_TYPE("defrecord", LVAL_QEXPR, 1, a);
+  lval *name = lval_unpack(a->cell[0]);
+  lval *slots = lval_unpack(a->cell[1]);
+  LASSERT(a, name->count == 1 && name->cell[0]->type == LVAL_SYM,
+          "Function 'defrecord' expects a single name");
+  LASSERT(a, slots->count > 0, "Function 'defrecord' passed no slots");
+  for (int i = 0; i < slots->count; i++) {
+    LASSERT(a, slots->cell[i]->type == LVAL_SYM,
+            "Function 'defrecord' cannot use non-symbols as slots");
+    for (int j = 0; j < i; j++) {
+      LASSERT(a, strcmp(slots->cell[i]->sym, slots->cell[j]->sym) != 0,
+              "Function 'defrecord' passed slot '%s' twice",
+              slots->cell[i]->sym);
+    }
+  }
+
+  linterp *li = linterp_current;
+  li->rectypes =
+      realloc(li->rectypes, sizeof(lrectype) * (li->rectype_count + 1));
+  lrectype *t = &li->rectypes[li->rectype_count];
+  t->name = malloc(strlen(name->cell[0]->sym) + 1);
+  strcpy(t->name, name->cell[0]->sym);
+  t->nslots = slots->count;
+  t->slots = malloc(sizeof(char *) * t->nslots);
+  for (int i = 0; i < t->nslots; i++) {
+    t->slots[i] = malloc(strlen(slots->cell[i]->sym) + 1);
+    strcpy(t->slots[i], slots->cell[i]->sym);
+  }
+  int tag = LVAL_RECORD + li->rectype_count++;
+
+  for (int i = -1; i < t->nslots; i++) {
+    char sym[STR_ERR_SIZE];
+    if (i < 0) {
+      snprintf(sym, sizeof(sym), "%s", t->name);
+    } else {
+      snprintf(sym, sizeof(sym), "%s-%s", t->name, t->slots[i]);
+    }
+    lval *k = lsym(sym);
+    lval *f = lfun(NULL);
+    f->rec = tag;
+    f->slot = i;
+    lenv_put(e, k, f);
+    lval_del(k);
+    lval_del(f);
+  }
+  lval_del(a);
+  return lsexpr();
+}
+
+/* Name of the type of a value, as used in error messages */
+lval *builtin_typeof(lenv *e, lval *a) {
+  LASSERT_NUM("typeof", 1, "argument", a);
+  char *name = ltype_name(a->cell[0]->type);
+  lval_del(a);
+  return lstrn(name, strlen(name));
+}
+
+/* Bitsets */
+
+/* Largest member a bitset may hold, to keep a stray id from allocating
+ * gigabytes */
+#define LBITS_MAX (1L << 32)
+
+enum { LBITS_OR, LBITS_AND, LBITS_ANDNOT };
+
+#ifdef __GNUC__
+typedef unsigned long lwvec4 __attribute__((vector_size(4 * sizeof(long))));
+#endif
+
+/* out = a op b over n words, four words at a time where possible */
+void lbits_combine(unsigned long *out, unsigned long *a, unsigned long *b,
+                   long n, int op) {
+  long i = 0;
+#ifdef __GNUC__
+#define LBITS_LOOP(expr)                                                       \
+  for (; i + 4 <= n; i += 4) {                                                 \
+    lwvec4 x, y;                                                               \
+    memcpy(&x, &a[i], sizeof(x));                                              \
+    memcpy(&y, &b[i], sizeof(y));                                              \
+    x = (expr);                                                                \
+    memcpy(&out[i], &x, sizeof(x));                                            \
+  }
+  switch (op) {
+  case LBITS_OR:
+    LBITS_LOOP(x | y);
+    break;
+  case LBITS_AND:
+    LBITS_LOOP(x & y);
+    break;
+  case LBITS_ANDNOT:
+    LBITS_LOOP(x & ~y);
+    break;
+  }
+#undef LBITS_LOOP
+#endif
+  for (; i < n; i++) {
+    out[i] = op == LBITS_OR    ? a[i] | b[i]
+             : op == LBITS_AND ? a[i] & b[i]
+                               : a[i] & ~b[i];
+  }
+}
+
+/* A copy of b that only the caller refers to, consuming the caller's
+ * reference */
+lbits *lbits_unshare(lbits *b) {
+  if (__atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1) {
+    return b;
+  }
+  lbits *x = lbits_new(b->nwords);
+  memcpy(x->words, b->words, sizeof(unsigned long) * b->nwords);
+  lbits_release(b);
+  return x;
+}
+
+/* Fold the Bitset arguments together with op */
+lval *lbits_fold(lval *a, char *func, int op) {
+  LASSERT(a, a->count > 0, "Function '%s' passed no arguments", func);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE(func, LVAL_BITS, i, a);
+  }
+
+  lbits *x = lbits_unshare(a->cell[0]->bits);
+  a->cell[0]->bits = x;
+  for (int i = 1; i < a->count; i++) {
+    lbits *y = a->cell[i]->bits;
+    long n = x->nwords < y->nwords ? x->nwords : y->nwords;
+    if (op == LBITS_OR && y->nwords > x->nwords) {
+      x->words = realloc(x->words, sizeof(unsigned long) * y->nwords);
+      memcpy(&x->words[n], &y->words[n],
+             sizeof(unsigned long) * (y->nwords - n));
+      x->nwords = y->nwords;
+    }
+    lbits_combine(x->words, x->words, y->words, n, op);
+    if (op == LBITS_AND) {
+      x->nwords = n;
+    }
+    lbits_trim(x);
+  }
+  return lval_take(a, 0);
+}
+
+lval *builtin_union(lenv *e, lval *a) {
+  return lbits_fold(a, "union", LBITS_OR);
+}
+
+lval *builtin_intersect(lenv *e, lval *a) {
+  return lbits_fold(a, "intersect", LBITS_AND);
+}
+
+lval *builtin_difference(lenv *e, lval *a) {
+  return lbits_fold(a, "difference", LBITS_ANDNOT);
+}
+
+/* Bitset of the numbers in a Q-expression */
+lval *builtin_bitset(lenv *e, lval *a) {
+  LASSERT_NUM("bitset", 1, "QExpr", a);
+  LASSERT_TYPE("bitset", LVAL_QEXPR, 0, a);
+  lval *q = lval_pack(a->cell[0]);
+  LASSERT(a, q->count == 0 || q->nums,
+          "Function 'bitset' expects a QExpr of numbers");
+
+  long max = -1;
+  for (int i = 0; i < q->count; i++) {
+    LASSERT(a, q->nums[i] >= 0 && q->nums[i] < LBITS_MAX,
+            "Function 'bitset' cannot hold %li", q->nums[i]);
+    max = q->nums[i] > max ? q->nums[i] : max;
+  }
+  lbits *b = lbits_new(max / LBITS_WORD + 1);
+  for (int i = 0; i < q->count; i++) {
+    b->words[q->nums[i] / LBITS_WORD] |= 1UL << (q->nums[i] % LBITS_WORD);
+  }
+  lval_del(a);
+  return lbitsv(lbits_trim(b));
+}
+
+long lbits_count(lbits *b) {
+  long n = 0;
+  for (long i = 0; i < b->nwords; i++) {
+    n += lpopcount(b->words[i]);
+  }
+  return n;
+}
+
+lval *builtin_popcount(lenv *e, lval *a) {
+  LASSERT_NUM("popcount", 1, "Bitset", a);
+  LASSERT_TYPE("popcount", LVAL_BITS, 0, a);
+  lval *x = lnum(lbits_count(a->cell[0]->bits));
+  lval_del(a);
+  return x;
+}
+
+/* Members of a Bitset in ascending order, as a Q-expression */
+lval *builtin_members(lenv *e, lval *a) {
+  LASSERT_NUM("members", 1, "Bitset", a);
+  LASSERT_TYPE("members", LVAL_BITS, 0, a);
+  lbits *b = a->cell[0]->bits;
+  lval *x = lqexpr();
+  long n = lbits_count(b);
+  if (n > 0) {
+    x->nums = lalloc(sizeof(long) * n);
+    for (long w = 0; w < b->nwords; w++) {
+      for (unsigned long bits = b->words[w]; bits; bits &= bits - 1) {
+        x->nums[x->count++] = w * LBITS_WORD + lctz(bits);
+      }
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_contains(lenv *e, lval *a) {
+  LASSERT_NUM("contains", 2, "arguments", a);
+  LASSERT_TYPE("contains", LVAL_BITS, 0, a);
+  LASSERT_TYPE("contains", LVAL_NUM, 1, a);
+  lbits *b = a->cell[0]->bits;
+  long n = a->cell[1]->num;
+  int in = n >= 0 && n / LBITS_WORD < b->nwords &&
+           (b->words[n / LBITS_WORD] >> (n % LBITS_WORD)) & 1;
+  lval_del(a);
+  return lnum(in);
+}
+
+/* Parallel map and reduce
+ *
+ * pmap and preduce cut their list into chunks and run them on a pool of
+ * threads, each with a deque of chunk ranges. A thread halves the range
+ * it takes, pushing one half onto its own deque and carrying on with the
+ * other, and idle threads steal the oldest, largest ranges from the other
+ * deques. Every pool thread runs an interpreter of its own that reads the
+ * caller's environment through lenv_share, and values cross between
+ * interpreters only as clones, so the function must be pure: definitions
+ * it makes are lost.
+ */
+
+/* pmap aims for this many chunks per thread so stealing can even out the
+ * load */
+#define LPOOL_CHUNKS_PER_THREAD 8
+/* preduce always makes this many chunks, so the shape of its reduction
+ * tree depends only on the length of the list */
+#define LPOOL_REDUCE_CHUNKS 256
+
+/* A copy of v for another interpreter: Maps and the cells of Q-expressions
+ * are duplicated and memoised functions get an empty cache. Arrays,
+ * Strings and Bitsets count references atomically, and futures and
+ * channels are thread-safe, so copies still share them */
+lval *lval_clone(lval *v);
+
+void lmap_clone_entry(lval *k, lval *v, void *ctx) {
+  lmap_put(ctx, lval_clone(k), v ? lval_clone(v) : NULL);
+}
+
+lval *lval_clone(lval *v) {
+  switch (v->type) {
+  /* Their contents are counted atomically, so clones share them too */
+  case LVAL_ARRAY:
+  case LVAL_BITS:
+  case LVAL_STR:
+    return lval_copy(v);
+  case LVAL_MAP: {
+    lmap *m = lmap_new(v->map->kind);
+    m->set = v->map->set;
+    if (m->kind != LMAP_HASH) {
+      lmap_each(v->map, lmap_clone_entry, m);
+      return lmapv(m);
+    }
+    /* Hash tables keep their layout, and so their order */
+    free(m->slots);
+    m->count = v->map->count;
+    m->capacity = v->map->capacity;
+    m->tombstones = v->map->tombstones;
+    m->slots = malloc(sizeof(lmap_slot) * m->capacity);
+    for (long i = 0; i < m->capacity; i++) {
+      m->slots[i] = v->map->slots[i];
+      lval *key = m->slots[i].key;
+      if (key && key != &lmap_tombstone) {
+        m->slots[i].key = lval_clone(key);
+        m->slots[i].val = lval_clone(m->slots[i].val);
+      }
+    }
+    return lmapv(m);
+  }
+  case LVAL_FUN: {
+    lval *x = lfun(v->fun);
+    x->rec = v->rec;
+    x->slot = v->slot;
+    x->cache = v->cache ? lcache_new(v->cache->capacity) : NULL;
+    return x;
+  }
+  case LVAL_NUM:
   case LVAL_ERR:
-    printf("Error: %s", val->err);
-    break;
   case LVAL_SYM:
-    printf("%s", val->sym);
-    break;
-  case LVAL_FUN:
-    printf("<function>");
-    break;
-  case LVAL_QEXPR:
-    lval_expr_print(val, "{ ", " }");
+  case LVAL_FUTURE:
+  case LVAL_CHAN:
+    return lval_copy(v);
+  case LVAL_MACRO:
+    return lmacro(lval_clone(v->cell[0]), lval_clone(v->cell[1]));
+  default:
+  case LVAL_SEXPR:
+  case LVAL_QEXPR: {
+    lval *x = lqexpr();
+    x->type = v->type;
+    x->count = v->count;
+    if (v->nums) {
+      x->nums = lalloc(sizeof(long) * v->count);
+      memcpy(x->nums, v->nums, sizeof(long) * v->count);
+    } else if (v->count > 0) {
+      x->cell = lalloc(sizeof(lval *) * v->count);
+      for (int i = 0; i < v->count; i++) {
+        x->cell[i] = lval_clone(v->cell[i]);
+      }
+    }
+    return x;
+  }
+  }
+}
+
+/* Chunks [lo, hi) of the current job */
+typedef struct lrange {
+  long lo;
+  long hi;
+} lrange;
+
+/* The owner pushes and pops at the bottom, thieves take from the top */
+typedef struct ldeque {
+  pthread_mutex_t lock;
+  lrange *items;
+  long top;
+  long bottom;
+  long capacity;
+} ldeque;
+
+/* Jobs apply f to each element, fold f over each chunk, or evaluate each
+ * element of an Sexpr */
+enum { LJOB_MAP, LJOB_REDUCE, LJOB_EVAL };
+
+typedef struct ljob {
+  lenv *env;
+  lval *f;
+  lval *list;
+  int kind;
+  long n;
+  /* Elements per chunk */
+  long grain;
+  long nchunks;
+  /* A result per element, or per chunk when reducing */
+  lval **out;
+} ljob;
+
+typedef struct lworker {
+  struct lpool *pool;
+  int id;
+  pthread_t thread;
+  /* The worker's own interpreter, or the caller's for the last worker */
+  linterp *li;
+  /* The job's function, cloned into li */
+  lval *f;
+  ldeque deque;
+  /* Coroutines ready to run here */
+  struct lcoro *runq;
+  struct lcoro *runq_tail;
+} lworker;
+
+/* Futures, described with their builtins below, wait on the pool for a
+ * thread */
+enum { LFUTURE_PENDING, LFUTURE_RUNNING, LFUTURE_DONE };
+
+typedef struct lfuture {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int refs;
+  int state;
+  /* Set by cancel, and polled by the running evaluation */
+  int cancel;
+  /* The interpreter that made the future, which may share its result with
+   * copies of it; any other gets a clone */
+  linterp *owner;
+  /* The future's own interpreter and expression, until it runs */
+  linterp *li;
+  lval *expr;
+  /* The value, or NULL if cancelled before it started */
+  lval *result;
+  /* Next in the pool's queue */
+  struct lfuture *next;
+} lfuture;
+
+typedef struct lpool {
+  /* Threads besides the caller, which works as the last worker */
+  int nthreads;
+  lworker *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  /* Bumped to start each job */
+  unsigned long generation;
+  int stop;
+  /* Set while a job runs, so pmap inside pmap runs on the caller alone */
+  int busy;
+  /* Chunks of the job not yet finished, and threads that joined it and
+   * are still working */
+  long remaining;
+  int working;
+  ljob *job;
+  /* Futures waiting for a thread, run between jobs */
+  struct lfuture *queue;
+  struct lfuture *queue_tail;
+  /* Futures running on the pool's threads */
+  int futures;
+  /* Every coroutine not yet finished, how many are running, and a count
+   * of those spawned to spread them over the threads */
+  struct lcoro *coros;
+  int running;
+  unsigned long spawned;
+  /* Broadcast whenever a coroutine switches out */
+  pthread_cond_t progress;
+  /* Set once coroutines may no longer be spawned */
+  int closing;
+} lpool;
+
+void ldeque_push(ldeque *d, lrange r) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->capacity) {
+    d->capacity = d->capacity ? d->capacity * 2 : 64;
+    d->items = realloc(d->items, sizeof(lrange) * d->capacity);
+  }
+  d->items[d->bottom++] = r;
+  pthread_mutex_unlock(&d->lock);
+}
+
+int ldeque_pop(ldeque *d, lrange *r, int steal) {
+  pthread_mutex_lock(&d->lock);
+  int ok = d->top < d->bottom;
+  if (ok) {
+    *r = steal ? d->items[d->top++] : d->items[--d->bottom];
+  }
+  if (d->top == d->bottom) {
+    d->top = d->bottom = 0;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return ok;
+}
+
+/* Apply f to x, or to acc and x when reducing, consuming the arguments */
+lval *ljob_apply(lenv *e, lval *f, lval *acc, lval *x) {
+  lval *call = lsexpr();
+  lval_add(call, lval_copy(f));
+  if (acc) {
+    lval_add(call, acc);
+  }
+  lval_add(call, x);
+  return lval_apply(e, call);
+}
+
+/* Element i of the job's list, cloned when taken by a pool thread */
+lval *ljob_elem(ljob *j, long i, int foreign) {
+  lval *list = j->list;
+  if (list->nums) {
+    return lnum(list->nums[i]);
+  }
+  return foreign ? lval_clone(list->cell[i]) : lval_copy(list->cell[i]);
+}
+
+/* A result made by a pool thread, cloned for the caller to keep */
+lval *ljob_result(lval *r, int foreign) {
+  if (!foreign) {
+    return r;
+  }
+  lval *x = lval_clone(r);
+  lval_del(r);
+  return x;
+}
+
+/* Run chunk c of a job with environment e and function f. A pool thread
+ * passes foreign, as the job's values belong to another interpreter */
+void ljob_chunk(ljob *j, long c, lenv *e, lval *f, int foreign) {
+  long lo = c * j->grain;
+  long hi = lo + j->grain < j->n ? lo + j->grain : j->n;
+  if (j->kind != LJOB_REDUCE) {
+    for (long i = lo; i < hi; i++) {
+      lval *x = ljob_elem(j, i, foreign);
+      lval *r = j->kind == LJOB_EVAL ? lval_eval(e, x)
+                                     : ljob_apply(e, f, NULL, x);
+      j->out[i] = ljob_result(r, foreign);
+    }
+    return;
+  }
+  lval *acc = ljob_elem(j, lo, foreign);
+  for (long i = lo + 1; i < hi && acc->type != LVAL_ERR; i++) {
+    acc = ljob_apply(e, f, acc, ljob_elem(j, i, foreign));
+  }
+  j->out[c] = ljob_result(acc, foreign);
+}
+
+/* Take and run chunks until none are left */
+void lpool_work(lpool *p, lworker *w) {
+  int total = p->nthreads + 1;
+  int caller = w->id == p->nthreads;
+  lenv *e = caller ? p->job->env : w->li->env;
+  lval *f = caller ? p->job->f : w->f;
+  for (;;) {
+    lrange r = {0, 0};
+    int got = ldeque_pop(&w->deque, &r, 0);
+    for (int k = 1; !got && k < total; k++) {
+      got = ldeque_pop(&p->workers[(w->id + k) % total].deque, &r, 1);
+    }
+    if (!got) {
+      pthread_mutex_lock(&p->lock);
+      long left = p->remaining;
+      pthread_mutex_unlock(&p->lock);
+      if (left == 0) {
+        return;
+      }
+      sched_yield();
+      continue;
+    }
+
+    /* Keep the first chunk, leaving the rest in halves to be stolen */
+    while (r.hi - r.lo > 1) {
+      lrange upper = {r.lo + (r.hi - r.lo) / 2, r.hi};
+      ldeque_push(&w->deque, upper);
+      r.hi = upper.lo;
+    }
+    ljob_chunk(p->job, r.lo, e, f, !caller);
+    pthread_mutex_lock(&p->lock);
+    p->remaining--;
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+int lfuture_claim(struct lfuture *f);
+void lfuture_run(struct lfuture *f);
+struct lcoro *lsched_pick(lpool *p, lworker *w);
+void lcoro_resume(lpool *p, struct lcoro *co);
+
+/* The pool worker this thread runs, or NULL on the owner's thread */
+static LTHREAD lworker *lworker_current;
+
+void *lpool_thread(void *arg) {
+  lworker *w = arg;
+  lpool *p = w->pool;
+  linterp_enter(w->li);
+  lworker_current = w;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    struct lcoro *co = NULL;
+    while (!p->stop && p->generation == seen && !p->queue &&
+           !(co = lsched_pick(p, w))) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->stop) {
+      break;
+    }
+    if (co) {
+      pthread_mutex_unlock(&p->lock);
+      lcoro_resume(p, co);
+      pthread_mutex_lock(&p->lock);
+      continue;
+    }
+
+    /* Join a new job unless it finished while this thread was busy */
+    if (p->generation != seen) {
+      seen = p->generation;
+      if (p->job && p->remaining > 0) {
+        p->working++;
+        pthread_mutex_unlock(&p->lock);
+        lpool_work(p, w);
+        pthread_mutex_lock(&p->lock);
+        if (--p->working == 0) {
+          pthread_cond_signal(&p->done);
+        }
+      }
+      continue;
+    }
+
+    struct lfuture *f = p->queue;
+    p->queue = f->next;
+    p->futures++;
+    pthread_mutex_unlock(&p->lock);
+    if (lfuture_claim(f)) {
+      lfuture_run(f);
+    }
+    lfuture_release(f);
+    pthread_mutex_lock(&p->lock);
+    p->futures--;
+    pthread_cond_broadcast(&p->progress);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* An interpreter for a pool thread, which takes its environment from the
+ * caller before each job */
+linterp *lpool_interp(void) {
+  linterp *li = calloc(1, sizeof(linterp));
+  li->hcons = lhcons_table_new();
+  li->match = lmatch_cache_new();
+  li->jit = ljit_state_new();
+  linterp_register(li);
+  return li;
+}
+
+lpool *lpool_new(linterp *owner, int nthreads) {
+  lpool *p = calloc(1, sizeof(lpool));
+  p->nthreads = nthreads;
+  p->workers = calloc(nthreads + 1, sizeof(lworker));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+  pthread_cond_init(&p->progress, NULL);
+  for (int i = 0; i <= nthreads; i++) {
+    lworker *w = &p->workers[i];
+    w->pool = p;
+    w->id = i;
+    w->li = i < nthreads ? lpool_interp() : owner;
+    if (i < nthreads) {
+      w->li->sched = p;
+    }
+    pthread_mutex_init(&w->deque.lock, NULL);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&p->workers[i].thread, NULL, lpool_thread, &p->workers[i]);
+  }
+  return p;
+}
+
+void lsched_shutdown(lpool *p);
+
+void lpool_del(lpool *p) {
+  if (!p) {
+    return;
+  }
+  lsched_shutdown(p);
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i <= p->nthreads; i++) {
+    lworker *w = &p->workers[i];
+    if (i < p->nthreads) {
+      pthread_join(w->thread, NULL);
+      linterp *prev = linterp_enter(w->li);
+      if (w->f) {
+        lval_del(w->f);
+      }
+      linterp_enter(prev);
+      linterp_del(w->li);
+    }
+    pthread_mutex_destroy(&w->deque.lock);
+    free(w->deque.items);
+  }
+  /* Futures still queued run when touched instead */
+  while (p->queue) {
+    struct lfuture *f = p->queue;
+    p->queue = f->next;
+    lfuture_release(f);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->progress);
+  free(p->workers);
+  free(p);
+}
+
+/* Bring a pool thread's environment and function up to date with the
+ * caller's, from the caller's thread while the pool is idle */
+void lworker_sync(lworker *w, lenv *e, lval *f) {
+  linterp *owner = linterp_enter(w->li);
+  if (!w->li->env || w->li->env->version != e->version) {
+    if (w->li->env) {
+      lenv_del(w->li->env);
+    }
+    w->li->env = lenv_share(e);
+    lrectypes_copy(w->li, owner);
+  }
+  if (w->f) {
+    lval_del(w->f);
+  }
+  w->f = f ? lval_clone(f) : NULL;
+  linterp_enter(owner);
+}
+
+/* The current interpreter's pool, started on first use, or NULL when it
+ * runs on one thread */
+lpool *lpool_ensure(void) {
+  linterp *li = linterp_current;
+  if (li->threads <= 1) {
+    return NULL;
+  }
+  if (!li->pool) {
+    li->pool = lpool_new(li, li->threads - 1);
+  }
+  return li->pool;
+}
+
+/* The pool for a new job, or NULL to run it on this thread alone */
+lpool *lpool_get(void) {
+  lpool *p = lpool_ensure();
+  return p && !p->busy ? p : NULL;
+}
+
+void lpool_run(lpool *p, ljob *j) {
+  p->busy = 1;
+  for (int i = 0; i < p->nthreads; i++) {
+    lworker_sync(&p->workers[i], j->env, j->f);
+  }
+  lworker *caller = &p->workers[p->nthreads];
+  lrange all = {0, j->nchunks};
+  ldeque_push(&caller->deque, all);
+
+  /* Threads busy with futures join when they finish, if work is left */
+  pthread_mutex_lock(&p->lock);
+  p->job = j;
+  p->remaining = j->nchunks;
+  p->generation++;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  lpool_work(p, caller);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->working > 0) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  p->job = NULL;
+  pthread_mutex_unlock(&p->lock);
+  p->busy = 0;
+}
+
+/* Shared by pmap and preduce: (pmap f {x ...}) and (preduce f {x ...}) */
+lval *lval_pjob(lenv *e, lval *a, char *func, int reduce) {
+  LASSERT_NUM(func, 2, "arguments", a);
+  LASSERT_TYPE(func, LVAL_FUN, 0, a);
+  LASSERT_TYPE(func, LVAL_QEXPR, 1, a);
+  long n = a->cell[1]->count;
+  LASSERT(a, n > 0 || !reduce, "Function '%s' passed {}", func);
+  if (n == 0) {
+    return lval_take(a, 1);
+  }
+
+  lpool *p = lpool_get();
+  long target = reduce ? LPOOL_REDUCE_CHUNKS
+                       : (long)(p ? p->nthreads + 1 : 1) *
+                             LPOOL_CHUNKS_PER_THREAD;
+  ljob j = {e, a->cell[0], a->cell[1], reduce ? LJOB_REDUCE : LJOB_MAP, n};
+  j.grain = (n + target - 1) / target;
+  j.nchunks = (n + j.grain - 1) / j.grain;
+  j.out = calloc(reduce ? j.nchunks : n, sizeof(lval *));
+  if (p) {
+    lpool_run(p, &j);
+  } else {
+    for (long c = 0; c < j.nchunks; c++) {
+      ljob_chunk(&j, c, e, j.f, 0);
+    }
+  }
+
+  lval *x;
+  if (reduce) {
+    /* Combine the chunk results pairwise, in the same tree every time */
+    for (long m = j.nchunks; m > 1; m = (m + 1) / 2) {
+      for (long k = 0; k < m / 2; k++) {
+        j.out[k] = ljob_apply(e, j.f, j.out[2 * k], j.out[2 * k + 1]);
+      }
+      if (m % 2) {
+        j.out[m / 2] = j.out[m - 1];
+      }
+    }
+    x = j.out[0];
+  } else {
+    /* The first error wins, as it would running in order */
+    x = NULL;
+    for (long i = 0; i < n; i++) {
+      if (!x && j.out[i]->type == LVAL_ERR) {
+        x = j.out[i];
+        j.out[i] = NULL;
+      }
+    }
+    if (x) {
+      for (long i = 0; i < n; i++) {
+        if (j.out[i]) {
+          lval_del(j.out[i]);
+        }
+      }
+    } else {
+      x = lqexpr();
+      for (long i = 0; i < n; i++) {
+        lval_add(x, j.out[i]);
+      }
+      lval_pack(x);
+    }
+  }
+  free(j.out);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_pmap(lenv *e, lval *a) { return lval_pjob(e, a, "pmap", 0); }
+
+lval *builtin_preduce(lenv *e, lval *a) {
+  return lval_pjob(e, a, "preduce", 1);
+}
+
+/* (map f {x ...}) applies f to each element in order */
+lval *builtin_map(lenv *e, lval *a) {
+  LASSERT_NUM("map", 2, "arguments", a);
+  LASSERT_TYPE("map", LVAL_FUN, 0, a);
+  LASSERT_TYPE("map", LVAL_QEXPR, 1, a);
+  lval *f = a->cell[0];
+  lval *q = lval_unpack(a->cell[1]);
+  for (int i = 0; i < q->count; i++) {
+    q->cell[i] = ljob_apply(e, f, NULL, q->cell[i]);
+    if (q->cell[i]->type == LVAL_ERR) {
+      lval *err = lval_pop(q, i);
+      lval_del(a);
+      return err;
+    }
+  }
+  lval_pack(q);
+  return lval_take(a, 1);
+}
+
+/* (reduce f {x ...}) folds f over the elements from the left */
+lval *builtin_reduce(lenv *e, lval *a) {
+  LASSERT_NUM("reduce", 2, "arguments", a);
+  LASSERT_TYPE("reduce", LVAL_FUN, 0, a);
+  LASSERT_TYPE("reduce", LVAL_QEXPR, 1, a);
+  LASSERT(a, a->cell[1]->count > 0, "Function 'reduce' passed {}");
+  lval *f = a->cell[0];
+  lval *q = lval_unpack(a->cell[1]);
+  lval *acc = lval_pop(q, 0);
+  while (q->count > 0 && acc->type != LVAL_ERR) {
+    acc = ljob_apply(e, f, acc, lval_pop(q, 0));
+  }
+  lval_del(a);
+  return acc;
+}
+
+/* Futures
+ *
+ * (future {expr}) evaluates expr on a pool thread while the caller
+ * carries on, and (touch f) waits for its value. Each future runs in an
+ * interpreter of its own, cloned from the caller's when the future is
+ * made and deleted as soon as the expression has been evaluated. Nothing
+ * else then refers to any part of the result, so it passes back to the
+ * caller as it is instead of being copied.
+ */
+
+lval *lfuturev(lfuture *f) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_FUTURE;
+  v->fut = f;
+  return v;
+}
+
+void lfuture_retain(lfuture *f) {
+  pthread_mutex_lock(&f->lock);
+  f->refs++;
+  pthread_mutex_unlock(&f->lock);
+}
+
+/* Delete the interpreter of a future that will never run */
+void lfuture_discard(lfuture *f) {
+  linterp *prev = linterp_enter(f->li);
+  lval_del(f->expr);
+  linterp_enter(prev);
+  linterp_del(f->li);
+  f->li = NULL;
+  f->expr = NULL;
+}
+
+void lfuture_release(lfuture *f) {
+  pthread_mutex_lock(&f->lock);
+  int refs = --f->refs;
+  pthread_mutex_unlock(&f->lock);
+  if (refs > 0) {
+    return;
+  }
+  if (f->li) {
+    lfuture_discard(f);
+  }
+  if (f->result) {
+    lval_del(f->result);
+  }
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->done);
+  free(f);
+}
+
+/* Take a pending future to run or cancel; only one taker succeeds */
+int lfuture_claim(lfuture *f) {
+  pthread_mutex_lock(&f->lock);
+  int ok = f->state == LFUTURE_PENDING;
+  if (ok) {
+    f->state = LFUTURE_RUNNING;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return ok;
+}
+
+/* Evaluate a claimed future on this thread */
+void lfuture_run(lfuture *f) {
+  linterp *li = f->li;
+  linterp *prev = linterp_enter(li);
+  li->cancel = &f->cancel;
+  lval *x = lval_unpack(f->expr);
+  x->type = LVAL_SEXPR;
+  lval *r = lval_eval(li->env, lval_expand(li->env, x));
+  f->expr = NULL;
+  f->li = NULL;
+  linterp_enter(prev);
+  linterp_del(li);
+
+  pthread_mutex_lock(&f->lock);
+  f->result = r;
+  f->state = LFUTURE_DONE;
+  pthread_cond_broadcast(&f->done);
+  pthread_mutex_unlock(&f->lock);
+}
+
+/* Wait for f, running it here if no thread has taken it yet. The owner's
+ * last handle takes the result itself */
+lval *lfuture_touch(lfuture *f) {
+  if (lfuture_claim(f)) {
+    lfuture_run(f);
+  }
+  pthread_mutex_lock(&f->lock);
+  while (f->state != LFUTURE_DONE) {
+    pthread_cond_wait(&f->done, &f->lock);
+  }
+  lval *r;
+  if (!f->result) {
+    r = lerr("Future cancelled");
+  } else if (f->owner != linterp_current) {
+    r = lval_clone(f->result);
+  } else if (f->refs == 1) {
+    r = f->result;
+    f->result = NULL;
+  } else {
+    r = lval_copy(f->result);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return r;
+}
+
+lpool *lsched_get(void);
+
+/* (future {expr}) starts evaluating expr and returns a future for it */
+lval *builtin_future(lenv *e, lval *a) {
+  LASSERT_NUM("future", 1, "QExpr", a);
+  LASSERT_TYPE("future", LVAL_QEXPR, 0, a);
+  lfuture *f = calloc(1, sizeof(lfuture));
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->done, NULL);
+  f->refs = 1;
+  f->state = LFUTURE_PENDING;
+
+  /* Clones are made on the heap of the future's interpreter */
+  f->li = lpool_interp();
+  f->owner = linterp_enter(f->li);
+  f->li->env = lenv_share(e);
+  lrectypes_copy(f->li, f->owner);
+  f->expr = lval_clone(a->cell[0]);
+  linterp_enter(f->owner);
+  f->li->sched = lsched_get();
+  lval_del(a);
+
+  /* Without a pool the future runs when first touched */
+  lpool *p = lpool_ensure();
+  if (p) {
+    f->refs++;
+    pthread_mutex_lock(&p->lock);
+    if (p->queue) {
+      p->queue_tail->next = f;
+    } else {
+      p->queue = f;
+    }
+    p->queue_tail = f;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return lfuturev(f);
+}
+
+/* (touch f) waits for and returns the value of future f */
+lval *builtin_touch(lenv *e, lval *a) {
+  LASSERT_NUM("touch", 1, "Future", a);
+  LASSERT_TYPE("touch", LVAL_FUTURE, 0, a);
+  lval *x = lval_take(a, 0);
+  lval *r = lfuture_touch(x->fut);
+  lval_del(x);
+  return r;
+}
+
+/* (await f ...) waits for every future and returns their values in a
+ * Qexpr, or the first error among them */
+lval *builtin_await(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("await", LVAL_FUTURE, i, a);
+  }
+  lval *x = lqexpr();
+  for (int i = 0; i < a->count; i++) {
+    lval *r = lfuture_touch(a->cell[i]->fut);
+    if (x->type == LVAL_ERR) {
+      lval_del(r);
+    } else if (r->type == LVAL_ERR) {
+      lval_del(x);
+      x = r;
+    } else {
+      lval_add(x, r);
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+/* (cancel f) stops future f and returns 1, or 0 if it had finished. A
+ * pending future never starts, and a running one fails at its next
+ * evaluation */
+lval *builtin_cancel(lenv *e, lval *a) {
+  LASSERT_NUM("cancel", 1, "Future", a);
+  LASSERT_TYPE("cancel", LVAL_FUTURE, 0, a);
+  lfuture *f = a->cell[0]->fut;
+  int stopped = lfuture_claim(f);
+  if (stopped) {
+    lfuture_discard(f);
+    pthread_mutex_lock(&f->lock);
+    f->state = LFUTURE_DONE;
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+  } else {
+    pthread_mutex_lock(&f->lock);
+    stopped = f->state == LFUTURE_RUNNING;
+    if (stopped) {
+      LATOMIC_STORE(&f->cancel, 1);
+    }
+    pthread_mutex_unlock(&f->lock);
+  }
+  lval_del(a);
+  return lnum(stopped);
+}
+
+/* Coroutines and channels
+ *
+ * (spawn {expr}) evaluates expr in a coroutine: a green thread with a
+ * stack of its own, run by the pool's threads. Coroutines talk over
+ * channels, bounded rings that (send c v) and (recv c) use without a
+ * lock; a coroutine that finds its channel full or empty parks and lets
+ * its thread run another until a peer wakes it.
+ *
+ * Like a future, each coroutine evaluates in an interpreter cloned from
+ * the spawner's, and values cross channels as clones. Threads take
+ * coroutines that have not started from each other's queues, but one
+ * that has run stays on its thread, since compiled code may keep the
+ * address of the thread's interpreter across a switch.
+ */
+
+#define LCORO_STACK_SIZE (1 << 20)
+#define LCHAN_MAX_CAPACITY (1L << 24)
+
+typedef struct lcoro {
+  ucontext_t ctx;
+  /* Where the thread running the coroutine continues when it parks */
+  ucontext_t back;
+  char *stack;
+  linterp *li;
+  /* The expression, until it starts */
+  lval *expr;
+  lpool *pool;
+  int done;
+  /* Set when the pool shuts down, stopping the coroutine's evaluation */
+  int killed;
+  /* Set while waiting; whoever clears it first makes the coroutine ready */
+  int parked;
+  /* The worker it runs on, or -1 before it starts */
+  int home;
+  /* Next in its worker's queue */
+  struct lcoro *next;
+  /* Neighbours among the pool's unfinished coroutines */
+  struct lcoro *live_prev;
+  struct lcoro *live_next;
+} lcoro;
+
+/* A thread or coroutine waiting on a channel */
+typedef struct lchan_waiter {
+  lcoro *co;
+  lpool *pool;
+  struct lchan_waiter *next;
+} lchan_waiter;
+
+/* A slot is free for the send at position pos when its seq equals pos,
+ * and full for the receive at pos when its seq is pos + 1 */
+typedef struct lchan_cell {
+  size_t seq;
+  lval *v;
+} lchan_cell;
+
+typedef struct lchan {
+  int refs;
+  size_t mask;
+  lchan_cell *cells;
+  /* Positions of the next receive and send */
+  size_t head;
+  size_t tail;
+  int closed;
+  /* Sends in progress, which close waits for */
+  int senders;
+  /* Guards the waiter list, counted in waiting so that senders and
+   * receivers only take the lock when someone waits */
+  pthread_mutex_t lock;
+  lchan_waiter *waiters;
+  int waiting;
+} lchan;
+
+lval *lchanv(lchan *c) {
+  lval *v = lalloc(sizeof(lval));
+  v->type = LVAL_CHAN;
+  v->chan = c;
+  return v;
+}
+
+void lchan_retain(lchan *c) { __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED); }
+
+void lchan_release(lchan *c) {
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  for (size_t i = c->head; i != c->tail; i++) {
+    lval_del(c->cells[i & c->mask].v);
+  }
+  pthread_mutex_destroy(&c->lock);
+  free(c->cells);
+  free(c);
+}
+
+/* Add v to c, or return 0 if c is full */
+int lchan_push(lchan *c, lval *v) {
+  size_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    lchan_cell *cell = &c->cells[pos & c->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long dif = (long)(seq - pos);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->v = v;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Take the oldest value from c, or return NULL if c is empty */
+lval *lchan_pop(lchan *c) {
+  size_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+  for (;;) {
+    lchan_cell *cell = &c->cells[pos & c->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long dif = (long)(seq - (pos + 1));
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        lval *v = cell->v;
+        __atomic_store_n(&cell->seq, pos + c->mask + 1, __ATOMIC_RELEASE);
+        return v;
+      }
+    } else if (dif < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Whether a send (or receive) on c would go ahead without waiting */
+int lchan_ready(lchan *c, int send) {
+  if (__atomic_load_n(&c->closed, __ATOMIC_SEQ_CST)) {
+    return 1;
+  }
+  size_t *end = send ? &c->tail : &c->head;
+  size_t pos = __atomic_load_n(end, __ATOMIC_SEQ_CST);
+  for (;;) {
+    size_t seq = __atomic_load_n(&c->cells[pos & c->mask].seq,
+                                 __ATOMIC_SEQ_CST);
+    long dif = (long)(seq - (send ? pos : pos + 1));
+    if (dif == 0) {
+      return 1;
+    }
+    if (dif < 0) {
+      return 0;
+    }
+    pos = __atomic_load_n(end, __ATOMIC_SEQ_CST);
+  }
+}
+
+int lchan_ready_any(lchan **cs, int n, int send) {
+  for (int i = 0; i < n; i++) {
+    if (lchan_ready(cs[i], send)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Append co to w's queue; the caller holds the pool's lock */
+void lsched_push(lpool *p, lworker *w, lcoro *co) {
+  co->next = NULL;
+  if (w->runq) {
+    w->runq_tail->next = co;
+  } else {
+    w->runq = co;
+  }
+  w->runq_tail = co;
+  pthread_cond_broadcast(&p->wake);
+  pthread_cond_broadcast(&p->progress);
+}
+
+/* Take the next coroutine for w to run, from its own queue or else one
+ * not yet started from another worker's, holding the pool's lock */
+lcoro *lsched_pick(lpool *p, lworker *w) {
+  lworker *from = w;
+  lcoro *prev = NULL;
+  lcoro *co = w->runq;
+  for (int i = 1; !co && i <= p->nthreads; i++) {
+    from = &p->workers[(w->id + i) % (p->nthreads + 1)];
+    prev = NULL;
+    for (co = from->runq; co && co->home >= 0; co = co->next) {
+      prev = co;
+    }
+  }
+  if (!co) {
+    return NULL;
+  }
+  if (prev) {
+    prev->next = co->next;
+  } else {
+    from->runq = co->next;
+  }
+  if (from->runq_tail == co) {
+    from->runq_tail = prev;
+  }
+  co->next = NULL;
+  co->home = w->id;
+  p->running++;
+  return co;
+}
+
+void lsched_unlink(lpool *p, lcoro *co) {
+  if (co->live_prev) {
+    co->live_prev->live_next = co->live_next;
+  } else {
+    p->coros = co->live_next;
+  }
+  if (co->live_next) {
+    co->live_next->live_prev = co->live_prev;
+  }
+}
+
+void lcoro_free(lcoro *co) {
+  if (co->expr) {
+    linterp *prev = linterp_enter(co->li);
+    lval_del(co->expr);
+    linterp_enter(prev);
+  }
+  linterp_del(co->li);
+  free(co->stack);
+  free(co);
+}
+
+/* Where every coroutine starts; the pointer comes split in two halves
+ * because makecontext only passes ints */
+void lcoro_main(unsigned int hi, unsigned int lo) {
+  lcoro *co = (lcoro *)(((uintptr_t)hi << 16 << 16) | lo);
+  linterp *li = co->li;
+  lval *x = lval_unpack(co->expr);
+  co->expr = NULL;
+  x->type = LVAL_SEXPR;
+  lval *r = lval_eval(li->env, lval_expand(li->env, x));
+  if (r->type == LVAL_ERR && !LATOMIC_LOAD(&co->killed)) {
+    lval_println(r);
+  }
+  lval_del(r);
+  co->done = 1;
+}
+
+/* Run co on this thread until it parks or finishes */
+void lcoro_resume(lpool *p, lcoro *co) {
+  linterp *prev = linterp_enter(co->li);
+  swapcontext(&co->back, &co->ctx);
+  linterp_enter(prev);
+  pthread_mutex_lock(&p->lock);
+  p->running--;
+  if (co->done) {
+    lsched_unlink(p, co);
+  }
+  pthread_cond_broadcast(&p->progress);
+  pthread_mutex_unlock(&p->lock);
+  if (co->done) {
+    lcoro_free(co);
+  }
+}
+
+/* Make a parked coroutine ready, unless another waker got there first */
+void lcoro_wake(lcoro *co) {
+  int parked = 1;
+  if (__atomic_compare_exchange_n(&co->parked, &parked, 0, 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    lpool *p = co->pool;
+    pthread_mutex_lock(&p->lock);
+    lsched_push(p, &p->workers[co->home], co);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* Wake everything waiting on c. Channel locks come before pool locks */
+void lchan_wake(lchan *c) {
+  pthread_mutex_lock(&c->lock);
+  for (lchan_waiter *w = c->waiters; w; w = w->next) {
+    if (w->co) {
+      lcoro_wake(w->co);
+    } else if (w->pool) {
+      pthread_mutex_lock(&w->pool->lock);
+      pthread_cond_broadcast(&w->pool->progress);
+      pthread_mutex_unlock(&w->pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* Called after a send or receive on c, which may let a waiter go on */
+void lchan_signal(lchan *c) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&c->waiting, __ATOMIC_RELAXED)) {
+    lchan_wake(c);
+  }
+}
+
+/* The scheduler for coroutines spawned here: the pool of the interpreter
+ * this one was cloned from, or else its own, which is started with no
+ * threads of its own when it runs on one. NULL for pool threads' bare
+ * interpreters */
+lpool *lsched_get(void) {
+  linterp *li = linterp_current;
+  if (li->sched) {
+    return li->sched;
+  }
+  if (li->threads < 1) {
+    return NULL;
+  }
+  if (!li->pool) {
+    li->pool = lpool_new(li, li->threads - 1);
+  }
+  return li->pool;
+}
+
+/* The worker whose coroutines this thread may run while it waits: its own
+ * on a pool thread, or with no pool threads the owner's */
+lworker *lsched_worker(lpool *p) {
+  if (lworker_current && lworker_current->pool == p) {
+    return lworker_current;
+  }
+  return p->nthreads == 0 ? &p->workers[0] : NULL;
+}
+
+/* Whether the owner's thread waits for coroutines that cannot run: none
+ * is ready or running and nothing else on the pool could wake them. Pool
+ * threads never know, as the owner may still be on its way */
+int lsched_stuck(lpool *p) {
+  if (lworker_current && lworker_current->pool == p) {
+    return 0;
+  }
+  if (p->running || p->queue || p->job || p->futures) {
+    return 0;
+  }
+  for (int i = 0; i <= p->nthreads; i++) {
+    if (p->workers[i].runq) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Wait until a send (or receive) on one of n channels may go ahead. A
+ * coroutine parks; a thread runs what coroutines it may meanwhile */
+lval *lchan_wait(lchan **cs, int n, int send) {
+  lcoro *co = linterp_current->coro;
+  lpool *p = co ? co->pool : lsched_get();
+  lchan_waiter *ws = malloc(sizeof(lchan_waiter) * n);
+  for (int i = 0; i < n; i++) {
+    ws[i].co = co;
+    ws[i].pool = p;
+    pthread_mutex_lock(&cs[i]->lock);
+    ws[i].next = cs[i]->waiters;
+    cs[i]->waiters = &ws[i];
+    __atomic_add_fetch(&cs[i]->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&cs[i]->lock);
+  }
+
+  lval *err = NULL;
+  if (co) {
+    /* A waker may queue the coroutine before it has switched out, which
+     * is safe as only this thread runs it */
+    for (;;) {
+      __atomic_store_n(&co->parked, 1, __ATOMIC_SEQ_CST);
+      int go = lchan_ready_any(cs, n, send) || LATOMIC_LOAD(&co->killed);
+      int parked = 1;
+      if (!go || !__atomic_compare_exchange_n(&co->parked, &parked, 0, 0,
+                                              __ATOMIC_SEQ_CST,
+                                              __ATOMIC_SEQ_CST)) {
+        swapcontext(&co->ctx, &co->back);
+      }
+      if (go) {
+        break;
+      }
+    }
+    if (LATOMIC_LOAD(&co->killed)) {
+      err = lerr("Coroutine stopped");
+    }
+  } else if (p) {
+    lworker *w = lsched_worker(p);
+    pthread_mutex_lock(&p->lock);
+    while (!lchan_ready_any(cs, n, send)) {
+      if (p->closing) {
+        err = lerr("Coroutine scheduler stopped");
+        break;
+      }
+      lcoro *next = w ? lsched_pick(p, w) : NULL;
+      if (next) {
+        pthread_mutex_unlock(&p->lock);
+        lcoro_resume(p, next);
+        pthread_mutex_lock(&p->lock);
+      } else if (lsched_stuck(p)) {
+        err = lerr("Deadlock: every coroutine is blocked");
+        break;
+      } else {
+        pthread_cond_wait(&p->progress, &p->lock);
+      }
+    }
+    pthread_mutex_unlock(&p->lock);
+  } else {
+    while (!lchan_ready_any(cs, n, send)) {
+      sched_yield();
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_lock(&cs[i]->lock);
+    lchan_waiter **link = &cs[i]->waiters;
+    while (*link != &ws[i]) {
+      link = &(*link)->next;
+    }
+    *link = ws[i].next;
+    __atomic_sub_fetch(&cs[i]->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&cs[i]->lock);
+  }
+  free(ws);
+  return err;
+}
+
+/* Stop every coroutine before the pool goes: those not started are
+ * dropped, and the rest are woken to fail at their next evaluation */
+void lsched_shutdown(lpool *p) {
+  lcoro *fresh = NULL;
+  pthread_mutex_lock(&p->lock);
+  p->closing = 1;
+  for (int i = 0; i <= p->nthreads; i++) {
+    lworker *w = &p->workers[i];
+    lcoro **link = &w->runq;
+    w->runq_tail = NULL;
+    while (*link) {
+      lcoro *co = *link;
+      if (co->home < 0) {
+        *link = co->next;
+        lsched_unlink(p, co);
+        co->next = fresh;
+        fresh = co;
+      } else {
+        w->runq_tail = co;
+        link = &co->next;
+      }
+    }
+  }
+  for (lcoro *co = p->coros; co; co = co->live_next) {
+    LATOMIC_STORE(&co->killed, 1);
+    int parked = 1;
+    if (__atomic_compare_exchange_n(&co->parked, &parked, 0, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      lsched_push(p, &p->workers[co->home], co);
+    }
+  }
+  pthread_cond_broadcast(&p->progress);
+
+  lworker *w = p->nthreads == 0 ? &p->workers[0] : NULL;
+  while (p->coros) {
+    lcoro *co = w ? lsched_pick(p, w) : NULL;
+    if (co) {
+      pthread_mutex_unlock(&p->lock);
+      lcoro_resume(p, co);
+      pthread_mutex_lock(&p->lock);
+    } else {
+      pthread_cond_wait(&p->progress, &p->lock);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  while (fresh) {
+    lcoro *next = fresh->next;
+    lcoro_free(fresh);
+    fresh = next;
+  }
+}
+
+/* (spawn {expr}) evaluates expr in a new coroutine and returns () */
+lval *builtin_spawn(lenv *e, lval *a) {
+  LASSERT_NUM("spawn", 1, "QExpr", a);
+  LASSERT_TYPE("spawn", LVAL_QEXPR, 0, a);
+  lpool *p = lsched_get();
+  LASSERT(a, p, "Function 'spawn' cannot be called here");
+
+  lcoro *co = calloc(1, sizeof(lcoro));
+  co->pool = p;
+  co->home = -1;
+  co->stack = malloc(LCORO_STACK_SIZE);
+  getcontext(&co->ctx);
+  co->ctx.uc_stack.ss_sp = co->stack;
+  co->ctx.uc_stack.ss_size = LCORO_STACK_SIZE;
+  co->ctx.uc_link = &co->back;
+  uintptr_t ptr = (uintptr_t)co;
+  makecontext(&co->ctx, (void (*)(void))lcoro_main, 2,
+              (unsigned int)(ptr >> 16 >> 16), (unsigned int)ptr);
+
+  co->li = lpool_interp();
+  linterp *owner = linterp_enter(co->li);
+  co->li->env = lenv_share(e);
+  co->li->sched = p;
+  co->li->coro = co;
+  co->li->cancel = &co->killed;
+  lrectypes_copy(co->li, owner);
+  co->expr = lval_clone(a->cell[0]);
+  linterp_enter(owner);
+  lval_del(a);
+
+  pthread_mutex_lock(&p->lock);
+  if (p->closing) {
+    pthread_mutex_unlock(&p->lock);
+    lcoro_free(co);
+    return lerr("Coroutine scheduler stopped");
+  }
+  co->live_next = p->coros;
+  if (p->coros) {
+    p->coros->live_prev = co;
+  }
+  p->coros = co;
+  lworker *w = p->nthreads == 0
+                   ? &p->workers[0]
+                   : &p->workers[p->spawned++ % p->nthreads];
+  lsched_push(p, w, co);
+  pthread_mutex_unlock(&p->lock);
+  return lsexpr();
+}
+
+/* (chan n) makes a channel holding up to n values, rounded up to a power
+ * of two. The ring needs two slots to tell full from empty, so it holds
+ * at least two */
+lval *builtin_chan(lenv *e, lval *a) {
+  LASSERT_NUM("chan", 1, "Number", a);
+  LASSERT_TYPE("chan", LVAL_NUM, 0, a);
+  long n = a->cell[0]->num;
+  LASSERT(a, n >= 0 && n <= LCHAN_MAX_CAPACITY,
+          "Function 'chan' passed capacity %li, outside 0 to %li", n,
+          LCHAN_MAX_CAPACITY);
+  lval_del(a);
+  size_t cap = 2;
+  while (cap < (size_t)n) {
+    cap <<= 1;
+  }
+  lchan *c = calloc(1, sizeof(lchan));
+  c->refs = 1;
+  c->mask = cap - 1;
+  c->cells = malloc(sizeof(lchan_cell) * cap);
+  for (size_t i = 0; i < cap; i++) {
+    c->cells[i].seq = i;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  return lchanv(c);
+}
+
+/* (send c v) puts v on channel c, waiting while c is full */
+lval *builtin_send(lenv *e, lval *a) {
+  LASSERT_NUM("send", 2, "arguments", a);
+  LASSERT_TYPE("send", LVAL_CHAN, 0, a);
+  lchan *c = a->cell[0]->chan;
+
+  /* The receiver frees the value, so it must not live in an arena */
+  linterp_current->arena.heap_depth++;
+  lval *v = lval_clone(a->cell[1]);
+  linterp_current->arena.heap_depth--;
+
+  lval *err = NULL;
+  for (;;) {
+    __atomic_add_fetch(&c->senders, 1, __ATOMIC_SEQ_CST);
+    int closed = __atomic_load_n(&c->closed, __ATOMIC_SEQ_CST);
+    int sent = !closed && lchan_push(c, v);
+    __atomic_sub_fetch(&c->senders, 1, __ATOMIC_SEQ_CST);
+    if (closed) {
+      err = lerr("Channel closed");
+    }
+    if (sent || closed || (err = lchan_wait(&c, 1, 1))) {
+      break;
+    }
+  }
+  if (err) {
+    lval_del(v);
+  } else {
+    lchan_signal(c);
+  }
+  lval_del(a);
+  return err ? err : lsexpr();
+}
+
+/* Take a value from the first of the channels in a that has one, waiting
+ * while none has, and set which to its index */
+lval *lchan_recv(lval *a, int *which) {
+  int n = a->count;
+  lchan **open = malloc(sizeof(lchan *) * n);
+  lval *r = NULL;
+  while (!r) {
+    int nopen = 0;
+    for (int i = 0; i < n && !r; i++) {
+      lchan *c = a->cell[i]->chan;
+      /* A closed channel is done once no send is still going in */
+      int closed = __atomic_load_n(&c->closed, __ATOMIC_SEQ_CST) &&
+                   !__atomic_load_n(&c->senders, __ATOMIC_SEQ_CST);
+      if ((r = lchan_pop(c))) {
+        lchan_signal(c);
+        *which = i;
+      } else if (!closed) {
+        open[nopen++] = c;
+      }
+    }
+    if (!r && nopen == 0) {
+      r = lerr("Channel closed");
+    } else if (!r) {
+      r = lchan_wait(open, nopen, 0);
+    }
+  }
+  free(open);
+  return r;
+}
+
+/* (recv c) takes the oldest value from channel c, waiting while c is
+ * empty; once c is closed and empty it is an error */
+lval *builtin_recv(lenv *e, lval *a) {
+  LASSERT_NUM("recv", 1, "Channel", a);
+  LASSERT_TYPE("recv", LVAL_CHAN, 0, a);
+  int which;
+  lval *r = lchan_recv(a, &which);
+  lval_del(a);
+  return r;
+}
+
+/* (select c ...) receives from whichever channel first has a value,
+ * trying them in order, and returns {index value} */
+lval *builtin_select(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'select' passed no channels");
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("select", LVAL_CHAN, i, a);
+  }
+  int which;
+  lval *r = lchan_recv(a, &which);
+  lval_del(a);
+  if (r->type == LVAL_ERR) {
+    return r;
+  }
+  return lval_add(lval_add(lqexpr(), lnum(which)), r);
+}
+
+/* (close c) closes channel c: later sends fail, and receives fail once
+ * the values already sent have been taken */
+lval *builtin_close(lenv *e, lval *a) {
+  LASSERT_NUM("close", 1, "Channel", a);
+  LASSERT_TYPE("close", LVAL_CHAN, 0, a);
+  lchan *c = a->cell[0]->chan;
+  LASSERT(a, !__atomic_exchange_n(&c->closed, 1, __ATOMIC_SEQ_CST),
+          "Channel already closed");
+  while (__atomic_load_n(&c->senders, __ATOMIC_SEQ_CST)) {
+    sched_yield();
+  }
+  lchan_wake(c);
+  lval_del(a);
+  return lsexpr();
+}
+
+/* Pattern matching
+ *
+ * (match x {pattern body} ...) evaluates the body of the first clause
+ * whose pattern matches x. Patterns are Numbers and Strings matched by
+ * value, _ matching anything, other symbols binding what they match, and
+ * Q-expressions of patterns matching lists of the same length, with
+ * {p ... & rest} binding any remaining elements to rest.
+ *
+ * The clauses are compiled once into a decision tree. Every node tests
+ * one sub-term of x, reached through the nodes above it, and no sub-term
+ * is tested twice on the way to a leaf. Sub-terms are only copied where
+ * a body uses the variable bound to them.
+ */
+
+#define LMATCH_TABLE_SIZE 256
+
+enum { LMATCH_FAIL, LMATCH_LEAF, LMATCH_SWITCH };
+enum { LMATCH_LIT, LMATCH_LEN, LMATCH_MIN };
+
+/* A variable bound to sub-term occ, or to the elements of occ from rest
+ * on if rest is not negative */
+typedef struct lmatch_bind {
+  char *name;
+  int occ;
+  int rest;
+} lmatch_bind;
+
+struct lmatch_node;
+
+typedef struct lmatch_case {
+  int kind;
+  /* LMATCH_LIT: the value to compare against */
+  lval *lit;
+  /* LMATCH_LEN and LMATCH_MIN: the length, and the sub-terms that its
+   * first len elements become */
+  int len;
+  int *kids;
+  struct lmatch_node *next;
+} lmatch_case;
+
+typedef struct lmatch_node {
+  int kind;
+  /* LMATCH_LEAF */
+  int clause;
+  int nbinds;
+  lmatch_bind *binds;
+  /* LMATCH_SWITCH: cases are tried in order, then the default */
+  int occ;
+  int ncases;
+  lmatch_case *cases;
+  struct lmatch_node *dflt;
+} lmatch_node;
+
+/* A pending test of one sub-term against a pattern */
+typedef struct lmatch_test {
+  int occ;
+  lval *pat;
+} lmatch_test;
+
+/* A clause while it is being compiled */
+typedef struct lmatch_row {
+  int clause;
+  int ntests;
+  lmatch_test *tests;
+  int nbinds;
+  lmatch_bind *binds;
+} lmatch_row;
+
+typedef struct lmatch {
+  lmatch_node *root;
+  /* Number of distinct sub-terms the tree can visit */
+  int nocc;
+  /* The sub-term id of element idx of sub-term parent, while compiling */
+  int nkids;
+  int (*kids)[3];
+} lmatch;
+
+typedef struct lmatch_entry {
+  /* The clauses the tree was compiled from */
+  lform_key key;
+  lmatch *m;
+} lmatch_entry;
+
+/* Decision trees compiled by this interpreter */
+typedef struct lmatch_cache {
+  lmatch_entry table[LMATCH_TABLE_SIZE];
+} lmatch_cache;
+
+int lmatch_kid(lmatch *m, int parent, int idx) {
+  for (int i = 0; i < m->nkids; i++) {
+    if (m->kids[i][0] == parent && m->kids[i][1] == idx) {
+      return m->kids[i][2];
+    }
+  }
+  m->kids = realloc(m->kids, sizeof(int[3]) * (m->nkids + 1));
+  m->kids[m->nkids][0] = parent;
+  m->kids[m->nkids][1] = idx;
+  m->kids[m->nkids][2] = m->nocc;
+  m->nkids++;
+  return m->nocc++;
+}
+
+/* Number of fixed elements in a list pattern, or -1 without a rest */
+int lmatch_rest(lval *pat) {
+  for (int i = 0; !pat->nums && i < pat->count; i++) {
+    if (pat->cell[i]->type == LVAL_SYM && strcmp(pat->cell[i]->sym, "&") == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Element i of a list, boxing packed numbers into box */
+lval *lmatch_elem(lval *v, int i, lval *box) {
+  if (!v->nums) {
+    return v->cell[i];
+  }
+  memset(box, 0, sizeof(lval));
+  box->type = LVAL_NUM;
+  box->num = v->nums[i];
+  return box;
+}
+
+/* Box the packed numbers of a pattern, which are tested one at a time */
+void lmatch_unpack(lval *pat) {
+  if (pat->type != LVAL_QEXPR) {
+    return;
+  }
+  lval_unpack(pat);
+  for (int i = 0; i < pat->count; i++) {
+    lmatch_unpack(pat->cell[i]);
+  }
+}
+
+void lmatch_row_bind(lmatch_row *r, char *name, int occ, int rest) {
+  r->binds = realloc(r->binds, sizeof(lmatch_bind) * (r->nbinds + 1));
+  r->binds[r->nbinds].name = name;
+  r->binds[r->nbinds].occ = occ;
+  r->binds[r->nbinds].rest = rest;
+  r->nbinds++;
+}
+
+/* Add a test at position at, binding it straight away if it always
+ * matches */
+void lmatch_row_test(lmatch_row *r, int at, int occ, lval *pat) {
+  if (pat->type == LVAL_SYM) {
+    if (strcmp(pat->sym, "_") != 0) {
+      lmatch_row_bind(r, pat->sym, occ, -1);
+    }
+    return;
+  }
+  r->tests = realloc(r->tests, sizeof(lmatch_test) * (r->ntests + 1));
+  memmove(&r->tests[at + 1], &r->tests[at],
+          sizeof(lmatch_test) * (r->ntests - at));
+  r->tests[at].occ = occ;
+  r->tests[at].pat = pat;
+  r->ntests++;
+}
+
+lmatch_row lmatch_row_copy(lmatch_row *r) {
+  lmatch_row x = *r;
+  x.tests = malloc(sizeof(lmatch_test) * (r->ntests + 1));
+  x.binds = malloc(sizeof(lmatch_bind) * (r->nbinds + 1));
+  if (r->ntests) {
+    memcpy(x.tests, r->tests, sizeof(lmatch_test) * r->ntests);
+  }
+  if (r->nbinds) {
+    memcpy(x.binds, r->binds, sizeof(lmatch_bind) * r->nbinds);
+  }
+  return x;
+}
+
+void lmatch_row_free(lmatch_row *r) {
+  free(r->tests);
+  free(r->binds);
+}
+
+/* Index of the test of occ in r, or -1 */
+int lmatch_row_find(lmatch_row *r, int occ) {
+  for (int i = 0; i < r->ntests; i++) {
+    if (r->tests[i].occ == occ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* r specialised to the sub-term at occ satisfying c, or 0 if it cannot
+ * match then */
+int lmatch_specialise(lmatch *m, lmatch_row *r, int occ, lmatch_case *c,
+                      lmatch_row *out) {
+  int i = lmatch_row_find(r, occ);
+  if (i < 0) {
+    *out = lmatch_row_copy(r);
+    return 1;
+  }
+  lval *pat = r->tests[i].pat;
+  int rest = pat->type == LVAL_QEXPR ? lmatch_rest(pat) : -1;
+  int fixed = rest >= 0 ? rest : pat->count;
+  switch (c->kind) {
+  case LMATCH_LIT:
+    if (pat->type == LVAL_QEXPR || !lval_eq(pat, c->lit)) {
+      return 0;
+    }
     break;
-  case LVAL_SEXPR:
-    lval_expr_print(val, "( ", " )");
+  case LMATCH_LEN:
+    if (pat->type != LVAL_QEXPR ||
+        (rest < 0 ? fixed != c->len : fixed > c->len)) {
+      return 0;
+    }
     break;
-  default:
-    printf("Error: Unknown value!");
+  case LMATCH_MIN:
+    if (pat->type != LVAL_QEXPR || rest < 0 || fixed > c->len) {
+      return 0;
+    }
     break;
   }
+
+  *out = lmatch_row_copy(r);
+  memmove(&out->tests[i], &out->tests[i + 1],
+          sizeof(lmatch_test) * (out->ntests - i - 1));
+  out->ntests--;
+  if (c->kind == LMATCH_LIT) {
+    return 1;
+  }
+  if (rest >= 0 && strcmp(pat->cell[rest + 1]->sym, "_") != 0) {
+    lmatch_row_bind(out, pat->cell[rest + 1]->sym, occ, rest);
+  }
+  /* Children are tested before anything else so the order stays left to
+   * right */
+  for (int k = fixed - 1; k >= 0; k--) {
+    lmatch_row_test(out, i, c->kids[k], pat->cell[k]);
+  }
+  return 1;
 }
 
-// print a lispy value followed by a newline
-void lval_println(lval *val) {
-  lval_print(val);
-  putchar('\n');
+lmatch_node *lmatch_compile(lmatch *m, lmatch_row *rows, int nrows);
+
+int lmatch_case_before(lmatch_case *a, lmatch_case *b) {
+  if (b->kind != LMATCH_MIN) {
+    return 0;
+  }
+  return a->kind != LMATCH_MIN || a->len > b->len;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v);
+void lmatch_add_case(lmatch_node *n, lmatch_case c) {
+  n->cases = realloc(n->cases, sizeof(lmatch_case) * (n->ncases + 1));
+  n->cases[n->ncases++] = c;
+}
 
-lval *lval_eval(lenv *, lval *v);
-void lenv_add_builtins(lenv *);
+lmatch_node *lmatch_compile(lmatch *m, lmatch_row *rows, int nrows) {
+  lmatch_node *n = calloc(1, sizeof(lmatch_node));
+  if (nrows == 0) {
+    n->kind = LMATCH_FAIL;
+    return n;
+  }
+  if (rows[0].ntests == 0) {
+    n->kind = LMATCH_LEAF;
+    n->clause = rows[0].clause;
+    n->nbinds = rows[0].nbinds;
+    n->binds = malloc(sizeof(lmatch_bind) * (n->nbinds + 1));
+    if (n->nbinds) {
+      memcpy(n->binds, rows[0].binds, sizeof(lmatch_bind) * n->nbinds);
+    }
+    return n;
+  }
 
-int main(int argc, char **argv) {
-  // define Polish grammar
+  /* Switch on the first sub-term the first clause still has to test */
+  n->kind = LMATCH_SWITCH;
+  n->occ = rows[0].tests[0].occ;
+  for (int r = 0; r < nrows; r++) {
+    int i = lmatch_row_find(&rows[r], n->occ);
+    if (i < 0) {
+      continue;
+    }
+    lval *pat = rows[r].tests[i].pat;
+    lmatch_case c = {LMATCH_LIT, pat, 0, NULL, NULL};
+    if (pat->type == LVAL_QEXPR) {
+      int rest = lmatch_rest(pat);
+      c.kind = rest < 0 ? LMATCH_LEN : LMATCH_MIN;
+      c.len = rest < 0 ? pat->count : rest;
+      c.lit = NULL;
+    }
+    int seen = 0;
+    for (int k = 0; k < n->ncases && !seen; k++) {
+      lmatch_case *d = &n->cases[k];
+      seen = d->kind == c.kind &&
+             (c.kind == LMATCH_LIT ? lval_eq(d->lit, c.lit) : d->len == c.len);
+    }
+    if (!seen) {
+      lmatch_add_case(n, c);
+    }
+  }
 
-  /*The symbols for evaluating QExpr are defined below
-   * list: Takes one or more arguments and returns a new Q-Expression containing
-   * the arguments head: Takes a Q-Expression and returns and Q-Expression with
-   * only the first element tail: Takes a Q-Expression and returns a
-   * Q-Expression with the first element removed join: Takes one or more
-   * Q-Expressions and returns a Q-Expression of them conjoined together eval:
-   * Takes a Q-Expression and evaluates it as if it were a S-Expression def: Put
-   * a new variable into the environment
-   *
-   * */
-  mpc_parser_t *Number = mpc_new("number");
-  mpc_parser_t *Symbol = mpc_new("symbol");
-  mpc_parser_t *Sexpr = mpc_new("sexpr");
-  mpc_parser_t *Qexpr = mpc_new("qexpr");
-  mpc_parser_t *Expr = mpc_new("expr");
-  mpc_parser_t *Lispy = mpc_new("lispy");
-  mpca_lang(MPCA_LANG_DEFAULT, "						\
-			number: /-?[0-9]+/; 				\
-			symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;	 \
-			sexpr: '(' <expr>* ')' ;			\
-			qexpr: '{' <expr>* '}' ;									\
-			expr: <number> | <symbol> | <sexpr> | <qexpr> ;	\
-			lispy: /^/ <expr>* /$/; 		\
-			",
-            Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-  puts("Lispy Version 0.0.0.0.1");
-  puts("Press Ctrl+c to exit\n");
+  /* Minimum lengths go after everything else, longest first */
+  for (int i = 1; i < n->ncases; i++) {
+    lmatch_case c = n->cases[i];
+    int j = i;
+    while (j > 0 && lmatch_case_before(&c, &n->cases[j - 1])) {
+      n->cases[j] = n->cases[j - 1];
+      j--;
+    }
+    n->cases[j] = c;
+  }
+
+  lmatch_row *sub = malloc(sizeof(lmatch_row) * nrows);
+  for (int k = 0; k < n->ncases; k++) {
+    lmatch_case *c = &n->cases[k];
+    if (c->kind != LMATCH_LIT) {
+      c->kids = malloc(sizeof(int) * (c->len + 1));
+      for (int i = 0; i < c->len; i++) {
+        c->kids[i] = lmatch_kid(m, n->occ, i);
+      }
+    }
+    int nsub = 0;
+    for (int r = 0; r < nrows; r++) {
+      nsub += lmatch_specialise(m, &rows[r], n->occ, c, &sub[nsub]);
+    }
+    c->next = lmatch_compile(m, sub, nsub);
+    for (int r = 0; r < nsub; r++) {
+      lmatch_row_free(&sub[r]);
+    }
+  }
 
-  lenv *e = lenv_new();
-  lenv_add_builtins(e);
+  int nsub = 0;
+  for (int r = 0; r < nrows; r++) {
+    if (lmatch_row_find(&rows[r], n->occ) < 0) {
+      sub[nsub++] = lmatch_row_copy(&rows[r]);
+    }
+  }
+  n->dflt = lmatch_compile(m, sub, nsub);
+  for (int r = 0; r < nsub; r++) {
+    lmatch_row_free(&sub[r]);
+  }
+  free(sub);
+  return n;
+}
 
-  while (1) {
-    char *input = readline("> ");
-    add_history(input);
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
+void lmatch_node_free(lmatch_node *n) {
+  free(n->binds);
+  for (int k = 0; k < n->ncases; k++) {
+    free(n->cases[k].kids);
+    lmatch_node_free(n->cases[k].next);
+  }
+  free(n->cases);
+  if (n->dflt) {
+    lmatch_node_free(n->dflt);
+  }
+  free(n);
+}
+
+/* Check that a pattern can be compiled */
+int lmatch_valid(lval *pat) {
+  if (pat->type == LVAL_SEXPR) {
+    return 0;
+  }
+  if (pat->type != LVAL_QEXPR || pat->nums) {
+    return 1;
+  }
+  int rest = lmatch_rest(pat);
+  if (rest >= 0 && (rest + 2 != pat->count ||
+                    pat->cell[rest + 1]->type != LVAL_SYM ||
+                    strcmp(pat->cell[rest + 1]->sym, "&") == 0)) {
+    return 0;
+  }
+  int fixed = rest >= 0 ? rest : pat->count;
+  for (int i = 0; i < fixed; i++) {
+    if (!lmatch_valid(pat->cell[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
 
-      lval *result = lval_eval(e, lval_read(r.output));
-      lval_println(result);
-      lval_del(result);
+/* Compile clauses, which are already checked to be {pattern body} pairs */
+lmatch *lmatch_new(lval *clauses) {
+  lmatch *m = calloc(1, sizeof(lmatch));
+  m->nocc = 1;
+  lmatch_row *rows = malloc(sizeof(lmatch_row) * (clauses->count + 1));
+  linterp_current->arena.heap_depth++;
+  for (int i = 0; i < clauses->count; i++) {
+    lmatch_unpack(clauses->cell[i]->cell[0]);
+  }
+  linterp_current->arena.heap_depth--;
+  for (int i = 0; i < clauses->count; i++) {
+    lmatch_row r = {i, 0, NULL, 0, NULL};
+    lmatch_row_test(&r, 0, 0, clauses->cell[i]->cell[0]);
+    rows[i] = r;
+  }
+  m->root = lmatch_compile(m, rows, clauses->count);
+  for (int i = 0; i < clauses->count; i++) {
+    lmatch_row_free(&rows[i]);
+  }
+  free(rows);
+  free(m->kids);
+  m->kids = NULL;
+  return m;
+}
 
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+void lmatch_free(lmatch *m) {
+  lmatch_node_free(m->root);
+  free(m);
+}
+
+void lmatch_flush(void) {
+  lmatch_entry *table = linterp_current->match->table;
+  for (int i = 0; i < LMATCH_TABLE_SIZE; i++) {
+    lmatch_entry *t = &table[i];
+    if (t->key.form) {
+      lval_del(t->key.form);
+      lmatch_free(t->m);
     }
-    free(input);
   }
-  lenv_del(e);
-  /*Undefine and Delete our Parsers*/
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-  return 0;
+  memset(table, 0, sizeof(lmatch_entry) * LMATCH_TABLE_SIZE);
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-  if (v->type == LVAL_SYM) {
-    lval *x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+/* Trees are in use while their bodies are evaluated, so a full table is
+ * only emptied when none are */
+void lmatch_evict(void) {
+  if (!linterp_current->scope) {
+    lmatch_flush();
   }
-  /* Evaluate Sexpression */
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(e, v);
+}
+
+lmatch_cache *lmatch_cache_new(void) {
+  return calloc(1, sizeof(lmatch_cache));
+}
+
+/* Free the decision trees of the current interpreter */
+void lmatch_cache_del(lmatch_cache *c) {
+  lmatch_flush();
+  free(c);
+}
+
+/* Find or compile the decision tree for a list of clauses, or NULL if
+ * the table is full and in use */
+lmatch *lmatch_lookup(lval *clauses) {
+  int fresh;
+  lmatch_entry *t =
+      lform_lookup(linterp_current->match->table, sizeof(lmatch_entry),
+                   LMATCH_TABLE_SIZE, clauses, lmatch_evict, &fresh);
+  if (!t) {
+    return NULL;
+  }
+  if (fresh) {
+    t->m = lmatch_new(t->key.form);
+  }
+  return t->m;
+}
+
+/* Walk the tree, filling in sub-terms as the tests reach them. Packed
+ * numbers are boxed into the matching slot of box */
+lmatch_node *lmatch_run(lmatch_node *n, lval **occ, lval *box) {
+  while (n->kind == LMATCH_SWITCH) {
+    lval *v = occ[n->occ];
+    lmatch_node *next = n->dflt;
+    for (int k = 0; k < n->ncases; k++) {
+      lmatch_case *c = &n->cases[k];
+      int hit = c->kind == LMATCH_LIT
+                    ? lval_eq(c->lit, v)
+                    : v->type == LVAL_QEXPR &&
+                          (c->kind == LMATCH_LEN ? v->count == c->len
+                                                 : v->count >= c->len);
+      if (!hit) {
+        continue;
+      }
+      for (int i = 0; c->kind != LMATCH_LIT && i < c->len; i++) {
+        occ[c->kids[i]] = lmatch_elem(v, i, &box[c->kids[i]]);
+      }
+      next = c->next;
+      break;
+    }
+    n = next;
+  }
+  return n;
+}
+
+/* The names bound by a clause while its body is evaluated in env. Each
+ * refers to its sub-term of the scrutinee in place; rest bindings see
+ * the tail of their list through a view in rests */
+typedef struct lmatch_scope {
+  lenv *env;
+  lmatch_node *leaf;
+  lval **occ;
+  lval *rests;
+  struct lmatch_scope *up;
+} lmatch_scope;
+
+/* The value a match body being evaluated in e binds sym to, or NULL */
+lval *lmatch_peek(lenv *e, char *sym) {
+  for (lmatch_scope *s = linterp_current->scope; s; s = s->up) {
+    if (s->env != e) {
+      continue;
+    }
+    for (int i = s->leaf->nbinds - 1; i >= 0; i--) {
+      lmatch_bind *b = &s->leaf->binds[i];
+      if (strcmp(b->name, sym) == 0) {
+        return b->rest < 0 ? s->occ[b->occ] : &s->rests[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Point the view for each rest binding at the tail of its list */
+void lmatch_rests(lmatch_scope *s) {
+  for (int i = 0; i < s->leaf->nbinds; i++) {
+    lmatch_bind *b = &s->leaf->binds[i];
+    if (b->rest < 0) {
+      continue;
+    }
+    lval *v = s->occ[b->occ];
+    lval *x = &s->rests[i];
+    memset(x, 0, sizeof(lval));
+    x->type = LVAL_QEXPR;
+    x->count = v->count - b->rest;
+    if (x->count > 0 && v->nums) {
+      x->nums = v->nums + b->rest;
+    } else if (x->count > 0) {
+      x->cell = v->cell + b->rest;
+    }
   }
-  return v;
 }
 
-/* Pop an item from the list */
-lval *lval_pop(lval *v, int i) {
-  /* Find the item at i */
-  lval *x = v->cell[i];
-
-  /* Shift memory after the item at "i" over the top */
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
-  /* Decrease the count of items in the list */
-  v->count--;
+lval *builtin_match(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 2,
+          "Function 'match' passed incorrect number of arguments: %d\n"
+          "Expected a value and at least one clause",
+          a->count);
+  for (int i = 1; i < a->count; i++) {
+    lval *c = a->cell[i];
+    if (c->type == LVAL_QEXPR) {
+      lval_unpack(c);
+    }
+    LASSERT(a, c->type == LVAL_QEXPR && c->count == 2,
+            "Function 'match' expects clauses of the form {pattern body}");
+    LASSERT(a, lmatch_valid(c->cell[0]),
+            "Function 'match' passed an invalid pattern in clause %d", i);
+  }
 
-  /* Reallocate the memory used */
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  return x;
-}
+  lval *x = lval_pop(a, 0);
+  lmatch *m = lmatch_lookup(a);
+  /* Without room in the table, the tree is only kept for this call */
+  lmatch *own = m ? NULL : lmatch_new(a);
+  m = m ? m : own;
+  lval **occ = malloc(sizeof(lval *) * m->nocc);
+  lval *box = malloc(sizeof(lval) * m->nocc);
+  occ[0] = x;
 
-/* Take an item from the list and delete the rest */
-lval *lval_take(lval *v, int i) {
-  lval *x = lval_pop(v, i);
-  lval_del(v);
-  return x;
+  lmatch_node *leaf = lmatch_run(m->root, occ, box);
+  lval *r;
+  if (leaf->kind == LMATCH_FAIL) {
+    r = lerr("No pattern matched");
+  } else {
+    /* The body looks its names up in the scrutinee, which stays alive
+     * and unchanged until it is done */
+    linterp *li = linterp_current;
+    lmatch_scope s = {e, leaf, occ, NULL, li->scope};
+    s.rests = malloc(sizeof(lval) * (leaf->nbinds + 1));
+    lmatch_rests(&s);
+    li->scope = &s;
+    lval *body = lval_pop(a->cell[leaf->clause], 1);
+    r = lval_eval(e, lval_expand(e, body));
+    li->scope = s.up;
+    free(s.rests);
+  }
+  free(occ);
+  free(box);
+  if (own) {
+    lmatch_free(own);
+  }
+  lval_del(x);
+  lval_del(a);
+  return r;
 }
 
 /* Evaluate the given lval and return the result */
 lval *builtin_op(lenv *e, lval *v, char *sym) {
+  /*Arrays are combined elementwise*/
+  for (int i = 0; i < v->count; ++i) {
+    if (v->cell[i]->type == LVAL_ARRAY) {
+      return larray_op(v, sym);
+    }
+  }
+
   /*Make sure we have numbers only*/
   for (int i = 0; i < v->count; ++i) {
     if (v->cell[i]->type != LVAL_NUM) {
+      lval *err = lerr("Invalid operand: %s\nExpected numbers only",
+                       ltype_name(v->cell[i]->type));
       lval_del(v);
-      return lerr("Invalid operand: %s\nExpected numbers only",
-                  v->cell[i]->type);
+      return err;
     }
   }
 
@@ -508,42 +7571,44 @@ lval *builtin_op(lenv *e, lval *v, char *sym) {
     return lerr("Modulo support is only binary");
   }
 
-  /*Take the first cell from v*/
-  lval *x = lval_pop(v, 0);
-  if (v->count == 0 && (strcmp(sym, "-") == 0)) {
-    lval_del(v);
-    x->num = -x->num;
-    return x;
+  /*Fold the operands into the first one in place. Overflow wraps, as it
+   * does in JIT-compiled code, so it is done on unsigned values */
+  lval *x = v->cell[0];
+  if (v->count == 1 && (strcmp(sym, "-") == 0)) {
+    x->num = (long)(0UL - (unsigned long)x->num);
+    return lval_take(v, 0);
   }
 
-  while (v->count > 0) {
-    lval *y = lval_pop(v, 0);
+  for (int i = 1; i < v->count; ++i) {
+    long y = v->cell[i]->num;
+    unsigned long ux = x->num, uy = y;
     if (strcmp(sym, "+") == 0) {
-      x->num += y->num;
+      x->num = (long)(ux + uy);
     }
     if (strcmp(sym, "*") == 0) {
-      x->num *= y->num;
+      x->num = (long)(ux * uy);
     }
     if (strcmp(sym, "/") == 0) {
-      if (y->num == 0)
+      if (y == 0) {
+        lval_del(v);
         return lerr("Division by zero");
-      else
-        x->num /= y->num;
+      }
+      /* LONG_MIN / -1 traps in hardware, so negate instead */
+      x->num = y == -1 ? (long)(0UL - ux) : x->num / y;
     }
     if (strcmp(sym, "-") == 0) {
-      x->num -= y->num;
+      x->num = (long)(ux - uy);
     }
     if (strcmp(sym, "%") == 0) {
-      if (y->num == 0)
+      if (y == 0) {
+        lval_del(v);
         return lerr("Division by zero");
-      else
-        x->num %= y->num;
+      }
+      x->num = y == -1 ? 0 : x->num % y;
     }
-    lval_del(y);
   }
 
-  lval_del(v);
-  return x;
+  return lval_take(v, 0);
 }
 
 lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
@@ -558,7 +7623,7 @@ lval *builtin_def(lenv *e, lval *a) {
   LASSERT_TYPE("def", LVAL_QEXPR, 0, a);
 
   /* First argument is symbol list */
-  lval *syms = a->cell[0];
+  lval *syms = lval_unpack(a->cell[0]);
 
   /* Ensure all elements of first list are symbols */
   for (int i = 0; i < syms->count; i++) {
@@ -593,9 +7658,12 @@ lval *builtin_head(lenv *e, lval *a) {
   lval *v = lval_take(a, 0);
 
   /*Delete all elements that are not head and return*/
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
+  if (!v->nums) {
+    for (int i = 1; i < v->count; i++) {
+      lval_del(v->cell[i]);
+    }
   }
+  v->count = 1;
 
   return v;
 }
@@ -621,7 +7689,7 @@ lval *builtin_tail(lenv *e, lval *a) {
 
 lval *builtin_list(lenv *e, lval *a) {
   a->type = LVAL_QEXPR;
-  return a;
+  return lval_pack(a);
 }
 
 lval *builtin_eval(lenv *e, lval *a) {
@@ -631,15 +7699,32 @@ lval *builtin_eval(lenv *e, lval *a) {
   /*Check for valid type(QExpr)*/
   LASSERT_TYPE("eval", LVAL_QEXPR, 0, a);
 
-  lval *x = lval_take(a, 0);
+  lval *x = lval_unpack(lval_take(a, 0));
   x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  return lval_eval(e, lval_expand(e, x));
 }
 
 lval *lval_join(lval *x, lval *y) {
-  /*For each cell in 'y' add it to 'x'*/
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  /*Packed lists are joined with a single copy*/
+  if (y->count && (x->nums || x->count == 0) && y->nums) {
+    /* An empty 'x' may still hold cell storage from earlier pops */
+    lfree(x->cell);
+    x->cell = NULL;
+    x->nums = lrealloc(x->nums, sizeof(long) * (x->count + y->count));
+    memcpy(&x->nums[x->count], y->nums, sizeof(long) * y->count);
+    x->count += y->count;
+    lval_del(y);
+    return x;
+  }
+
+  /*Otherwise move every cell of 'y' onto the end of 'x'*/
+  if (y->count) {
+    lval_unpack(x);
+    lval_unpack(y);
+    x->cell = lrealloc(x->cell, sizeof(lval *) * (x->count + y->count));
+    memcpy(&x->cell[x->count], y->cell, sizeof(lval *) * y->count);
+    x->count += y->count;
+    y->count = 0;
   }
 
   /*Delete the empty 'y' and return 'x'*/
@@ -663,6 +7748,657 @@ lval *builtin_join(lenv *e, lval *a) {
   return x;
 }
 
+lval *builtin_defmacro(lenv *e, lval *a) {
+  LASSERT_NUM("defmacro", 3, "QExprs", a);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("defmacro", LVAL_QEXPR, i, a);
+  }
+
+  lval *name = lval_unpack(a->cell[0]);
+  lval *formals = lval_unpack(a->cell[1]);
+  LASSERT(a, name->count == 1 && name->cell[0]->type == LVAL_SYM,
+          "Function 'defmacro' expects a single symbol as the name");
+
+  /* Formals must be symbols, with '&' only before the final one */
+  for (int i = 0; i < formals->count; i++) {
+    LASSERT(a, formals->cell[i]->type == LVAL_SYM,
+            "Function 'defmacro' cannot bind non-symbols");
+    LASSERT(a,
+            strcmp(formals->cell[i]->sym, "&") != 0 ||
+                i == formals->count - 2,
+            "Function 'defmacro' expects '&' to be followed by one symbol");
+  }
+
+  lval *params = lval_pop(a, 1);
+  lval *body = lval_pop(a, 1);
+  lval *m = lmacro(params, body);
+  lenv_put(e, name->cell[0], m);
+  lval_del(m);
+  lval_del(a);
+  return lsexpr();
+}
+
+/* Wrap a function in a result cache keyed on its arguments */
+lval *builtin_memo(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'memo' passed incorrect number of arguments: %d\n"
+          "Expected a Function and an optional capacity",
+          a->count);
+  LASSERT_TYPE("memo", LVAL_FUN, 0, a);
+
+  int capacity = LCACHE_DEFAULT_CAPACITY;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", LVAL_NUM, 1, a);
+    LASSERT(a, a->cell[1]->num > 0 && a->cell[1]->num <= 1 << 24,
+            "Function 'memo' passed invalid capacity: %li", a->cell[1]->num);
+    capacity = a->cell[1]->num;
+  }
+
+  lval *f = lval_pop(a, 0);
+  lcache_release(f->cache);
+  f->cache = lcache_new(capacity);
+  lval_del(a);
+  return f;
+}
+
+/* Report { hits misses size capacity } for a memoised function */
+lval *builtin_memo_stats(lenv *e, lval *a) {
+  LASSERT_NUM("memo-stats", 1, "Function", a);
+  LASSERT_TYPE("memo-stats", LVAL_FUN, 0, a);
+  LASSERT(a, a->cell[0]->cache != NULL,
+          "Function 'memo-stats' passed a function that is not memoised");
+
+  lcache *c = a->cell[0]->cache;
+  lval *x = lqexpr();
+  lval_add(x, lnum(c->hits));
+  lval_add(x, lnum(c->misses));
+  lval_add(x, lnum(c->count));
+  lval_add(x, lnum(c->capacity));
+  lval_del(a);
+  return x;
+}
+
+/* Template JIT for integer arithmetic forms */
+
+/* Jit modes: off, on, and verify every native result against lval_eval */
+enum { LJIT_OFF, LJIT_ON, LJIT_VERIFY };
+
+#define LJIT_MAX_VARS 64
+#define LJIT_MAX_NODES 4096
+#define LJIT_TABLE_SIZE 512
+
+/* Mode, counters and, where supported, compiled forms of an interpreter */
+typedef struct ljit_state {
+  int mode;
+  long compiled;
+  long runs;
+  long bailouts;
+  long mismatches;
+  /* LJIT_TABLE_SIZE slots */
+  struct ljit_fn *table;
+} ljit_state;
+
+#ifdef LISPY_JIT
+
+/* Generated code returns 0 and stores the result, or 1 to bail out */
+typedef int (*ljit_code)(const long *vars, long *out);
+
+typedef struct ljit_fn {
+  lform_key key;
+  /* NULL when the form was found not to be compilable */
+  ljit_code code;
+  size_t size;
+  /* Free variables, loaded by the caller into the vars array */
+  int nvars;
+  char *vars[LJIT_MAX_VARS];
+  /* Environment version at which the operators were last checked */
+  unsigned long version;
+  int checked;
+} ljit_fn;
+
+
+typedef struct ljit_buf {
+  unsigned char *code;
+  size_t len;
+  size_t cap;
+  int nodes;
+  /* Offsets of rel32 jumps to the bail-out stub */
+  size_t *bails;
+  int nbails;
+} ljit_buf;
+
+void ljit_emit(ljit_buf *b, const void *bytes, size_t n) {
+  if (b->len + n > b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 256;
+    while (b->len + n > b->cap) {
+      b->cap *= 2;
+    }
+    b->code = realloc(b->code, b->cap);
+  }
+  memcpy(b->code + b->len, bytes, n);
+  b->len += n;
+}
+
+void ljit_emit_imm64(ljit_buf *b, const char *op, long imm) {
+  ljit_emit(b, op, 2);
+  ljit_emit(b, &imm, 8);
+}
+
+void ljit_emit_disp32(ljit_buf *b, const char *op, int disp) {
+  ljit_emit(b, op, 3);
+  ljit_emit(b, &disp, 4);
+}
+
+/* Return the operator of an arithmetic form, or 0 if it is not one */
+char ljit_op(lval *v) {
+  if (v->type != LVAL_SEXPR || v->count < 2 ||
+      v->cell[0]->type != LVAL_SYM) {
+    return 0;
+  }
+  char *sym = v->cell[0]->sym;
+  if (sym[0] && sym[1] == '\0' && strchr("+-*/", sym[0])) {
+    return sym[0];
+  }
+  return 0;
+}
+
+int ljit_var(ljit_fn *f, char *sym) {
+  for (int i = 0; i < f->nvars; i++) {
+    if (strcmp(f->vars[i], sym) == 0) {
+      return i;
+    }
+  }
+  if (f->nvars == LJIT_MAX_VARS) {
+    return -1;
+  }
+  f->vars[f->nvars] = sym;
+  return f->nvars++;
+}
+
+/* Load a leaf operand into rax (reg 0) or rcx (reg 1) */
+int ljit_leaf(ljit_buf *b, ljit_fn *f, lval *v, int reg) {
+  if (v->type == LVAL_NUM) {
+    ljit_emit_imm64(b, reg ? "\x48\xb9" : "\x48\xb8", v->num);
+    return 1;
+  }
+  int i = ljit_var(f, v->sym);
+  if (i < 0) {
+    return 0;
+  }
+  ljit_emit_disp32(b, reg ? "\x48\x8b\x8f" : "\x48\x8b\x87", i * 8);
+  return 1;
+}
+
+/* Emit code leaving the value of v in rax; returns 0 if not compilable */
+int ljit_compile(ljit_buf *b, ljit_fn *f, lval *v) {
+  if (++b->nodes > LJIT_MAX_NODES) {
+    return 0;
+  }
+  if (v->type == LVAL_NUM || v->type == LVAL_SYM) {
+    return ljit_leaf(b, f, v, 0);
+  }
+  char op = ljit_op(v);
+  if (!op) {
+    return 0;
+  }
+
+  if (!ljit_compile(b, f, v->cell[1])) {
+    return 0;
+  }
+
+  /* A lone operand to '-' is negated */
+  if (v->count == 2 && op == '-') {
+    ljit_emit(b, "\x48\xf7\xd8", 3); /* neg rax */
+    return 1;
+  }
+
+  for (int i = 2; i < v->count; i++) {
+    lval *y = v->cell[i];
+    if (y->type == LVAL_NUM || y->type == LVAL_SYM) {
+      if (!ljit_leaf(b, f, y, 1)) {
+        return 0;
+      }
+    } else {
+      ljit_emit(b, "\x50", 1); /* push rax */
+      if (!ljit_compile(b, f, y)) {
+        return 0;
+      }
+      ljit_emit(b, "\x48\x89\xc1", 3); /* mov rcx, rax */
+      ljit_emit(b, "\x58", 1);         /* pop rax */
+    }
+
+    switch (op) {
+    case '+':
+      ljit_emit(b, "\x48\x01\xc8", 3); /* add rax, rcx */
+      break;
+    case '-':
+      ljit_emit(b, "\x48\x29\xc8", 3); /* sub rax, rcx */
+      break;
+    case '*':
+      ljit_emit(b, "\x48\x0f\xaf\xc1", 4); /* imul rax, rcx */
+      break;
+    case '/':
+      /* Division by zero is reported by the interpreter */
+      ljit_emit(b, "\x48\x85\xc9\x0f\x84", 5); /* test rcx, rcx; jz bail */
+      b->bails = realloc(b->bails, sizeof(size_t) * (b->nbails + 1));
+      b->bails[b->nbails++] = b->len;
+      ljit_emit(b, "\0\0\0\0", 4);
+      /* LONG_MIN / -1 would trap, so -1 divisors are left to it too */
+      ljit_emit(b, "\x48\x83\xf9\xff\x0f\x84", 6); /* cmp rcx, -1; je bail */
+      b->bails = realloc(b->bails, sizeof(size_t) * (b->nbails + 1));
+      b->bails[b->nbails++] = b->len;
+      ljit_emit(b, "\0\0\0\0", 4);
+      ljit_emit(b, "\x48\x99\x48\xf7\xf9", 5); /* cqo; idiv rcx */
+      break;
+    }
+  }
+  return 1;
+}
+
+/* Translate a form into executable memory, filling in f */
+void ljit_build(ljit_fn *f, lval *v) {
+  ljit_buf b = {NULL, 0, 0, 0, NULL, 0};
+
+  /* push rbp; mov rbp, rsp */
+  ljit_emit(&b, "\x55\x48\x89\xe5", 4);
+  int ok = ljit_compile(&b, f, v);
+
+  /* mov [rsi], rax; xor eax, eax; mov rsp, rbp; pop rbp; ret */
+  ljit_emit(&b, "\x48\x89\x06\x31\xc0\x48\x89\xec\x5d\xc3", 10);
+
+  /* bail: mov eax, 1; mov rsp, rbp; pop rbp; ret */
+  size_t bail = b.len;
+  ljit_emit(&b, "\xb8\x01\x00\x00\x00\x48\x89\xec\x5d\xc3", 10);
+  for (int i = 0; i < b.nbails; i++) {
+    int rel = (int)(bail - (b.bails[i] + 4));
+    memcpy(b.code + b.bails[i], &rel, 4);
+  }
+
+  if (ok) {
+    /* Write the code, then flip the pages to read+execute */
+    void *mem = mmap(NULL, b.len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+      memcpy(mem, b.code, b.len);
+      if (mprotect(mem, b.len, PROT_READ | PROT_EXEC) == 0) {
+        f->code = (ljit_code)mem;
+        f->size = b.len;
+        linterp_current->jit->compiled++;
+      } else {
+        munmap(mem, b.len);
+      }
+    }
+  }
+  if (!f->code) {
+    f->nvars = 0;
+  }
+  free(b.code);
+  free(b.bails);
+}
+
+void ljit_flush(void) {
+  ljit_fn *table = linterp_current->jit->table;
+  for (int i = 0; i < LJIT_TABLE_SIZE; i++) {
+    ljit_fn *f = &table[i];
+    if (f->key.form) {
+      if (f->code) {
+        munmap((void *)f->code, f->size);
+      }
+      lval_del(f->key.form);
+    }
+  }
+  memset(table, 0, sizeof(ljit_fn) * LJIT_TABLE_SIZE);
+}
+
+ljit_state *ljit_state_new(void) {
+  ljit_state *j = calloc(1, sizeof(ljit_state));
+  j->table = calloc(LJIT_TABLE_SIZE, sizeof(ljit_fn));
+  return j;
+}
+
+/* Find or compile the native code for a form */
+ljit_fn *ljit_lookup(lval *v) {
+  int fresh;
+  ljit_fn *f = lform_lookup(linterp_current->jit->table, sizeof(ljit_fn),
+                            LJIT_TABLE_SIZE, v, ljit_flush, &fresh);
+  if (fresh) {
+    ljit_build(f, f->key.form);
+  }
+  return f;
+}
+
+lval *builtin_add(lenv *e, lval *a);
+lval *builtin_sub(lenv *e, lval *a);
+lval *builtin_mul(lenv *e, lval *a);
+lval *builtin_div(lenv *e, lval *a);
+
+/* Guard against the arithmetic operators having been redefined */
+int ljit_ops_ok(lenv *e, lval *v) {
+  if (v->type != LVAL_SEXPR) {
+    return 1;
+  }
+  lval *op = lenv_peek(e, v->cell[0]->sym);
+  lbuiltin expect = NULL;
+  switch (v->cell[0]->sym[0]) {
+  case '+':
+    expect = builtin_add;
+    break;
+  case '-':
+    expect = builtin_sub;
+    break;
+  case '*':
+    expect = builtin_mul;
+    break;
+  case '/':
+    expect = builtin_div;
+    break;
+  }
+  if (!op || op->type != LVAL_FUN || op->fun != expect || op->cache) {
+    return 0;
+  }
+  for (int i = 1; i < v->count; i++) {
+    if (!ljit_ops_ok(e, v->cell[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Run v natively if possible: returns the result, or NULL to interpret */
+lval *ljit_eval(lenv *e, lval *v) {
+  if (!ljit_op(v)) {
+    return NULL;
+  }
+  ljit_state *j = linterp_current->jit;
+  ljit_fn *f = ljit_lookup(v);
+  if (!f->code) {
+    return NULL;
+  }
+
+  /* Names bound by match may hide an operator, and are not versioned, nor
+   * are defs made in an environment e was shared from */
+  int ok;
+  if (linterp_current->scope || e->parent) {
+    ok = ljit_ops_ok(e, f->key.form);
+  } else {
+    if (!f->checked || f->version != e->version) {
+      f->checked = ljit_ops_ok(e, f->key.form);
+      f->version = e->version;
+    }
+    ok = f->checked;
+  }
+  if (!ok) {
+    j->bailouts++;
+    return NULL;
+  }
+
+  /* Type guard: every variable must currently be bound to a number */
+  long vars[LJIT_MAX_VARS];
+  for (int i = 0; i < f->nvars; i++) {
+    lval *x = lenv_peek(e, f->vars[i]);
+    if (!x || x->type != LVAL_NUM) {
+      j->bailouts++;
+      return NULL;
+    }
+    vars[i] = x->num;
+  }
+
+  long out;
+  if (f->code(vars, &out)) {
+    j->bailouts++;
+    return NULL;
+  }
+  j->runs++;
+
+  if (j->mode == LJIT_VERIFY) {
+    /* Differential check against the tree-walking interpreter */
+    j->mode = LJIT_OFF;
+    lval *ref = lval_eval(e, v);
+    j->mode = LJIT_VERIFY;
+    if (ref->type != LVAL_NUM || ref->num != out) {
+      j->mismatches++;
+      lval_del(ref);
+      return lerr("JIT result %li differs from interpreter", out);
+    }
+    lval_del(ref);
+    return lnum(out);
+  }
+
+  lval_del(v);
+  return lnum(out);
+}
+
+#else
+
+lval *ljit_eval(lenv *e, lval *v) { return NULL; }
+void ljit_flush(void) {}
+ljit_state *ljit_state_new(void) { return calloc(1, sizeof(ljit_state)); }
+
+#endif
+
+/* Free the JIT state of the current interpreter */
+void ljit_state_del(ljit_state *j) {
+  ljit_flush();
+  free(j->table);
+  free(j);
+}
+
+/* Turn the JIT of the current interpreter off and forget its counts */
+void ljit_reset(ljit_state *j) {
+  ljit_flush();
+  j->mode = LJIT_OFF;
+  j->compiled = 0;
+  j->runs = 0;
+  j->bailouts = 0;
+  j->mismatches = 0;
+}
+
+/* Set the JIT mode, returning { compiled runs bailouts mismatches } */
+lval *builtin_jit(lenv *e, lval *a) {
+  LASSERT_NUM("jit", 1, "Number", a);
+  LASSERT_TYPE("jit", LVAL_NUM, 0, a);
+  LASSERT(a, a->cell[0]->num >= LJIT_OFF && a->cell[0]->num <= LJIT_VERIFY,
+          "Function 'jit' expects 0 (off), 1 (on) or 2 (verify)");
+#ifndef LISPY_JIT
+  LASSERT(a, a->cell[0]->num == LJIT_OFF,
+          "Function 'jit' is not supported on this platform");
+#endif
+
+  ljit_state *j = linterp_current->jit;
+  j->mode = a->cell[0]->num;
+  if (j->mode == LJIT_OFF) {
+    ljit_flush();
+  }
+
+  lval *x = lqexpr();
+  lval_add(x, lnum(j->compiled));
+  lval_add(x, lnum(j->runs));
+  lval_add(x, lnum(j->bailouts));
+  lval_add(x, lnum(j->mismatches));
+  lval_del(a);
+  return x;
+}
+
+/* Turn hash-consing of literals read from now on off or on, returning
+ * { literals shared bytes-unshared bytes-shared } */
+lval *builtin_hashcons(lenv *e, lval *a) {
+  LASSERT_NUM("hashcons", 1, "Number", a);
+  LASSERT_TYPE("hashcons", LVAL_NUM, 0, a);
+  LASSERT(a, a->cell[0]->num == 0 || a->cell[0]->num == 1,
+          "Function 'hashcons' expects 0 (off) or 1 (on)");
+
+  lhcons_table *t = linterp_current->hcons;
+  t->enabled = a->cell[0]->num;
+  lval *x = lqexpr();
+  lval_add(x, lnum(t->literals));
+  lval_add(x, lnum(t->hits));
+  lval_add(x, lnum(t->unshared));
+  lval_add(x, lnum(t->shared));
+  lval_del(a);
+  return x;
+}
+
+/* Parallel evaluation of arguments
+ *
+ * When on, a call to a pure builtin whose arguments include at least two
+ * costly subexpressions, themselves built only from pure builtins, has
+ * its arguments evaluated as a job on the pmap pool. Such arguments
+ * cannot see each other's effects, and the builtin still gets them in
+ * order and reports the first error, so the result is the same as
+ * evaluating them one after another.
+ */
+
+#define LPAR_DEFAULT_COST 10000
+
+/* Builtins with no effects beyond their result */
+static lbuiltin lpar_pure[] = {
+    builtin_list, builtin_head, builtin_tail, builtin_join, builtin_array,
+    builtin_tolist, builtin_shape, builtin_reshape, builtin_transpose,
+    builtin_matmul, builtin_sum, builtin_prod, builtin_min, builtin_max,
+    builtin_strlen, builtin_concat, builtin_substr, builtin_search,
+    builtin_split, builtin_dict, builtin_pdict, builtin_get, builtin_put,
+    builtin_remove, builtin_keys, builtin_size, builtin_omap, builtin_oset,
+    builtin_range, builtin_sort, builtin_sort_stable, builtin_typeof,
+    builtin_bitset, builtin_members, builtin_contains, builtin_popcount,
+    builtin_union, builtin_intersect, builtin_difference, builtin_add,
+    builtin_sub, builtin_mul, builtin_div};
+
+/* Whether the call v has no effects: a pure builtin, a record function,
+ * or sort without a comparator, which might be memoised */
+int lpar_pure_call(lenv *e, lval *v) {
+  if (v->cell[0]->type != LVAL_SYM ||
+      (linterp_current->scope && lmatch_peek(e, v->cell[0]->sym))) {
+    return 0;
+  }
+  lval *f = lenv_peek(e, v->cell[0]->sym);
+  if (!f || f->type != LVAL_FUN || f->cache) {
+    return 0;
+  }
+  if (f->rec) {
+    return 1;
+  }
+  if ((f->fun == builtin_sort || f->fun == builtin_sort_stable) &&
+      v->count != 2) {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(lpar_pure) / sizeof(lpar_pure[0]); i++) {
+    if (f->fun == lpar_pure[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Rough size of the data in v */
+long lpar_size(lval *v) {
+  switch (v->type) {
+  case LVAL_ARRAY:
+    return v->arr->size;
+  case LVAL_BITS:
+    return v->bits->nwords;
+  case LVAL_STR:
+    return v->len / 8;
+  case LVAL_MAP:
+    return v->map->count;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    return v->count;
+  default:
+    return 0;
+  }
+}
+
+/* Estimated cost of evaluating v, counting the data each call touches,
+ * or -1 if evaluating it might have an effect */
+long lpar_cost(lenv *e, lval *v) {
+  if (v->type == LVAL_SYM) {
+    /* Names bound by match can only be read on this thread */
+    if (linterp_current->scope && lmatch_peek(e, v->sym)) {
+      return -1;
+    }
+    lval *x = lenv_peek(e, v->sym);
+    return 1 + (x ? lpar_size(x) : 0);
+  }
+  if (v->type != LVAL_SEXPR) {
+    return 1 + lpar_size(v);
+  }
+  if (v->count == 0) {
+    return 1;
+  }
+  if (!lpar_pure_call(e, v)) {
+    return -1;
+  }
+  long cost = 1;
+  for (int i = 1; i < v->count; i++) {
+    long c = lpar_cost(e, v->cell[i]);
+    if (c < 0) {
+      return -1;
+    }
+    cost += c;
+  }
+  return cost;
+}
+
+/* Evaluate the children of v in parallel if that is worth it and safe,
+ * returning 1 if it did */
+int lpar_eval(lenv *e, lval *v) {
+  if (!lpar_pure_call(e, v)) {
+    return 0;
+  }
+  linterp *li = linterp_current;
+  int costly = 0;
+  for (int i = 1; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_SEXPR) {
+      continue;
+    }
+    long c = lpar_cost(e, v->cell[i]);
+    if (c < 0) {
+      return 0;
+    }
+    costly += c >= li->par_threshold;
+  }
+  lpool *p = costly >= 2 ? lpool_get() : NULL;
+  if (!p) {
+    return 0;
+  }
+
+  ljob j = {e, NULL, v, LJOB_EVAL, v->count, 1, v->count};
+  j.out = calloc(v->count, sizeof(lval *));
+  lpool_run(p, &j);
+  for (int i = 0; i < v->count; i++) {
+    lval_del(v->cell[i]);
+    v->cell[i] = j.out[i];
+  }
+  free(j.out);
+  li->par_calls++;
+  return 1;
+}
+
+/* (parargs 0|1 [cost]) turns parallel evaluation of arguments costing at
+ * least cost off or on, returning { calls cost }, with a cost of 0 when
+ * off */
+lval *builtin_parargs(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'parargs' passed incorrect number of arguments: %d\n"
+          "Expected 0 or 1 and an optional cost",
+          a->count);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("parargs", LVAL_NUM, i, a);
+  }
+  LASSERT(a, a->cell[0]->num == 0 || a->cell[0]->num == 1,
+          "Function 'parargs' expects 0 (off) or 1 (on)");
+  long cost = a->count == 2 ? a->cell[1]->num : LPAR_DEFAULT_COST;
+  LASSERT(a, cost > 0, "Function 'parargs' expects a positive cost");
+
+  linterp *li = linterp_current;
+  li->par_threshold = a->cell[0]->num ? cost : 0;
+  lval *x = lqexpr();
+  lval_add(x, lnum(li->par_calls));
+  lval_add(x, lnum(li->par_threshold));
+  lval_del(a);
+  return x;
+}
+
 lval *builtin(lenv *e, lval *a, char *func) {
   if (strcmp("list", func) == 0) {
     return builtin_list(e, a);
@@ -702,6 +8438,83 @@ void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
   lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "defmacro", builtin_defmacro);
+
+  /* Memoisation */
+  lenv_add_builtin(e, "memo", builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+  /* Numeric arrays */
+  lenv_add_builtin(e, "array", builtin_array);
+  lenv_add_builtin(e, "tolist", builtin_tolist);
+  lenv_add_builtin(e, "shape", builtin_shape);
+  lenv_add_builtin(e, "reshape", builtin_reshape);
+  lenv_add_builtin(e, "transpose", builtin_transpose);
+  lenv_add_builtin(e, "matmul", builtin_matmul);
+  lenv_add_builtin(e, "sum", builtin_sum);
+  lenv_add_builtin(e, "prod", builtin_prod);
+  lenv_add_builtin(e, "min", builtin_min);
+  lenv_add_builtin(e, "max", builtin_max);
+
+  /* Strings */
+  lenv_add_builtin(e, "strlen", builtin_strlen);
+  lenv_add_builtin(e, "concat", builtin_concat);
+  lenv_add_builtin(e, "substr", builtin_substr);
+  lenv_add_builtin(e, "search", builtin_search);
+  lenv_add_builtin(e, "split", builtin_split);
+
+  /* Maps */
+  lenv_add_builtin(e, "dict", builtin_dict);
+  lenv_add_builtin(e, "pdict", builtin_pdict);
+  lenv_add_builtin(e, "get", builtin_get);
+  lenv_add_builtin(e, "put", builtin_put);
+  lenv_add_builtin(e, "remove", builtin_remove);
+  lenv_add_builtin(e, "keys", builtin_keys);
+  lenv_add_builtin(e, "size", builtin_size);
+  lenv_add_builtin(e, "omap", builtin_omap);
+  lenv_add_builtin(e, "oset", builtin_oset);
+  lenv_add_builtin(e, "range", builtin_range);
+
+  /* Sorting */
+  lenv_add_builtin(e, "sort", builtin_sort);
+  lenv_add_builtin(e, "sort-stable", builtin_sort_stable);
+
+  /* Records */
+  lenv_add_builtin(e, "defrecord", builtin_defrecord);
+  lenv_add_builtin(e, "typeof", builtin_typeof);
+
+  /* Pattern matching */
+  lenv_add_builtin(e, "match", builtin_match);
+
+  /* Bitsets */
+  lenv_add_builtin(e, "bitset", builtin_bitset);
+  lenv_add_builtin(e, "members", builtin_members);
+  lenv_add_builtin(e, "contains", builtin_contains);
+  lenv_add_builtin(e, "popcount", builtin_popcount);
+  lenv_add_builtin(e, "union", builtin_union);
+  lenv_add_builtin(e, "intersect", builtin_intersect);
+  lenv_add_builtin(e, "difference", builtin_difference);
+
+  /* Parallelism */
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "reduce", builtin_reduce);
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "future", builtin_future);
+  lenv_add_builtin(e, "touch", builtin_touch);
+  lenv_add_builtin(e, "await", builtin_await);
+  lenv_add_builtin(e, "cancel", builtin_cancel);
+  lenv_add_builtin(e, "spawn", builtin_spawn);
+  lenv_add_builtin(e, "chan", builtin_chan);
+  lenv_add_builtin(e, "send", builtin_send);
+  lenv_add_builtin(e, "recv", builtin_recv);
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "close", builtin_close);
+
+  /* Native code generation */
+  lenv_add_builtin(e, "jit", builtin_jit);
+  lenv_add_builtin(e, "hashcons", builtin_hashcons);
+  lenv_add_builtin(e, "parargs", builtin_parargs);
 
   /* Mathematical Functions */
 
@@ -712,11 +8525,45 @@ void lenv_add_builtins(lenv *e) {
 }
 
 lval *lval_eval_sexpr(lenv *e, lval *v) {
+  /* A cancelled future stops at its next evaluation */
+  int *cancel = linterp_current->cancel;
+  if (cancel && LATOMIC_LOAD(cancel)) {
+    lval_del(v);
+    return lerr("Future cancelled");
+  }
+
+  /*Arithmetic on numbers may run as native code*/
+  if (linterp_current->jit->mode != LJIT_OFF) {
+    lval *x = ljit_eval(e, v);
+    if (x) {
+      return x;
+    }
+  }
+
+  /* Costly arguments of a pure builtin may be evaluated in parallel */
+  if (linterp_current->par_threshold && v->count > 2 && lpar_eval(e, v)) {
+    return lval_apply(e, v);
+  }
+
   /*Evaluate Children*/
   for (int i = 0; i < v->count; ++i) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
 
+  return lval_apply(e, v);
+}
+
+/* Apply an Sexpr whose children have already been evaluated */
+/* Call a function value on its evaluated arguments */
+lval *lval_call(lenv *e, lval *f, lval *a) {
+  lval_thaw_args(a);
+  if (f->rec) {
+    return lrecord_apply(f, a);
+  }
+  return f->fun(e, a);
+}
+
+lval *lval_apply(lenv *e, lval *v) {
   /*Error Checking */
   for (int i = 0; i < v->count; ++i) {
     if (v->cell[i]->type == LVAL_ERR) {
@@ -742,8 +8589,27 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
     return lerr("fist element is not a function");
   }
 
+  /* Memoised functions answer repeated arguments from their cache */
+  if (f->cache) {
+    lval *hit = lcache_get(f->cache, v);
+    if (hit) {
+      lval_del(f);
+      lval_del(v);
+      return lval_copy(hit);
+    }
+    lval *key = lval_copy(v);
+    lval *result = lval_call(e, f, v);
+    if (result->type != LVAL_ERR) {
+      lcache_put(f->cache, key, lval_copy(result));
+    } else {
+      lval_del(key);
+    }
+    lval_del(f);
+    return result;
+  }
+
   /* If so call function to get result */
-  lval *result = f->fun(e, v);
+  lval *result = lval_call(e, f, v);
   lval_del(f);
   return result;
 }
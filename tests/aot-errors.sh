@@ -0,0 +1,30 @@
+#!/bin/sh
+# Check that errors made while compiling, such as bad macro calls expanded
+# by lispyc, print the same in the compiled program as in the interpreter.
+# Usage: tests/aot-errors.sh   (run from the repository root after build.sh)
+set -e
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/errors.lsp" <<'LSP'
+(defmacro {sq} {x} {* x x})
+(sq 3)
+(sq)
+(+ 1 (sq))
+{(sq)}
+(defmacro {loop} {x} {loop x})
+(loop 1)
+(defmacro {quoted} {x} {x "a\"b"})
+(quoted)
+LSP
+
+./parsing "$DIR/errors.lsp" > "$DIR/interpreted.out"
+./lispyc -o "$DIR/errors" "$DIR/errors.lsp"
+"$DIR/errors" > "$DIR/compiled.out"
+
+diff "$DIR/interpreted.out" "$DIR/compiled.out" || {
+  echo "compiled errors differ" >&2
+  exit 1
+}
+echo "ok"
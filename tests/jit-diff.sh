@@ -0,0 +1,85 @@
+#!/bin/sh
+# Check that generated arithmetic prints the same with the JIT off, on and
+# verifying against the interpreter, including overflow-adjacent values,
+# division by zero and operands that are not numbers.
+# Usage: tests/jit-diff.sh [forms] [seed]   (run from the repository root after build.sh)
+set -e
+
+FORMS=${1:-2000}
+SEED=${2:-1}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+echo "(jit 1)" > "$DIR/probe.lsp"
+if ./parsing "$DIR/probe.lsp" | grep -q "not supported"; then
+  echo "skipped: no JIT on this platform"
+  exit 0
+fi
+
+# Random + - * / forms over literals and variables. Each form is printed
+# twice so the second run reuses the compiled code, and the whole batch
+# is repeated with b rebound to a String so the type guards bail out.
+awk -v forms="$FORMS" -v seed="$SEED" '
+  BEGIN {
+    srand(seed)
+    split("0 1 -1 2 -2 7 -7 1000003 -1000003 4294967296 -4294967296 " \
+          "3037000499 3037000500 -3037000500 9223372036854775807 " \
+          "9223372036854775806 -9223372036854775807 -9223372036854775808 " \
+          "a b c d z", leaf, " ")
+    nleaf = length(leaf)
+    split("+ - * /", op, " ")
+    split("s|q|\"x\"|{1 2}", odd, "|")
+    for (i = 0; i < forms; i++) {
+      batch[i] = expr(0)
+    }
+    print "(def {a b c d z s q} 7 -3 9223372036854775807 -9223372036854775808 0 \"s\" {1})"
+    emit()
+    print "(def {b} \"now a String\")"
+    emit()
+    print "(def {b} -3)"
+    emit()
+  }
+  function emit(  i) {
+    for (i = 0; i < forms; i++) {
+      print batch[i]
+      print batch[i]
+    }
+  }
+  function expr(depth,  n, s, i) {
+    if (depth > 0 && rand() < 0.02) {
+      return odd[int(rand() * 4) + 1]
+    }
+    if (depth >= 3 || (depth > 0 && rand() < 0.5)) {
+      return leaf[int(rand() * nleaf) + 1]
+    }
+    n = int(rand() * 3) + 1
+    s = "(" op[int(rand() * 4) + 1]
+    for (i = 0; i < n; i++) {
+      s = s " " expr(depth + 1)
+    }
+    return s ")"
+  }
+' > "$DIR/forms.lsp"
+
+for mode in 0 1 2; do
+  { echo "(jit $mode)"; cat "$DIR/forms.lsp"; echo "(jit $mode)"; } > "$DIR/jit$mode.lsp"
+  ./parsing "$DIR/jit$mode.lsp" > "$DIR/jit$mode.out"
+  # { compiled runs bailouts mismatches } from the closing (jit) call
+  tail -n 1 "$DIR/jit$mode.out" > "$DIR/jit$mode.stats"
+  sed -i '1d;$d' "$DIR/jit$mode.out"
+done
+
+for mode in 1 2; do
+  cmp -s "$DIR/jit0.out" "$DIR/jit$mode.out" || {
+    echo "(jit $mode) output differs from (jit 0):" >&2
+    diff "$DIR/jit0.out" "$DIR/jit$mode.out" | head -n 20 >&2
+    exit 1
+  }
+done
+
+set -- $(cat "$DIR/jit1.stats")
+[ "$3" -gt 0 ] || {
+  echo "(jit 1) ran no forms natively" >&2
+  exit 1
+}
+echo "ok: $FORMS forms, $2 compiled, $3 native runs, $4 bailouts"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Check that match binds sub-terms as data: symbols and S-expressions in the
+# scrutinee are never evaluated, and quoted bodies are left as written.
+# Usage: tests/match.sh   (run from the repository root after build.sh)
+set -e
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/match.lsp" <<'LSP'
+(match {a b} {{x y} (list x y)})
+(match {(+ 1 2)} {{y} (list y)})
+(def {x} 3)
+(match {1 2 {3 x}} {{p q {r z}} z})
+(match {1 2 {3 x}} {{p q {r z}} (list p q r z)})
+(match {a b c} {{h & t} t})
+(match {1 2 3 4} {{a & r} (list a r)})
+(match {1 2} {{a b} {a b}})
+(match {1 2} {{a b} (match {b a} {{c d} (list a b c d)})})
+(match 3 {+ (list +)})
+(+ 1 2)
+x
+LSP
+
+cat > "$DIR/expected.out" <<'OUT'
+{ a b }
+{ ( + 1 2 ) }
+(  )
+x
+{ 1 2 3 x }
+{ b c }
+{ 1 { 2 3 4 } }
+{ a b }
+{ 1 2 b a }
+{ 3 }
+3
+3
+OUT
+
+./parsing "$DIR/match.lsp" > "$DIR/match.out"
+diff "$DIR/expected.out" "$DIR/match.out" || {
+  echo "match output differs" >&2
+  exit 1
+}
+echo "ok"